@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+void arena_measure(arena_t *arena) {
+	*arena = (arena_t) { NULL, SIZE_MAX, 0 };
+}
+
+int arena_create(arena_t *arena, size_t size) {
+	*arena = (arena_t) { NULL, 0, 0 };
+	if (size == 0) {
+		return -1;
+	}
+
+	// Small arenas take whole normal pages
+	if (size < ARENA_HUGE_PAGE) {
+		void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			return -1;
+		}
+		*arena = (arena_t) { base, size, 0 };
+		return 1;
+	}
+
+	// Map a huge page more than asked for and unmap the ends, so that the arena
+	// starts and ends on huge page boundaries
+	size = (size + ARENA_HUGE_PAGE - 1) & ~((size_t) ARENA_HUGE_PAGE - 1);
+	uint8_t *mapped = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED) {
+		return -1;
+	}
+	uint8_t *base = (uint8_t *) (((uintptr_t) mapped + ARENA_HUGE_PAGE - 1) & ~((uintptr_t) ARENA_HUGE_PAGE - 1));
+	if (base > mapped) {
+		munmap(mapped, base - mapped);
+	}
+	munmap(base + size, mapped + ARENA_HUGE_PAGE - base);
+
+	// Huge pages are only a hint: without them the arena is backed by normal pages
+#ifdef MADV_HUGEPAGE
+	madvise(base, size, MADV_HUGEPAGE);
+#endif
+	*arena = (arena_t) { base, size, 0 };
+	return 1;
+}
+
+void *arena_carve(arena_t *arena, size_t size, size_t align) {
+	size_t start = (arena->used + align - 1) & ~(align - 1);
+	if (start > arena->size || size > arena->size - start) {
+		return NULL;
+	}
+	arena->used = start + size;
+	return arena->base == NULL ? NULL : arena->base + start;
+}
+
+void arena_destroy(arena_t *arena) {
+	if (arena->base != NULL) {
+		munmap(arena->base, arena->size);
+	}
+	*arena = (arena_t) { NULL, 0, 0 };
+}
@@ -0,0 +1,39 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A region of memory mapped in one go and carved into pieces that are never
+ * freed one by one; the whole region is unmapped at once. Regions of at
+ * least ARENA_HUGE_PAGE bytes start on a huge page boundary and are advised
+ * to be backed by transparent huge pages (MADV_HUGEPAGE), so that a large
+ * cache takes few TLB entries; where huge pages are not available the
+ * region is made of normal pages. Memory comes zeroed.
+ *
+ * Sizes are worked out by carving from an arena created with
+ * arena_measure, which hands out no memory and only adds up what was
+ * asked for, before carving the same pieces from the real arena. */
+
+#define ARENA_HUGE_PAGE (2u << 20)
+
+typedef struct {
+  uint8_t *base;   /* NULL while measuring */
+  size_t size;
+  size_t used;
+} arena_t;
+
+/* Starts measuring how large an arena the following carves need. */
+void arena_measure(arena_t *arena);
+
+/* Returns 1 on success and -1 on failure. Maps an arena of |size| bytes. */
+int arena_create(arena_t *arena, size_t size);
+
+/* Returns |size| bytes of the arena aligned to |align|, a power of two, or
+ * NULL if they do not fit or the arena is only measuring. */
+void *arena_carve(arena_t *arena, size_t size, size_t align);
+
+/* Unmaps the arena; an arena that was never mapped is ignored. */
+void arena_destroy(arena_t *arena);
+
+#endif
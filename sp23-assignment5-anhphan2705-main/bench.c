@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "util.h"
+
+#define BENCH_ARGUMENTS "hn:d:a:p:S:t:m:"
+#define USAGE                                                  \
+  "USAGE: bench [-h] [-n lookups] [-d disks] [-a ways] [-p policy] [-S shards] [-t threads] [-m max_size]\n" \
+  "\n"                                                         \
+  "where:\n"                                                   \
+  "    -h - help mode (display this message)\n"                \
+  "    -n - number of lookups timed per cache size (default 1000000)\n" \
+  "    -d - disks the cached blocks are spread over (default 16)\n" \
+  "    -a - ways per set of a set-associative cache (default 0, fully associative)\n" \
+  "    -p - eviction policy of a fully associative cache, lru (default) or arc\n" \
+  "    -S - number of independently locked cache shards (default 1)\n" \
+  "    -t - threads timing the hits, each doing -n lookups (default 1)\n" \
+  "    -m - largest cache size timed (default 4096)\n"       \
+  "\n"                                                         \
+  "Times cache_lookup hits and misses and evicting cache_inserts for every\n" \
+  "cache size from 2 up to the largest size. With several threads\n"  \
+  "the hit column is the wall time divided by the lookups of all threads.\n"
+
+/* shared with the hit threads */
+static int *order;
+static int lookups = 1000000, disks = JBOD_NUM_DISKS;
+static int hits;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* looks up |lookups| cached blocks, starting at its own point in |order| */
+static void *hit_worker(void *arg) {
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	int start = (int) (intptr_t) arg, found = 0;
+
+	for (int i = 0; i < lookups; i++) {
+		int k = order[(start + i) % lookups];
+		found += cache_lookup(k % disks, k / disks, buf) == 1;
+	}
+	__atomic_fetch_add(&hits, found, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* fills a cache of |config->num_entries| entries and prints the cost of
+ * |lookups| hits per thread, as many misses and as many evicting inserts */
+static int bench_size(const cache_config_t *config, int threads) {
+	int cache_size = config->num_entries;
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	pthread_t tids[threads];
+	uint64_t start, hit_ns, miss_ns, evict_ns;
+
+	if (cache_create_with(config) != 1) {
+		return -1;
+	}
+
+	// Spread the cached blocks over the disks
+	memset(buf, 0, JBOD_BLOCK_SIZE);
+	for (int i = 0; i < cache_size; i++) {
+		cache_insert(i % disks, i / disks, buf);
+	}
+
+	// Draw the scattered lookup order up front so it is not timed
+	order = malloc(lookups * sizeof(int));
+	if (order == NULL) {
+		cache_destroy();
+		return -1;
+	}
+	for (int i = 0; i < lookups; i++) {
+		order[i] = get_rand(0, cache_size - 1);
+	}
+
+	// Time lookups of cached blocks from every thread at once
+	hits = 0;
+	start = now_ns();
+	for (int t = 0; t < threads; t++) {
+		if (pthread_create(&tids[t], NULL, hit_worker, (void *) (intptr_t) (t * (lookups / threads))) != 0) {
+			errx(1, "cannot start hit thread %d", t);
+		}
+	}
+	for (int t = 0; t < threads; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	hit_ns = now_ns() - start;
+
+	// Time lookups of blocks that were never inserted
+	start = now_ns();
+	for (int i = 0; i < lookups; i++) {
+		int k = cache_size + order[i];
+		hits += cache_lookup(k % disks, k / disks, buf) == 1;
+	}
+	miss_ns = now_ns() - start;
+
+	// Time inserts of new blocks, each of which evicts one
+	start = now_ns();
+	for (int i = 0; i < lookups; i++) {
+		int k = cache_size + i;
+		cache_insert(k % disks, k / disks, buf);
+	}
+	evict_ns = now_ns() - start;
+
+	printf("%6d %12.1f %12.1f %12.1f %10d\n", cache_size, (double) hit_ns / ((double) lookups * threads),
+	       (double) miss_ns / lookups, (double) evict_ns / lookups, hits);
+
+	free(order);
+	cache_destroy();
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	int ch, threads = 1, max_size = 4096;
+	cache_config_t config = { .ways = 0, .policy = CACHE_POLICY_LRU, .shards = 1 };
+
+	while ((ch = getopt(argc, argv, BENCH_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h':
+			fprintf(stderr, USAGE);
+			return 0;
+		case 'n':
+			lookups = atoi(optarg);
+			break;
+		case 'd':
+			disks = atoi(optarg);
+			break;
+		case 'a':
+			config.ways = atoi(optarg);
+			break;
+		case 'p':
+			config.policy = cache_policy_by_name(optarg);
+			if ((int) config.policy == -1) {
+				errx(1, "unknown cache policy %s", optarg);
+			}
+			break;
+		case 'S':
+			config.shards = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'm':
+			max_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return -1;
+		}
+	}
+	if (lookups <= 0 || disks <= 0 || config.ways < 0 || config.shards <= 0 || threads <= 0) {
+		errx(1, "lookups, disks, shards and threads must be positive and ways not negative");
+	}
+
+	// Double the cache size, starting from one full set per shard, up to the largest
+	// size or until cache_create refuses it
+	printf("%6s %12s %12s %12s %10s\n", "size", "hit ns/op", "miss ns/op", "evict ns/op", "hits");
+	for (config.num_entries = (config.ways > 2 ? config.ways : 2) * config.shards;
+	     config.num_entries <= max_size && bench_size(&config, threads) == 1; config.num_entries *= 2)
+		;
+
+	return 0;
+}
@@ -1,32 +1,1779 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "cache.h"
 #include "jbod.h"
+#include "tinylfu.h"
+#include "mrc.h"
+#include "arena.h"
+#include "ztier.h"
 
-static cache_entry_t *cache = NULL;
+/* index from (disk_num, block_num) to the cache entry holding it, laid out as
+ * groups of INDEX_GROUP slots probed one group at a time. index_tags holds a
+ * 16-bit fingerprint of each slot's key so that a whole group is matched with
+ * a couple of vector compares; index_slots holds the entry number the slot
+ * points at. */
+#define INDEX_GROUP 16
+#define TAG_EMPTY 0
+#define TAG_DELETED 1
+
+/* the admission window of W-TinyLFU, an LRU list of the newest blocks; a
+ * block pushed out of it only moves on to the policy's part of the cache if
+ * the sketch says it is used more often than the block it would evict. The
+ * window gets WINDOW_PERCENT of the blocks, more than the 1% TinyLFU starts
+ * with, since with the cache sizes used here 1% is often a single block and
+ * the array workloads reuse recently written blocks a lot. */
+#define WINDOW_PERCENT 10
+
+/* alignment of the payload slab within a shard's arena */
+#define SLAB_ALIGN 4096
+
+/* payload slots each shard keeps aside so that blocks held by
+ * cache_get_ref need not be overwritten; also the most blocks of a shard
+ * that can be held at once */
+#define SHARD_SPARE_SLOTS 8
+
+/* set in slot_refs once a held slot no longer belongs to an entry */
+#define SLOT_ORPHAN 0x80000000u
+
+/* most entries a single insert or update changes */
+#define SHARD_MAX_DIRTY 8
+
+/* the file cache_save writes: a header, then one record per cached block in
+ * the order the block's shard would evict them, the first to go first, so
+ * that inserting the records in file order leaves the last one the most
+ * recently used. Fields are in host byte order, and every record carries a
+ * checksum of the rest of it. */
+#define CACHE_FILE_MAGIC "jbodcach"
+#define CACHE_FILE_VERSION 1
+#define RECORD_ADMITTED 1    /* held by the policy rather than the window */
+#define RECORD_REFERENCED 2  /* hit since the policy last looked at it */
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t num_records;
+} cache_file_header_t;
+
+typedef struct {
+	int32_t disk_num;
+	int32_t block_num;
+	uint32_t flags;
+	uint32_t checksum;
+	uint8_t block[JBOD_BLOCK_SIZE];
+} cache_file_record_t;
+
+/* a recency list threaded through the entries by number: head is the most
+ * and tail the least recently used entry, -1 ends the list */
+typedef struct {
+	int head;
+	int tail;
+	int len;
+} cache_list_t;
+
+/* ARC (Megiddo and Modha, "ARC: A Self-Tuning, Low Overhead Replacement
+ * Cache") splits the cached blocks into t1, seen once recently, and t2, seen
+ * at least twice, and remembers the keys of blocks evicted from each in the
+ * ghost lists b1 and b2. A miss that hits a ghost list moves arc_p, the
+ * target size of t1, towards the list that would have kept the block. A scan
+ * only ever cycles through t1, so the blocks in t2 survive it. Hits are
+ * taken as CAR (Bansal and Modha, "CAR: Clock with Adaptive Replacement")
+ * takes them: a referenced block about to be evicted from either list moves
+ * to the head of t2 instead. */
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2 };
+
+/* one shard of the cache. Blocks are spread over the shards by the hash of
+ * their address, and each shard is a complete cache of its own, guarded by
+ * its own lock. */
+typedef struct {
+	pthread_mutex_t lock;
+
+	/* the directory of cached blocks, one dense array per field. entry_disk
+	 * is -1 while an entry is unused; entry_data is the payload slot holding
+	 * the entry's block, or -1 for an entry a policy keeps without data */
+	int *entry_disk;
+	int *entry_block;
+	int *entry_data;
+	int num_entries;
+
+	/* lookups read hits without the lock. entry_seq is odd while a writer
+	 * holding the lock changes the entry's key, payload slot or block, so a
+	 * reader that sees the same even number before and after copying a block
+	 * copied it whole; the writer's entries stay odd until it unlocks, listed
+	 * in dirty. A hit only sets entry_ref, the entry's CLOCK reference bit,
+	 * and whoever next looks for a victim moves referenced entries on in
+	 * place of the hit. */
+	uint32_t *entry_seq;
+	uint8_t *entry_ref;
+	int dirty[SHARD_MAX_DIRTY];
+	int num_dirty;
+
+	/* the shard's count of blocks inserted when each entry's block was, to
+	 * tell the age of blocks at eviction */
+	uint32_t *entry_born;
+	uint32_t insert_clock;
+
+	/* block payloads, size blocks in a page-aligned slab, so that a block
+	 * never shares a cache line with another and the payloads never share a
+	 * page with the metadata */
+	uint8_t (*blocks)[JBOD_BLOCK_SIZE];
+	int size;
+
+	/* the one mapping every array of the shard is carved from */
+	arena_t arena;
+
+	/* blocks held by cache_get_ref. The slab has num_slots payload slots,
+	 * SHARD_SPARE_SLOTS more than blocks, the extra ones stacked in
+	 * spare_slots. slot_refs counts the refs to each slot; a writer about to
+	 * overwrite a held slot gives its entry a spare slot instead, leaving
+	 * the held one orphaned until its last ref is put, when it becomes a
+	 * spare. A slot is only held while there are more spares than held
+	 * slots still in use (held_live), so that a spare is always there.
+	 * num_held counts the held slots, orphans included. */
+	uint32_t *slot_refs;
+	int *spare_slots;
+	int num_spare;
+	int num_slots;
+	int held_live;
+	int num_held;
+
+	/* blocks pinned by cache_pin, which are never evicted. A pinned entry is
+	 * taken off its recency list, or passed over in its set, until unpinned;
+	 * at most max_pins of the shard's blocks are pinned at once, policy_pins
+	 * of them in the policy's part of the cache */
+	uint8_t *entry_pinned;
+	int num_pins;
+	int max_pins;
+	int policy_pins;
+
+	/* blocks and directory entries managed by the policy; with the TinyLFU
+	 * admission window, the last window_size entries and payload slots are
+	 * the window's instead */
+	int policy_size;
+	int policy_entries;
+	int window_size;
+
+	/* set-associative mode: when ways is non-zero the entries form num_sets
+	 * sets of ways consecutive entries, a block may only live in the set its
+	 * hash selects, and entry_stamp orders the entries of a set by last use
+	 * in place of the policy and the index */
+	int ways;
+	uint32_t num_sets;
+	uint32_t *entry_stamp;
+	uint32_t set_clock;
+
+	uint16_t *index_tags;
+	int *index_slots;
+	uint32_t index_group_mask;
+	int index_deleted;
+
+	/* links of the recency lists */
+	int *entry_prev;
+	int *entry_next;
+
+	cache_list_t lru_list;
+
+	cache_list_t arc_lists[4];
+	uint8_t *arc_where;
+	int arc_p;
+
+	/* unused directory entries and payload slots, as stacks */
+	int *free_entries;
+	int num_free_entries;
+	int *free_data;
+	int num_free_data;
+
+	cache_list_t window_list;
+	tinylfu_t *sketch;
+} cache_shard_t;
+
+/* the table of shards, replaced as a whole by cache_resize, and the
+ * configuration the cache was created with, num_entries included */
+static cache_shard_t *shards = NULL;
+static int num_shards = 0;
+
+/* the table cache_resize replaced, while it waits for the blocks held in
+ * it to be put back */
+static cache_shard_t *retired = NULL;
 static int cache_size = 0;
-static int num_queries = 0;
-static int num_hits = 0;
-static int clock = 0;
+static cache_config_t cache_config;
+
+/* the miss-ratio curve estimated from the lookups of the cache created with
+ * |mrc| set, kept after the cache is destroyed until the next is created */
+static mrc_t *mrc = NULL;
+
+/* the compressed tier evicted blocks go to, for a cache created with
+ * |tier_bytes| set, and what it held when the last cache was destroyed */
+static ztier_t *tier = NULL;
+static uint64_t tier_last_blocks = 0;
+static size_t tier_last_bytes = 0;
+
+/* the L1 of a thread, a direct-mapped copy of blocks it hit on lately that
+ * it serves without touching the shards (see cache_config_t). A line is
+ * current while the generation of its block's stripe is the one it was
+ * filled at: cache_update bumps the stripe after writing the block. A line
+ * handed out by cache_get_ref is held and not refilled until put back. */
+#define CACHE_L1_MAX_ENTRIES 1024
+#define CACHE_L1_STRIPES 4096
+
+typedef struct {
+	int disk_num;
+	int block_num;
+	uint32_t generation;
+	uint32_t refs;
+	uint8_t block[JBOD_BLOCK_SIZE];
+} __attribute__((aligned(64))) cache_l1_line_t;
+
+static uint32_t l1_generations[CACHE_L1_STRIPES];
+
+/* lookup counters of one thread. Each thread takes a slot of its own on its
+ * first call and bumps its counters without atomics; reading the counters
+ * sums the slots. Threads beyond CACHE_MAX_THREADS share the last slot and
+ * bump it atomically. */
+#define CACHE_MAX_THREADS 64
+
+/* the counters of cache_stats_t a thread keeps, zeroed when a cache is
+ * created; all of them are uint64_t, so that they can be summed as an array */
+typedef struct {
+	uint64_t queries;
+	uint64_t hits;
+	uint64_t l1_hits;
+	uint64_t tier_hits;
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t updates;
+	uint64_t update_hits;
+	uint64_t invalidations;
+	uint64_t eviction_age[CACHE_STATS_BUCKETS];
+} cache_counters_t;
+
+typedef struct {
+	cache_counters_t counters;
+	/* hits and queries per policy, kept across caches so that runs with
+	 * different policies can be compared */
+	uint64_t policy_queries[CACHE_POLICY_COUNT];
+	uint64_t policy_hits[CACHE_POLICY_COUNT];
+	/* odd while the thread uses the shard table, see epoch_enter */
+	uint64_t epoch;
+	/* the thread's L1, allocated on its first lookup and freed with the cache */
+	cache_l1_line_t *l1;
+	/* the thread's lookups and hits of each of the stats_disks disks, in
+	 * pairs, allocated on its first lookup */
+	uint64_t *disk_counts;
+} __attribute__((aligned(64))) cache_thread_stats_t;
+
+static cache_thread_stats_t thread_stats[CACHE_MAX_THREADS];
+static int num_thread_stats = 0;
+static __thread cache_thread_stats_t *my_stats = NULL;
+
+/* the number of disks counted by disk, kept across caches */
+static int stats_disks = JBOD_NUM_DISKS;
+
+/* adds one to |counter| of the calling thread's stats */
+static void stats_bump(uint64_t *counter) {
+	if (my_stats == &thread_stats[CACHE_MAX_THREADS - 1]) {
+		__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* returns the calling thread's stats slot */
+static cache_thread_stats_t *stats_slot(void) {
+	if (my_stats == NULL) {
+		int slot = __atomic_fetch_add(&num_thread_stats, 1, __ATOMIC_RELAXED);
+		my_stats = &thread_stats[slot < CACHE_MAX_THREADS ? slot : CACHE_MAX_THREADS - 1];
+	}
+	return my_stats;
+}
+
+/* epoch-based reclamation of the shard tables cache_resize replaces. A
+ * thread with a slot of its own makes its epoch odd while it uses a table,
+ * lock-free reads included, and even again when done; a replaced table is
+ * freed once every thread that was inside an epoch when it was replaced has
+ * left it. Threads sharing the last slot count themselves in shared_users
+ * instead, under resize_lock, which cache_resize holds throughout so that
+ * the count drains. */
+static pthread_mutex_t resize_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shared_users = 0;
+
+/* enters the calling thread's epoch and returns the shard table to use */
+static cache_shard_t *epoch_enter(cache_thread_stats_t *stats) {
+	if (stats == &thread_stats[CACHE_MAX_THREADS - 1]) {
+		pthread_mutex_lock(&resize_lock);
+		__atomic_add_fetch(&shared_users, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&resize_lock);
+	} else {
+		// Publish the odd epoch before reading the table, so that a resize
+		// swapping the table either sees it or is seen
+		__atomic_store_n(&stats->epoch, stats->epoch + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+}
+
+/* leaves the calling thread's epoch */
+static void epoch_exit(cache_thread_stats_t *stats) {
+	if (stats == &thread_stats[CACHE_MAX_THREADS - 1]) {
+		__atomic_sub_fetch(&shared_users, 1, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&stats->epoch, stats->epoch + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* waits until every thread that was inside an epoch has left it; the
+ * caller must hold resize_lock */
+static void epoch_synchronize(void) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (int i = 0; i < CACHE_MAX_THREADS - 1; i++) {
+		uint64_t epoch = __atomic_load_n(&thread_stats[i].epoch, __ATOMIC_ACQUIRE);
+		while ((epoch & 1) && __atomic_load_n(&thread_stats[i].epoch, __ATOMIC_ACQUIRE) == epoch) {
+			sched_yield();
+		}
+	}
+	while (__atomic_load_n(&shared_users, __ATOMIC_ACQUIRE) != 0) {
+		sched_yield();
+	}
+}
+
+/* returns the sum over all threads of the counter at |offset| in the stats */
+static uint64_t stats_sum(size_t offset) {
+	uint64_t sum = 0;
+	for (int i = 0; i < CACHE_MAX_THREADS; i++) {
+		sum += __atomic_load_n((uint64_t *) ((char *) &thread_stats[i] + offset), __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+/* returns the bucket of |value| in a log-scale histogram */
+static int stats_bucket(uint64_t value) {
+	int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+	return bucket < CACHE_STATS_BUCKETS ? bucket : CACHE_STATS_BUCKETS - 1;
+}
+
+/* returns the lookup and hit counters of |disk_num| in |stats|, allocating
+ * them on first use; NULL if the disk is not counted or memory runs out */
+static uint64_t *stats_disk(cache_thread_stats_t *stats, int disk_num) {
+	if (disk_num < 0 || disk_num >= stats_disks) {
+		return NULL;
+	}
+	uint64_t *counts = __atomic_load_n(&stats->disk_counts, __ATOMIC_ACQUIRE);
+	if (counts == NULL) {
+		if ((counts = calloc((size_t) stats_disks * 2, sizeof(uint64_t))) == NULL) {
+			return NULL;
+		}
+		// Threads sharing the last slot may race to allocate it
+		uint64_t *expected = NULL;
+		if (!__atomic_compare_exchange_n(&stats->disk_counts, &expected, counts, false, __ATOMIC_ACQ_REL,
+		                                 __ATOMIC_ACQUIRE)) {
+			free(counts);
+			counts = expected;
+		}
+	}
+	return &counts[disk_num * 2];
+}
+
+/* returns the hash of the block at |disk_num| and |block_num| */
+static uint64_t index_hash(int disk_num, int block_num) {
+	// Pack the key and run it through a 64-bit finalizer (from MurmurHash3)
+	uint64_t key = ((uint64_t) disk_num << 32) | (uint32_t) block_num;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+/* returns the number of the shard caching the block with hash |h|. It comes
+ * from bits 32-47, which neither the index groups (the low bits) nor the
+ * fingerprints (the top 16) use; sets take the whole hash modulo their count */
+static uint32_t shard_index(uint64_t h) {
+	return (uint16_t) (h >> 32) % num_shards;
+}
+
+/* returns the shard of |table| caching the block with hash |h| */
+static cache_shard_t *shard_of(cache_shard_t *table, uint64_t h) {
+	return &table[shard_index(h)];
+}
+
+/* locks and returns the shard caching the block with hash |h|, starting
+ * from |table| and moving on to the table that replaced it if cache_resize
+ * did so while the lock was awaited; the caller must be inside its epoch */
+static cache_shard_t *shard_lock(cache_shard_t *table, uint64_t h) {
+	for (;;) {
+		cache_shard_t *s = shard_of(table, h);
+		pthread_mutex_lock(&s->lock);
+		cache_shard_t *current = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+		if (current == table) {
+			return s;
+		}
+		pthread_mutex_unlock(&s->lock);
+		table = current;
+	}
+}
+
+/* returns the fingerprint stored for hash |h|, never TAG_EMPTY or TAG_DELETED */
+static uint16_t index_tag(uint64_t h) {
+	uint16_t tag = h >> 48;
+	return tag > TAG_DELETED ? tag : tag + 2;
+}
+
+/* returns a mask with bits 2i and 2i+1 set for every slot i of the group at
+ * |tags| that holds |tag| */
+static uint32_t group_match(const uint16_t *tags, uint16_t tag) {
+#if defined(__AVX2__)
+	__m256i group = _mm256_load_si256((const __m256i *) tags);
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi16(group, _mm256_set1_epi16(tag)));
+#elif defined(__SSE2__)
+	__m128i want = _mm_set1_epi16(tag);
+	uint32_t lo = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((const __m128i *) tags), want));
+	uint32_t hi = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((const __m128i *) tags + 1), want));
+	return lo | hi << 16;
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < INDEX_GROUP; i++) {
+		if (tags[i] == tag) {
+			mask |= 3u << (2 * i);
+		}
+	}
+	return mask;
+#endif
+}
+
+/* returns the slot of the first match in |mask| and clears it from the mask */
+static int next_match(uint32_t *mask) {
+	int bit = __builtin_ctz(*mask);
+	*mask &= ~(3u << bit);
+	return bit >> 1;
+}
+
+/* returns the index slot pointing at the block, or -1 if it is not cached */
+static int index_find(cache_shard_t *s, int disk_num, int block_num) {
+	uint64_t h = index_hash(disk_num, block_num);
+	uint16_t tag = index_tag(h);
+
+	for (uint32_t g = h & s->index_group_mask;; g = (g + 1) & s->index_group_mask) {
+		const uint16_t *tags = &s->index_tags[g * INDEX_GROUP];
+
+		// Check the full keys of the slots whose fingerprint matches
+		uint32_t mask = group_match(tags, tag);
+		while (mask != 0) {
+			int slot = g * INDEX_GROUP + next_match(&mask);
+			int e = s->index_slots[slot];
+			if (s->entry_disk[e] == disk_num && s->entry_block[e] == block_num) {
+				return slot;
+			}
+		}
+
+		// An empty slot means no key was ever pushed past this group
+		if (group_match(tags, TAG_EMPTY) != 0) {
+			return -1;
+		}
+	}
+}
+
+/* adds entry |e|, which must not already be indexed, to the index */
+static void index_insert(cache_shard_t *s, int e) {
+	uint64_t h = index_hash(s->entry_disk[e], s->entry_block[e]);
+
+	for (uint32_t g = h & s->index_group_mask;; g = (g + 1) & s->index_group_mask) {
+		uint16_t *tags = &s->index_tags[g * INDEX_GROUP];
+
+		// Take the first free slot in the group, reusing deleted ones
+		uint32_t mask = group_match(tags, TAG_EMPTY) | group_match(tags, TAG_DELETED);
+		if (mask != 0) {
+			int slot = next_match(&mask);
+			if (tags[slot] == TAG_DELETED) {
+				s->index_deleted--;
+			}
+			tags[slot] = index_tag(h);
+			s->index_slots[g * INDEX_GROUP + slot] = e;
+			return;
+		}
+	}
+}
+
+/* clears the index and adds every cached entry back, dropping tombstones */
+static void index_rebuild(cache_shard_t *s) {
+	memset(s->index_tags, 0, (s->index_group_mask + 1) * INDEX_GROUP * sizeof(uint16_t));
+	s->index_deleted = 0;
+	for (int e = 0; e < s->num_entries; e++) {
+		if (s->entry_disk[e] != -1) {
+			index_insert(s, e);
+		}
+	}
+}
+
+/* frees index slot |slot| */
+static void index_remove(cache_shard_t *s, int slot) {
+	uint16_t *tags = &s->index_tags[slot & ~(INDEX_GROUP - 1)];
+
+	// A group that still has an empty slot never sent a probe on to the next
+	// group, so the slot can be emptied outright; otherwise leave a tombstone
+	if (group_match(tags, TAG_EMPTY) != 0) {
+		s->index_tags[slot] = TAG_EMPTY;
+		return;
+	}
+	s->index_tags[slot] = TAG_DELETED;
+	s->index_deleted++;
+
+	// Rebuild once tombstones take up a quarter of the slots, so that probes
+	// keep ending early
+	if (s->index_deleted > (int) ((s->index_group_mask + 1) * INDEX_GROUP / 4)) {
+		index_rebuild(s);
+	}
+}
+
+/* removes entry |e| from |list| */
+static void list_unlink(cache_shard_t *s, cache_list_t *list, int e) {
+	if (s->entry_prev[e] == -1) {
+		list->head = s->entry_next[e];
+	} else {
+		s->entry_next[s->entry_prev[e]] = s->entry_next[e];
+	}
+	if (s->entry_next[e] == -1) {
+		list->tail = s->entry_prev[e];
+	} else {
+		s->entry_prev[s->entry_next[e]] = s->entry_prev[e];
+	}
+	list->len--;
+}
+
+/* adds entry |e| at the most recently used end of |list| */
+static void list_push(cache_shard_t *s, cache_list_t *list, int e) {
+	s->entry_prev[e] = -1;
+	s->entry_next[e] = list->head;
+	if (list->head == -1) {
+		list->tail = e;
+	} else {
+		s->entry_prev[list->head] = e;
+	}
+	list->head = e;
+	list->len++;
+}
+
+/* adds entry |e| at the least recently used end of |list| */
+static void list_append(cache_shard_t *s, cache_list_t *list, int e) {
+	s->entry_prev[e] = list->tail;
+	s->entry_next[e] = -1;
+	if (list->tail == -1) {
+		list->head = e;
+	} else {
+		s->entry_next[list->tail] = e;
+	}
+	list->tail = e;
+	list->len++;
+}
+
+/* removes and returns the least recently used entry of |list| */
+static int list_pop(cache_shard_t *s, cache_list_t *list) {
+	int e = list->tail;
+	list_unlink(s, list, e);
+	return e;
+}
+
+/* makes entry |e| odd, if it is not already, so that lookups leave it to
+ * the lock until the shard is unlocked; call before changing the entry */
+static void entry_dirty(cache_shard_t *s, int e) {
+	if ((s->entry_seq[e] & 1) == 0) {
+		assert(s->num_dirty < SHARD_MAX_DIRTY);
+		__atomic_store_n(&s->entry_seq[e], s->entry_seq[e] + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		s->dirty[s->num_dirty++] = e;
+	}
+}
+
+/* makes the entries changed since the last call even again */
+static void shard_clean(cache_shard_t *s) {
+	for (int i = 0; i < s->num_dirty; i++) {
+		int e = s->dirty[i];
+		__atomic_store_n(&s->entry_seq[e], s->entry_seq[e] + 1, __ATOMIC_RELEASE);
+	}
+	s->num_dirty = 0;
+}
+
+/* makes the entries changed under the lock even again, then unlocks */
+static void shard_unlock(cache_shard_t *s) {
+	shard_clean(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* sets entry |e|'s reference bit, writing it only if it is clear so that
+ * hits on a block keep its cache line shared */
+static void entry_reference(cache_shard_t *s, int e) {
+	if (__atomic_load_n(&s->entry_ref[e], __ATOMIC_RELAXED) == 0) {
+		__atomic_store_n(&s->entry_ref[e], 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* gives entry |e| a spare payload slot in place of its own if readers
+ * hold its slot, so that the caller may write the entry's block without
+ * changing what they see; call after entry_dirty */
+static void entry_own_slot(cache_shard_t *s, int e) {
+	int d = s->entry_data[e];
+	if (s->slot_refs[d] == 0) {
+		return;
+	}
+	assert(s->num_spare > 0);
+	s->slot_refs[d] |= SLOT_ORPHAN;
+	s->held_live--;
+	s->entry_data[e] = s->spare_slots[--s->num_spare];
+}
+
+/* clears entry |e|'s reference bit and returns whether it was set */
+static bool entry_take_reference(cache_shard_t *s, int e) {
+	if (__atomic_load_n(&s->entry_ref[e], __ATOMIC_RELAXED) == 0) {
+		return false;
+	}
+	__atomic_store_n(&s->entry_ref[e], 0, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* moves the referenced entries at the tail of |list| to its head, clearing
+ * their bits, so that the tail is the oldest entry not hit since it last
+ * got there (CLOCK's second chance) */
+static void list_settle(cache_shard_t *s, cache_list_t *list) {
+	for (int n = 0; n < list->len && entry_take_reference(s, list->tail); n++) {
+		int e = list_pop(s, list);
+		list_push(s, list, e);
+	}
+}
+
+/* moves entry |e| of |list| to the least recently used end, unless the
+ * list still ends in empty entries, which are filled first */
+static void list_demote(cache_shard_t *s, cache_list_t *list, int e) {
+	if (s->entry_disk[list->tail] != -1) {
+		list_unlink(s, list, e);
+		list_append(s, list, e);
+	}
+}
+
+/* eviction policy of a fully associative cache. The directory holds
+ * |entries_per_block| entries per cached block, so that a policy may remember
+ * blocks it has evicted. cache_insert hands |place| the directory entry it
+ * found for the block (one without data) or -1, and gets back the entry to
+ * fill; the entry must have a payload slot in entry_data, and if its
+ * entry_disk is -1 the caller fills in and indexes its key. Lookups only set
+ * the reference bit of the entry they hit; |victim| and |place| act on the
+ * bits of the entries they come across before choosing one to evict.
+ * |update| is called when a block is rewritten in place, which refreshes it
+ * without counting as another use. |victim| takes the same argument as
+ * |place| and returns the entry whose block placing would evict, or -1 if
+ * the block fits without evicting. Every entry changed must be marked with
+ * entry_dirty first. |rank| writes the entries holding blocks to |order|,
+ * the one the policy would evict first first, and returns how many it
+ * wrote; it sets the reference bit of blocks the policy holds on to beyond
+ * their recency, so that they keep their place when the cache is resized.
+ * |demote| moves a block just placed to where the next block is evicted
+ * from. |pin| takes entry |e| off the policy's lists for as long as it is
+ * pinned, after policy_pins has counted it, and |unpin| puts it back as a
+ * most recently used block. |remove| takes back entry |e|, whose block was
+ * dropped and whose key was forgotten, as an entry to fill first. */
+typedef struct {
+	const char *name;
+	int entries_per_block;
+	void (*init)(cache_shard_t *s);
+	void (*update)(cache_shard_t *s, int e);
+	int (*victim)(cache_shard_t *s, int e);
+	int (*place)(cache_shard_t *s, int e);
+	int (*rank)(cache_shard_t *s, int *order);
+	void (*demote)(cache_shard_t *s, int e);
+	void (*pin)(cache_shard_t *s, int e);
+	void (*unpin)(cache_shard_t *s, int e);
+	void (*remove)(cache_shard_t *s, int e);
+} cache_policy_ops_t;
+
+/* writes the entries of |list| that hold blocks to |order|, tail first, and
+ * returns how many it wrote */
+static int list_rank(cache_shard_t *s, cache_list_t *list, int *order) {
+	int n = 0;
+	for (int e = list->tail; e != -1; e = s->entry_prev[e]) {
+		if (s->entry_disk[e] != -1 && s->entry_data[e] != -1) {
+			order[n++] = e;
+		}
+	}
+	return n;
+}
+
+static const cache_policy_ops_t *policy = NULL;
+static cache_policy_t cache_policy = CACHE_POLICY_LRU;
+
+/* drops entry |e|'s key from the directory */
+static void entry_forget(cache_shard_t *s, int e) {
+	entry_dirty(s, e);
+	index_remove(s, index_find(s, s->entry_disk[e], s->entry_block[e]));
+	s->entry_disk[e] = -1;
+	s->entry_block[e] = -1;
+}
+
+/* counts the eviction of the block of entry |e| for the calling thread and
+ * hands the block down to the compressed tier */
+static void entry_evicted(cache_shard_t *s, int e) {
+	cache_counters_t *counters = &stats_slot()->counters;
+	stats_bump(&counters->evictions);
+	stats_bump(&counters->eviction_age[stats_bucket(s->insert_clock - s->entry_born[e])]);
+	if (tier != NULL) {
+		ztier_put(tier, s->entry_disk[e], s->entry_block[e], index_hash(s->entry_disk[e], s->entry_block[e]),
+		          s->blocks[s->entry_data[e]]);
+	}
+}
+
+/* LRU keeps every entry on one recency list, the empty ones chained at the
+ * tail so that they are filled in order, entry 0 first. Hits are folded in
+ * CLOCK-style when a victim is chosen, so the list orders entries by their
+ * last insert, update or second chance. */
+static void lru_init(cache_shard_t *s) {
+	s->lru_list = (cache_list_t) { -1, -1, 0 };
+	for (int e = 0; e < s->policy_size; e++) {
+		s->entry_data[e] = e;
+		list_push(s, &s->lru_list, e);
+	}
+}
+
+static void lru_update(cache_shard_t *s, int e) {
+	if (e != s->lru_list.head) {
+		list_unlink(s, &s->lru_list, e);
+		list_push(s, &s->lru_list, e);
+	}
+}
+
+static int lru_victim(cache_shard_t *s, int e) {
+	list_settle(s, &s->lru_list);
+	e = s->lru_list.tail;
+	return s->entry_disk[e] == -1 ? -1 : e;
+}
+
+static int lru_place(cache_shard_t *s, int e) {
+	// Reuse the least recently used entry that was not hit since it got to the tail
+	list_settle(s, &s->lru_list);
+	e = s->lru_list.tail;
+	if (s->entry_disk[e] != -1) {
+		entry_evicted(s, e);
+		entry_forget(s, e);
+	}
+	lru_update(s, e);
+	return e;
+}
+
+static int lru_rank(cache_shard_t *s, int *order) {
+	return list_rank(s, &s->lru_list, order);
+}
+
+static void lru_demote(cache_shard_t *s, int e) {
+	list_demote(s, &s->lru_list, e);
+}
+
+static void lru_pin(cache_shard_t *s, int e) {
+	list_unlink(s, &s->lru_list, e);
+}
+
+static void lru_unpin(cache_shard_t *s, int e) {
+	list_push(s, &s->lru_list, e);
+}
+
+static void lru_remove(cache_shard_t *s, int e) {
+	list_unlink(s, &s->lru_list, e);
+	list_append(s, &s->lru_list, e);
+}
+
+/* returns the number of blocks ARC manages: the policy's share of the
+ * shard, less the blocks pinned there */
+static int arc_size(cache_shard_t *s) {
+	return s->policy_size - s->policy_pins;
+}
+
+/* moves entry |e| to the most recently used end of ARC list |to| */
+static void arc_move(cache_shard_t *s, int e, int to) {
+	list_unlink(s, &s->arc_lists[s->arc_where[e]], e);
+	list_push(s, &s->arc_lists[to], e);
+	s->arc_where[e] = to;
+}
+
+/* forgets the least recently used ghost of list |from| */
+static void arc_drop_ghost(cache_shard_t *s, int from) {
+	int e = list_pop(s, &s->arc_lists[from]);
+	entry_forget(s, e);
+	s->free_entries[s->num_free_entries++] = e;
+}
+
+/* returns the list, t1 or t2, that a block is evicted from with t1's target
+ * at |p|; |in_b2| says the block being placed was found in b2 */
+static int arc_pick(cache_shard_t *s, int p, bool in_b2) {
+	int t1 = s->arc_lists[ARC_T1].len;
+	if (t1 > 0 && (t1 > p || (in_b2 && t1 == p) || s->arc_lists[ARC_T2].len == 0)) {
+		return ARC_T1;
+	}
+	return ARC_T2;
+}
+
+/* returns the list arc_pick picks, after moving the referenced blocks it
+ * would evict from t1 or t2 to the head of t2 */
+static int arc_pick_settled(cache_shard_t *s, int p, bool in_b2) {
+	int from = arc_pick(s, p, in_b2);
+	for (int n = 0; n < arc_size(s) && entry_take_reference(s, s->arc_lists[from].tail); n++) {
+		arc_move(s, s->arc_lists[from].tail, ARC_T2);
+		from = arc_pick(s, p, in_b2);
+	}
+	return from;
+}
+
+/* returns t1's target after a miss on ghost entry |e| */
+static int arc_adapt(cache_shard_t *s, int e) {
+	int b1 = s->arc_lists[ARC_B1].len, b2 = s->arc_lists[ARC_B2].len;
+	int p = s->arc_p;
+
+	if (s->arc_where[e] == ARC_B1) {
+		// Recency would have kept the block: grow t1's target
+		p += b2 / b1 > 1 ? b2 / b1 : 1;
+		return p > arc_size(s) ? arc_size(s) : p;
+	}
+
+	// Frequency would have kept the block: shrink t1's target
+	p -= b1 / b2 > 1 ? b1 / b2 : 1;
+	return p < 0 ? 0 : p;
+}
+
+/* if no payload slot is free, evicts a block from t1 or t2 into its ghost
+ * list; |in_b2| says the block being placed was found in b2 */
+static void arc_replace(cache_shard_t *s, bool in_b2) {
+	if (s->num_free_data > 0) {
+		return;
+	}
+
+	int from = arc_pick_settled(s, s->arc_p, in_b2);
+	int e = s->arc_lists[from].tail;
+	entry_evicted(s, e);
+	arc_move(s, e, from == ARC_T1 ? ARC_B1 : ARC_B2);
+	entry_dirty(s, e);
+	s->free_data[s->num_free_data++] = s->entry_data[e];
+	s->entry_data[e] = -1;
+}
+
+static void arc_init(cache_shard_t *s) {
+	for (int i = 0; i < 4; i++) {
+		s->arc_lists[i] = (cache_list_t) { -1, -1, 0 };
+	}
+	s->arc_p = 0;
+
+	// Stack the entries and payload slots so that the lowest come off first
+	s->num_free_entries = 0;
+	for (int e = 2 * s->policy_size - 1; e >= 0; e--) {
+		s->entry_data[e] = -1;
+		s->free_entries[s->num_free_entries++] = e;
+	}
+	s->num_free_data = 0;
+	for (int d = s->policy_size - 1; d >= 0; d--) {
+		s->free_data[s->num_free_data++] = d;
+	}
+}
+
+static void arc_update(cache_shard_t *s, int e) {
+	arc_move(s, e, s->arc_where[e]);
+}
+
+static int arc_victim(cache_shard_t *s, int e) {
+	if (s->num_free_data > 0) {
+		return -1;
+	}
+	if (e != -1) {
+		return s->arc_lists[arc_pick_settled(s, arc_adapt(s, e), s->arc_where[e] == ARC_B2)].tail;
+	}
+	return s->arc_lists[arc_pick_settled(s, s->arc_p, false)].tail;
+}
+
+static int arc_place(cache_shard_t *s, int e) {
+	int b1 = s->arc_lists[ARC_B1].len, b2 = s->arc_lists[ARC_B2].len;
+	int c = arc_size(s);
+
+	if (e != -1) {
+		// A ghost hit adapts t1's target, then the block moves on to t2
+		bool in_b2 = s->arc_where[e] == ARC_B2;
+		s->arc_p = arc_adapt(s, e);
+		arc_replace(s, in_b2);
+		arc_move(s, e, ARC_T2);
+	} else {
+		// A block not seen recently: make room in the directory, then in the cache,
+		// once the blocks hit at the end of the list to evict from have moved on
+		if (s->num_free_data == 0) {
+			arc_pick_settled(s, s->arc_p, false);
+		}
+		int t1 = s->arc_lists[ARC_T1].len;
+		int total = t1 + s->arc_lists[ARC_T2].len + b1 + b2;
+		if (t1 + b1 == c) {
+			if (t1 < c) {
+				arc_drop_ghost(s, ARC_B1);
+				arc_replace(s, false);
+			} else {
+				// t1 fills the whole cache: drop its oldest block outright
+				int old = list_pop(s, &s->arc_lists[ARC_T1]);
+				entry_evicted(s, old);
+				entry_dirty(s, old);
+				s->free_data[s->num_free_data++] = s->entry_data[old];
+				s->entry_data[old] = -1;
+				entry_forget(s, old);
+				s->free_entries[s->num_free_entries++] = old;
+			}
+		} else if (total >= c) {
+			if (total == 2 * c) {
+				arc_drop_ghost(s, ARC_B2);
+			}
+			arc_replace(s, false);
+		}
+
+		e = s->free_entries[--s->num_free_entries];
+		list_push(s, &s->arc_lists[ARC_T1], e);
+		s->arc_where[e] = ARC_T1;
+	}
+
+	// Give the block one of the free payload slots
+	entry_dirty(s, e);
+	s->entry_data[e] = s->free_data[--s->num_free_data];
+	return e;
+}
+
+static int arc_rank(cache_shard_t *s, int *order) {
+	// Blocks seen once go first; blocks in t2 are marked so that CAR's second
+	// chance moves them back to t2
+	int n = list_rank(s, &s->arc_lists[ARC_T1], order);
+	int t2 = list_rank(s, &s->arc_lists[ARC_T2], order + n);
+	for (int i = n; i < n + t2; i++) {
+		entry_reference(s, order[i]);
+	}
+	return n + t2;
+}
+
+static void arc_demote(cache_shard_t *s, int e) {
+	list_demote(s, &s->arc_lists[s->arc_where[e]], e);
+}
+
+static void arc_pin(cache_shard_t *s, int e) {
+	list_unlink(s, &s->arc_lists[s->arc_where[e]], e);
+
+	// The cache ARC manages shrank by a block: forget ghosts until the lists
+	// fit it again
+	int c = arc_size(s);
+	if (s->arc_lists[ARC_T1].len + s->arc_lists[ARC_B1].len > c) {
+		arc_drop_ghost(s, ARC_B1);
+	}
+	int total = 0;
+	for (int i = 0; i < 4; i++) {
+		total += s->arc_lists[i].len;
+	}
+	if (total > 2 * c) {
+		arc_drop_ghost(s, s->arc_lists[ARC_B2].len > 0 ? ARC_B2 : ARC_B1);
+	}
+	s->arc_p = s->arc_p > c ? c : s->arc_p;
+}
+
+static void arc_unpin(cache_shard_t *s, int e) {
+	// A block worth pinning was used more than once
+	list_push(s, &s->arc_lists[ARC_T2], e);
+	s->arc_where[e] = ARC_T2;
+}
+
+static void arc_remove(cache_shard_t *s, int e) {
+	// The block is gone rather than evicted, so it leaves no ghost
+	list_unlink(s, &s->arc_lists[s->arc_where[e]], e);
+	s->free_data[s->num_free_data++] = s->entry_data[e];
+	s->entry_data[e] = -1;
+	s->free_entries[s->num_free_entries++] = e;
+}
+
+static const cache_policy_ops_t policies[CACHE_POLICY_COUNT] = {
+	[CACHE_POLICY_LRU] = { "lru", 1, lru_init, lru_update, lru_victim, lru_place, lru_rank,
+	                       lru_demote, lru_pin, lru_unpin, lru_remove },
+	[CACHE_POLICY_ARC] = { "arc", 2, arc_init, arc_update, arc_victim, arc_place, arc_rank,
+	                       arc_demote, arc_pin, arc_unpin, arc_remove },
+};
+
+static void window_init(cache_shard_t *s) {
+	s->window_list = (cache_list_t) { -1, -1, 0 };
+	for (int e = s->policy_entries; e < s->num_entries; e++) {
+		s->entry_data[e] = s->policy_size + (e - s->policy_entries);
+		list_push(s, &s->window_list, e);
+	}
+}
+
+static void window_update(cache_shard_t *s, int e) {
+	if (e != s->window_list.head) {
+		list_unlink(s, &s->window_list, e);
+		list_push(s, &s->window_list, e);
+	}
+}
+
+/* returns the window entry a new block goes in, after moving the block it
+ * held into the policy's part of the cache or dropping it */
+static int window_place(cache_shard_t *s) {
+	list_settle(s, &s->window_list);
+	int w = s->window_list.tail;
+	window_update(s, w);
+	if (s->entry_disk[w] == -1) {
+		return w;
+	}
+
+	// Move the block on if the policy has room or the sketch prefers it to the policy's victim
+	int victim = policy->victim(s, -1);
+	if (victim == -1 || s->entry_disk[victim] == -1 ||
+	    tinylfu_admit(s->sketch, index_hash(s->entry_disk[w], s->entry_block[w]),
+	                  index_hash(s->entry_disk[victim], s->entry_block[victim]))) {
+		int m = policy->place(s, -1);
+
+		// Hand the block over by trading payload slots instead of copying it
+		entry_dirty(s, m);
+		entry_dirty(s, w);
+		int data = s->entry_data[m];
+		s->entry_data[m] = s->entry_data[w];
+		s->entry_data[w] = data;
+		s->entry_disk[m] = s->entry_disk[w];
+		s->entry_block[m] = s->entry_block[w];
+		s->entry_born[m] = s->entry_born[w];
+		entry_forget(s, w);
+		index_insert(s, m);
+	} else {
+		entry_evicted(s, w);
+		entry_forget(s, w);
+	}
+	return w;
+}
+
+/* returns the first entry of the set the block with hash |h| maps to */
+static int set_first(cache_shard_t *s, uint64_t h) {
+	return (h % s->num_sets) * s->ways;
+}
+
+/* returns the entry holding the block's key, or -1 if there is none; the
+ * entry may be one without data that a policy uses to remember the block */
+static int entry_find(cache_shard_t *s, int disk_num, int block_num) {
+	// Without sets, go through the index
+	if (s->ways == 0) {
+		int slot = index_find(s, disk_num, block_num);
+		return slot == -1 ? -1 : s->index_slots[slot];
+	}
+
+	// Otherwise check each way of the block's set
+	int first = set_first(s, index_hash(disk_num, block_num));
+	for (int e = first; e < first + s->ways; e++) {
+		if (s->entry_block[e] == block_num && s->entry_disk[e] == disk_num) {
+			return e;
+		}
+	}
+	return -1;
+}
+
+/* returns 1 and copies the block to |buf| if entry |e| holds it, 0 if the
+ * entry holds another block, and -1 if it holds the block without data or a
+ * writer is changing it. Needs no lock: the entry's sequence number shows
+ * whether it changed while being read. */
+static int entry_read(cache_shard_t *s, int e, int disk_num, int block_num, uint8_t *buf) {
+	uint32_t seq = __atomic_load_n(&s->entry_seq[e], __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+		return -1;
+	}
+	int disk = __atomic_load_n(&s->entry_disk[e], __ATOMIC_RELAXED);
+	int block = __atomic_load_n(&s->entry_block[e], __ATOMIC_RELAXED);
+	int data = __atomic_load_n(&s->entry_data[e], __ATOMIC_RELAXED);
+	if (disk != disk_num || block != block_num) {
+		return 0;
+	}
+	if (data < 0 || data >= s->num_slots) {
+		return -1;
+	}
+
+	// Copy the block, then check that no writer got to the entry meanwhile
+	memcpy(buf, s->blocks[data], JBOD_BLOCK_SIZE);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->entry_seq[e], __ATOMIC_RELAXED) == seq ? 1 : -1;
+}
+
+/* returns the entry the block was copied from into |buf|, or -1 if it could
+ * not be read without the lock, because it is not cached or is being
+ * changed. The index and the sets may change under the probe; an entry is
+ * only trusted once entry_read has checked its key. */
+static int entry_read_unlocked(cache_shard_t *s, uint64_t h, int disk_num, int block_num, uint8_t *buf) {
+	// With sets, check each way of the block's set
+	if (s->ways != 0) {
+		int first = set_first(s, h);
+		for (int e = first; e < first + s->ways; e++) {
+			int found = entry_read(s, e, disk_num, block_num, buf);
+			if (found != 0) {
+				return found == 1 ? e : -1;
+			}
+		}
+		return -1;
+	}
+
+	// Otherwise probe the index as index_find does, visiting each group at most once
+	uint16_t tag = index_tag(h);
+	uint32_t g = h & s->index_group_mask;
+	for (uint32_t n = 0; n <= s->index_group_mask; n++, g = (g + 1) & s->index_group_mask) {
+		const uint16_t *tags = &s->index_tags[g * INDEX_GROUP];
+		uint32_t mask = group_match(tags, tag);
+		while (mask != 0) {
+			int e = __atomic_load_n(&s->index_slots[g * INDEX_GROUP + next_match(&mask)], __ATOMIC_RELAXED);
+			int found = e >= 0 && e < s->num_entries ? entry_read(s, e, disk_num, block_num, buf) : -1;
+			if (found != 0) {
+				return found == 1 ? e : -1;
+			}
+		}
+		if (group_match(tags, TAG_EMPTY) != 0) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/* marks entry |e| as the most recently used after its block is rewritten */
+static void entry_refresh(cache_shard_t *s, int e) {
+	if (s->ways == 0 && s->entry_pinned[e]) {
+		// A pinned entry is off the lists until it is unpinned
+		return;
+	}
+	if (s->ways == 0 && e >= s->policy_entries) {
+		window_update(s, e);
+	} else if (s->ways == 0) {
+		policy->update(s, e);
+	} else {
+		s->entry_stamp[e] = ++s->set_clock;
+	}
+}
+
+/* returns the entry of the block's set that it should replace: an empty way
+ * if there is one, else the least recently stamped way not pinned; a way hit
+ * since its stamp gets a fresh one and the next oldest is tried, ways times
+ * at most */
+static int set_victim(cache_shard_t *s, int disk_num, int block_num) {
+	int first = set_first(s, index_hash(disk_num, block_num));
+	for (int n = 0;; n++) {
+		int victim = -1;
+		for (int e = first; e < first + s->ways; e++) {
+			if (s->entry_disk[e] == -1) {
+				return e;
+			}
+			if (!s->entry_pinned[e] && (victim == -1 || s->entry_stamp[e] - s->entry_stamp[victim] > UINT32_MAX / 2)) {
+				victim = e;
+			}
+		}
+		if (n == s->ways || !entry_take_reference(s, victim)) {
+			return victim;
+		}
+		s->entry_stamp[victim] = ++s->set_clock;
+	}
+}
+
+/* returns the entry block |block_num| of disk |disk_num| was inserted into
+ * shard |s| with the contents of |buf|, or -1 if it is already cached.
+ * |admitted| places the block straight in the policy's part of the cache,
+ * past the admission window. */
+static int shard_insert(cache_shard_t *s, int disk_num, int block_num, const uint8_t *buf, bool admitted) {
+	// Look for an existing cache entry for the given disk and block number
+	int e = entry_find(s, disk_num, block_num);
+	if (e != -1 && s->entry_data[e] != -1) {
+		return -1;
+	}
+
+	// Let the set, the admission window or the policy pick the entry the block goes in;
+	// a block the policy still remembers has already shown it is reused and skips the window
+	if (s->ways == 0 && s->window_size > 0 && e == -1 && !admitted) {
+		e = window_place(s);
+	} else if (s->ways == 0) {
+		e = policy->place(s, e);
+	} else {
+		e = set_victim(s, disk_num, block_num);
+		if (s->entry_disk[e] != -1) {
+			entry_evicted(s, e);
+		}
+		entry_dirty(s, e);
+		s->entry_disk[e] = -1;
+		s->entry_stamp[e] = ++s->set_clock;
+	}
+
+	// Fill in the entry, giving it the block's key unless it remembers the block already
+	entry_dirty(s, e);
+	__atomic_store_n(&s->entry_ref[e], 0, __ATOMIC_RELAXED);
+	s->entry_born[e] = ++s->insert_clock;
+	if (s->entry_disk[e] == -1) {
+		s->entry_disk[e] = disk_num;
+		s->entry_block[e] = block_num;
+		if (s->ways == 0) {
+			index_insert(s, e);
+		}
+	}
+	entry_own_slot(s, e);
+	memcpy(s->blocks[s->entry_data[e]], buf, JBOD_BLOCK_SIZE);
+	return e;
+}
+
+/* pins entry |e| of shard |s|, which holds a block, unless that would pin
+ * more than the shard's share of blocks or leave its set, the admission
+ * window or the policy without a block to evict; returns whether the entry
+ * is pinned */
+static bool entry_pin(cache_shard_t *s, int e) {
+	if (s->entry_pinned[e]) {
+		return true;
+	}
+	if (s->num_pins >= s->max_pins) {
+		return false;
+	}
+
+	if (s->ways != 0) {
+		int first = e - e % s->ways, pinned = 0;
+		for (int f = first; f < first + s->ways; f++) {
+			pinned += s->entry_pinned[f];
+		}
+		if (pinned >= s->ways - 1) {
+			return false;
+		}
+	} else if (e >= s->policy_entries) {
+		if (s->window_list.len <= 1) {
+			return false;
+		}
+		list_unlink(s, &s->window_list, e);
+	} else {
+		if (s->policy_pins >= s->policy_size - 1) {
+			return false;
+		}
+		s->policy_pins++;
+		policy->pin(s, e);
+	}
+	s->entry_pinned[e] = 1;
+	s->num_pins++;
+	return true;
+}
+
+/* unpins pinned entry |e|, making it the most recently used */
+static void entry_unpin(cache_shard_t *s, int e) {
+	s->entry_pinned[e] = 0;
+	s->num_pins--;
+	if (s->ways != 0) {
+		s->entry_stamp[e] = ++s->set_clock;
+	} else if (e >= s->policy_entries) {
+		list_push(s, &s->window_list, e);
+	} else {
+		s->policy_pins--;
+		policy->unpin(s, e);
+	}
+}
+
+/* drops the block of entry |e| from shard |s| without counting an
+ * eviction, leaving the entry empty; readers holding a reference to the
+ * block keep its slot */
+static void entry_remove(cache_shard_t *s, int e) {
+	if (s->entry_pinned[e]) {
+		entry_unpin(s, e);
+	}
+	entry_dirty(s, e);
+	entry_own_slot(s, e);
+	__atomic_store_n(&s->entry_ref[e], 0, __ATOMIC_RELAXED);
+	if (s->ways != 0) {
+		// An empty way is the first its set fills
+		s->entry_disk[e] = -1;
+		s->entry_block[e] = -1;
+		return;
+	}
+	entry_forget(s, e);
+	if (e >= s->policy_entries) {
+		list_unlink(s, &s->window_list, e);
+		list_append(s, &s->window_list, e);
+	} else {
+		policy->remove(s, e);
+	}
+}
+
+/* gives the block just inserted into entry |e| its place by |priority|: a
+ * high priority block starts out referenced, so that it is passed over the
+ * first time it comes up for eviction, and a low priority block is moved to
+ * where the next block is evicted from */
+static void entry_prioritize(cache_shard_t *s, int e, cache_priority_t priority) {
+	if (priority == CACHE_PRIORITY_HIGH) {
+		entry_reference(s, e);
+	} else if (priority == CACHE_PRIORITY_LOW && s->ways != 0) {
+		// Stamp the block just before the oldest way of its set
+		int first = e - e % s->ways;
+		uint32_t oldest = s->entry_stamp[e];
+		for (int f = first; f < first + s->ways; f++) {
+			if (f != e && s->entry_disk[f] != -1 && s->entry_stamp[f] - oldest > UINT32_MAX / 2) {
+				oldest = s->entry_stamp[f];
+			}
+		}
+		s->entry_stamp[e] = oldest - 1;
+	} else if (priority == CACHE_PRIORITY_LOW && e >= s->policy_entries) {
+		list_demote(s, &s->window_list, e);
+	} else if (priority == CACHE_PRIORITY_LOW) {
+		policy->demote(s, e);
+	}
+}
+
+/* writes the pinned entries of shard |s| from |first| up to |end| to
+ * |order| and returns how many it wrote */
+static int pinned_rank(cache_shard_t *s, int first, int end, int *order) {
+	int n = 0;
+	for (int e = first; e < end; e++) {
+		if (s->entry_pinned[e]) {
+			order[n++] = e;
+		}
+	}
+	return n;
+}
+
+/* an entry of a set-associative shard and how long ago it was stamped */
+typedef struct {
+	uint32_t age;
+	int entry;
+} set_rank_t;
+
+static int set_rank_compare(const void *a, const void *b) {
+	uint32_t x = ((const set_rank_t *) a)->age, y = ((const set_rank_t *) b)->age;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* writes the entries of shard |s| that hold blocks to |order|, the first
+ * to evict first: the window's blocks after the policy's, since the window
+ * holds the newest blocks, and the blocks of sets by age, sorted in
+ * |ranks|. Pinned blocks come after the other blocks of their part of the
+ * cache, or as the newest of their set. Both arrays must have room for
+ * every entry. Returns how many entries it wrote, of which the first
+ * |*admitted| are the policy's. */
+static int shard_rank(cache_shard_t *s, int *order, set_rank_t *ranks, int *admitted) {
+	if (s->ways == 0) {
+		int n = policy->rank(s, order);
+		n += pinned_rank(s, 0, s->policy_entries, order + n);
+		*admitted = n;
+		n += list_rank(s, &s->window_list, order + n);
+		return n + pinned_rank(s, s->policy_entries, s->num_entries, order + n);
+	}
+
+	int n = 0;
+	for (int e = 0; e < s->num_entries; e++) {
+		if (s->entry_disk[e] != -1) {
+			ranks[n++] = (set_rank_t) { s->entry_pinned[e] ? 0 : s->set_clock - s->entry_stamp[e], e };
+		}
+	}
+	qsort(ranks, n, sizeof(set_rank_t), set_rank_compare);
+	for (int i = 0; i < n; i++) {
+		order[i] = ranks[i].entry;
+	}
+	*admitted = n;
+	return n;
+}
+
+/* inserts the blocks of shard |from| into the empty shard |to| in the
+ * order they would be evicted, so that when |to| is smaller the blocks
+ * evicted to fit are the ones |from| would have evicted first. Reference
+ * bits, pins as far as |to| takes them, and the TinyLFU sketch move along
+ * with the blocks. |order| and
+ * |ranks| are scratch space for shard_rank. */
+static void shard_migrate(cache_shard_t *to, cache_shard_t *from, int *order, set_rank_t *ranks) {
+	int admitted;
+	int n = shard_rank(from, order, ranks, &admitted);
+
+	// Keep the sketch's counts, so that admission goes on as before; lookups
+	// still using |from| keep recording into it
+	if (from->sketch != NULL) {
+		tinylfu_destroy(to->sketch);
+		to->sketch = from->sketch;
+		__atomic_store_n(&from->sketch, NULL, __ATOMIC_RELAXED);
+	}
+
+	// The policy's blocks go straight back to the policy, the window's to the window
+	for (int i = 0; i < n; i++) {
+		int e = order[i];
+		int moved = shard_insert(to, from->entry_disk[e], from->entry_block[e], from->blocks[from->entry_data[e]],
+		                         i < admitted);
+		if (__atomic_load_n(&from->entry_ref[e], __ATOMIC_RELAXED)) {
+			entry_reference(to, moved);
+		}
+		if (from->entry_pinned[e]) {
+			entry_pin(to, moved);
+		}
+		shard_clean(to);
+	}
+}
+
+/* returns the FNV-1a hash of record |r| without its checksum field */
+static uint32_t record_checksum(const cache_file_record_t *r) {
+	const uint8_t *bytes[2] = { (const uint8_t *) r, r->block };
+	size_t lengths[2] = { offsetof(cache_file_record_t, checksum), JBOD_BLOCK_SIZE };
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < 2; i++) {
+		for (size_t j = 0; j < lengths[i]; j++) {
+			hash = (hash ^ bytes[i][j]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+/* writes a record for every block of shard |s| to |f|, the first to evict
+ * first, and returns how many it wrote or -1 on failure. |order| and
+ * |ranks| are scratch space for shard_rank. Ranking ARC's shards marks
+ * their frequently used blocks referenced, as cache_resize does, which
+ * only gives those blocks one more pass of the clock. */
+static int shard_save(cache_shard_t *s, FILE *f, int *order, set_rank_t *ranks) {
+	int admitted;
+	int n = shard_rank(s, order, ranks, &admitted);
+	for (int i = 0; i < n; i++) {
+		int e = order[i];
+		cache_file_record_t r = { s->entry_disk[e], s->entry_block[e], 0, 0, { 0 } };
+		r.flags = (i < admitted ? RECORD_ADMITTED : 0) |
+		          (__atomic_load_n(&s->entry_ref[e], __ATOMIC_RELAXED) ? RECORD_REFERENCED : 0);
+		memcpy(r.block, s->blocks[s->entry_data[e]], JBOD_BLOCK_SIZE);
+		r.checksum = record_checksum(&r);
+		if (fwrite(&r, sizeof(r), 1, f) != 1) {
+			return -1;
+		}
+	}
+	return n;
+}
+
+/* frees every array of shard |s| */
+static void shard_free(cache_shard_t *s) {
+	arena_destroy(&s->arena);
+	tinylfu_destroy(s->sketch);
+	pthread_mutex_destroy(&s->lock);
+}
+
+/* returns 1 on success and -1 on failure; sets up shard |s| to cache
+ * |num_blocks| blocks as described by |config| */
+static int shard_init(cache_shard_t *s, int num_blocks, const cache_config_t *config) {
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->lock, NULL);
+
+	// Give the admission window its share of the blocks, size the directory for the
+	// policy and the window, and the index to at most half full
+	s->size = num_blocks;
+	s->window_size = config->tinylfu ? (num_blocks * WINDOW_PERCENT + 99) / 100 : 0;
+	s->policy_size = num_blocks - s->window_size;
+	s->policy_entries = s->policy_size * policies[config->policy].entries_per_block;
+	s->num_entries = s->policy_entries + s->window_size;
+	uint32_t index_groups = 1;
+	while (index_groups * INDEX_GROUP < 2 * (uint32_t) s->num_entries) {
+		index_groups <<= 1;
+	}
+	size_t index_size = index_groups * INDEX_GROUP;
+	int num_entries = s->num_entries;
+
+	// Lay the index and the directory out first, then the colder lists and
+	// stacks, and the payload slab last on pages of its own, all in one arena:
+	// measure it, map it, then carve it up the same way
+	s->sketch = config->tinylfu ? tinylfu_create(num_blocks) : NULL;
+	if (config->tinylfu && s->sketch == NULL) {
+		shard_free(s);
+		return -1;
+	}
+	arena_measure(&s->arena);
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1 && arena_create(&s->arena, s->arena.used) != 1) {
+			shard_free(s);
+			return -1;
+		}
+		s->index_tags = arena_carve(&s->arena, index_size * sizeof(uint16_t), 64);
+		s->index_slots = arena_carve(&s->arena, index_size * sizeof(int), 64);
+		s->entry_disk = arena_carve(&s->arena, num_entries * sizeof(int), 64);
+		s->entry_block = arena_carve(&s->arena, num_entries * sizeof(int), 64);
+		s->entry_data = arena_carve(&s->arena, num_entries * sizeof(int), 64);
+		s->entry_seq = arena_carve(&s->arena, num_entries * sizeof(uint32_t), 64);
+		s->entry_ref = arena_carve(&s->arena, num_entries, 64);
+		s->entry_pinned = arena_carve(&s->arena, num_entries, 64);
+		s->entry_prev = arena_carve(&s->arena, num_entries * sizeof(int), 64);
+		s->entry_next = arena_carve(&s->arena, num_entries * sizeof(int), 64);
+		s->entry_stamp = arena_carve(&s->arena, num_entries * sizeof(uint32_t), 64);
+		s->entry_born = arena_carve(&s->arena, num_entries * sizeof(uint32_t), 64);
+		s->arc_where = arena_carve(&s->arena, num_entries, 64);
+		s->free_entries = arena_carve(&s->arena, num_entries * sizeof(int), 64);
+		s->free_data = arena_carve(&s->arena, num_blocks * sizeof(int), 64);
+		s->slot_refs = arena_carve(&s->arena, (num_blocks + SHARD_SPARE_SLOTS) * sizeof(uint32_t), 64);
+		s->spare_slots = arena_carve(&s->arena, SHARD_SPARE_SLOTS * sizeof(int), 64);
+		s->blocks = arena_carve(&s->arena, (size_t) (num_blocks + SHARD_SPARE_SLOTS) * JBOD_BLOCK_SIZE,
+		                        SLAB_ALIGN);
+	}
+	s->ways = config->ways;
+	s->max_pins = num_blocks * config->pin_percent / 100;
+	s->num_sets = s->ways == 0 ? 0 : num_blocks / s->ways;
+	s->index_group_mask = index_groups - 1;
+	s->num_slots = num_blocks + SHARD_SPARE_SLOTS;
+	for (int d = s->num_slots - 1; d >= num_blocks; d--) {
+		s->spare_slots[s->num_spare++] = d;
+	}
+
+	// Mark every entry empty and let the policy set up its lists
+	for (int i = 0; i < num_entries; i++) {
+		s->entry_disk[i] = -1;
+		s->entry_block[i] = -1;
+		s->entry_data[i] = i;
+	}
+	if (s->ways == 0) {
+		policy->init(s);
+		window_init(s);
+	}
+	return 1;
+}
+
+/* returns the number of blocks each shard of a cache described by |config|
+ * holds, or -1 if the configuration is not valid. The size is only bounded
+ * by memory and by the directory and the index of a shard, up to eight
+ * slots per block, staying addressable by int. */
+static int config_shard_blocks(const cache_config_t *config) {
+	int num_blocks = config->num_entries;
+	if (num_blocks < 2 || num_blocks > INT_MAX / 8) {
+		return -1;
+	}
+	int count = config->shards > 0 ? config->shards : 1;
+	if (count > CACHE_MAX_SHARDS || num_blocks % count != 0 || num_blocks / count < 2) {
+		return -1;
+	}
+	int shard_blocks = num_blocks / count;
+	if (config->ways < 0 || (config->ways > 0 && shard_blocks % config->ways != 0)) {
+		return -1;
+	}
+	if (config->policy < 0 || config->policy >= CACHE_POLICY_COUNT ||
+	    (config->ways > 0 && (config->policy != CACHE_POLICY_LRU || config->tinylfu))) {
+		return -1;
+	}
+	if (config->l1_entries < 0 || config->l1_entries > CACHE_L1_MAX_ENTRIES ||
+	    (config->l1_entries & (config->l1_entries - 1)) != 0 ||
+	    (config->l1_entries > 0 && (config->tinylfu || config->mrc))) {
+		return -1;
+	}
+	if (config->pin_percent < 0 || config->pin_percent > CACHE_MAX_PIN_PERCENT) {
+		return -1;
+	}
+	return shard_blocks;
+}
+
+/* frees the |count| shards of |table| and the table */
+static void table_free(cache_shard_t *table, int count) {
+	for (int i = 0; i < count; i++) {
+		shard_free(&table[i]);
+	}
+	free(table);
+}
+
+/* returns a table of |count| shards of |shard_blocks| blocks each, set up
+ * as described by |config|, or NULL on failure */
+static cache_shard_t *table_create(int count, int shard_blocks, const cache_config_t *config) {
+	// Set up every shard, undoing the ones done if one fails
+	cache_shard_t *table = calloc(count, sizeof(cache_shard_t));
+	if (table == NULL) {
+		return NULL;
+	}
+	for (int i = 0; i < count; i++) {
+		if (shard_init(&table[i], shard_blocks, config) != 1) {
+			table_free(table, i);
+			return NULL;
+		}
+	}
+	return table;
+}
+
+// Create a fully associative cache with the specified number of entries
+int cache_create(int num_entries) {
+	cache_config_t config = { .num_entries = num_entries, .ways = 0 };
+	return cache_create_with(&config);
+}
+
+// Create a cache organized as described by the configuration
+int cache_create_with(const cache_config_t *config) {
+	// Check if the configuration is valid and if the cache is already enabled
+	if (config == NULL || cache_enabled()) {
+		return -1;
+	}
+	int shard_blocks = config_shard_blocks(config);
+	if (shard_blocks == -1) {
+		return -1;
+	}
+
+	// Set up the shards and start a new miss-ratio curve and new counters
+	int count = config->num_entries / shard_blocks;
+	cache_policy = config->policy;
+	policy = &policies[cache_policy];
+	cache_shard_t *created = table_create(count, shard_blocks, config);
+	if (created == NULL) {
+		return -1;
+	}
+	mrc_destroy(mrc);
+	mrc = config->mrc ? mrc_create(MRC_MAX_KEYS) : NULL;
+	if (config->mrc && mrc == NULL) {
+		table_free(created, count);
+		return -1;
+	}
+	tier = config->tier_bytes > 0 ? ztier_create(config->tier_bytes) : NULL;
+	if (config->tier_bytes > 0 && tier == NULL) {
+		table_free(created, count);
+		return -1;
+	}
+	tier_last_blocks = 0;
+	tier_last_bytes = 0;
+	shards = created;
+	num_shards = count;
+	cache_size = config->num_entries;
+	cache_config = *config;
+	for (int i = 0; i < CACHE_MAX_THREADS; i++) {
+		memset(&thread_stats[i].counters, 0, sizeof(cache_counters_t));
+		if (thread_stats[i].disk_counts != NULL) {
+			memset(thread_stats[i].disk_counts, 0, (size_t) stats_disks * 2 * sizeof(uint64_t));
+		}
+	}
 
-// Create a cache with the specified number of entries
-int cache_create(int num_entries) {
-	// Check if the number of entries is valid and if the cache is already enabled
-	if (num_entries < 2 || num_entries > 4096 || cache_enabled()) {
+	// Return success
+    return 1;
+}
+
+// Resize the cache, keeping as many of its blocks as fit
+int cache_resize(int num_entries) {
+	// Check if the cache is enabled and if the new size suits its configuration
+	if (!cache_enabled()) {
+		return -1;
+	}
+	cache_config_t config = cache_config;
+	config.num_entries = num_entries;
+	int shard_blocks = config_shard_blocks(&config);
+	if (shard_blocks == -1) {
 		return -1;
 	}
 
-	// Allocate memory for the cache and set the cache size
-	cache = calloc(num_entries, sizeof(cache_entry_t));
+	// Keep other resizes and the threads without an epoch of their own out, and
+	// set up the new shards and the scratch space for moving blocks over
+	pthread_mutex_lock(&resize_lock);
+	cache_shard_t *old = shards;
+	int most = 0;
+	for (int i = 0; i < num_shards; i++) {
+		most = old[i].num_entries > most ? old[i].num_entries : most;
+	}
+	cache_shard_t *table = table_create(num_shards, shard_blocks, &config);
+	int *order = malloc(most * sizeof(int));
+	set_rank_t *ranks = malloc(most * sizeof(set_rank_t));
+	if (table == NULL || order == NULL || ranks == NULL) {
+		if (table != NULL) {
+			table_free(table, num_shards);
+		}
+		free(order);
+		free(ranks);
+		pthread_mutex_unlock(&resize_lock);
+		return -1;
+	}
+
+	// Move the blocks over with every old shard locked, then swap the tables;
+	// writers waiting for an old shard's lock move on to the new table
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_lock(&old[i].lock);
+	}
+	for (int i = 0; i < num_shards; i++) {
+		shard_migrate(&table[i], &old[i], order, ranks);
+	}
+	__atomic_store_n(&retired, old, __ATOMIC_RELEASE);
+	__atomic_store_n(&shards, table, __ATOMIC_RELEASE);
 	cache_size = num_entries;
+	cache_config.num_entries = num_entries;
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_unlock(&old[i].lock);
+	}
 
-	// Return success
-    return 1;
+	// Free the old shards once no thread can still be using them and every
+	// block held in them was put back
+	epoch_synchronize();
+	for (int i = 0; i < num_shards; i++) {
+		while (__atomic_load_n(&old[i].num_held, __ATOMIC_ACQUIRE) != 0) {
+			sched_yield();
+		}
+	}
+	__atomic_store_n(&retired, NULL, __ATOMIC_RELEASE);
+	table_free(old, num_shards);
+	pthread_mutex_unlock(&resize_lock);
+	free(order);
+	free(ranks);
+	return 1;
+}
+
+/* returns whether a block of |table| is pinned by cache_pin or held by a
+ * ref, in the table or in a thread's L1; the caller holds every shard of
+ * |table| locked */
+static bool table_held(cache_shard_t *table) {
+	for (int i = 0; i < num_shards; i++) {
+		if (table[i].num_pins != 0 || __atomic_load_n(&table[i].num_held, __ATOMIC_ACQUIRE) != 0) {
+			return true;
+		}
+	}
+	int num_lines = cache_config.l1_entries;
+	for (int i = 0; num_lines > 0 && i < CACHE_MAX_THREADS - 1; i++) {
+		cache_l1_line_t *l1 = __atomic_load_n(&thread_stats[i].l1, __ATOMIC_ACQUIRE);
+		for (int j = 0; l1 != NULL && j < num_lines; j++) {
+			if (__atomic_load_n(&l1[j].refs, __ATOMIC_ACQUIRE) != 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Drop every cached block, keeping the configuration and the counters
+int cache_clear(void) {
+	// Check if the cache is enabled
+	if (!cache_enabled()) {
+		return -1;
+	}
+
+	// Keep resizes out, and set up empty shards and an empty tier
+	pthread_mutex_lock(&resize_lock);
+	cache_shard_t *old = shards;
+	ztier_t *old_tier = tier;
+	cache_shard_t *table = table_create(num_shards, config_shard_blocks(&cache_config), &cache_config);
+	ztier_t *fresh = old_tier != NULL ? ztier_create(cache_config.tier_bytes) : NULL;
+	if (table == NULL || (old_tier != NULL && fresh == NULL)) {
+		if (table != NULL) {
+			table_free(table, num_shards);
+		}
+		ztier_destroy(fresh);
+		pthread_mutex_unlock(&resize_lock);
+		return -1;
+	}
+
+	// Swap them in with every old shard locked, unless a block is pinned or
+	// held by a ref, which must not outlive its shard
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_lock(&old[i].lock);
+	}
+	bool held = table_held(old);
+	if (!held) {
+		__atomic_store_n(&tier, fresh, __ATOMIC_RELEASE);
+		__atomic_store_n(&shards, table, __ATOMIC_RELEASE);
+	}
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_unlock(&old[i].lock);
+	}
+	if (held) {
+		table_free(table, num_shards);
+		ztier_destroy(fresh);
+		pthread_mutex_unlock(&resize_lock);
+		return -1;
+	}
+
+	// Make every copy in the threads' L1s stale, then free the old shards
+	// and tier once no thread can still be using them
+	for (int i = 0; i < CACHE_L1_STRIPES; i++) {
+		__atomic_add_fetch(&l1_generations[i], 1, __ATOMIC_RELEASE);
+	}
+	epoch_synchronize();
+	table_free(old, num_shards);
+	ztier_destroy(old_tier);
+	pthread_mutex_unlock(&resize_lock);
+	return 1;
 }
 
 // Destroy the cache
@@ -36,89 +1783,866 @@ int cache_destroy(void) {
 		return -1;
 	}
 
-	// Free the memory used by the cache and reset cache-related variables
-	free(cache);
-	cache = NULL;
+	// Free the memory used by the cache and reset cache-related variables; the
+	// counters stay readable until the next cache is created
+	table_free(shards, num_shards);
+	shards = NULL;
+	num_shards = 0;
 	cache_size = 0;
-	num_queries = 0;
-	num_hits = 0;
+	if (tier != NULL) {
+		tier_last_blocks = ztier_usage(tier, &tier_last_bytes);
+		ztier_destroy(tier);
+		tier = NULL;
+	}
+	for (int i = 0; i < CACHE_MAX_THREADS; i++) {
+		free(thread_stats[i].l1);
+		thread_stats[i].l1 = NULL;
+	}
 
 	// Return success
     return 1;
 }
 
 
+/* returns the generation stripe of the block with hash |h| */
+static uint32_t *l1_stripe(uint64_t h) {
+	return &l1_generations[h & (CACHE_L1_STRIPES - 1)];
+}
+
+/* returns the calling thread's L1 line for the block with hash |h|, or NULL
+ * if the cache has no L1 or the thread shares its stats slot and so cannot
+ * have one of its own */
+static cache_l1_line_t *l1_line(cache_thread_stats_t *stats, uint64_t h) {
+	int num_lines = cache_config.l1_entries;
+	if (num_lines == 0 || stats == &thread_stats[CACHE_MAX_THREADS - 1]) {
+		return NULL;
+	}
+	if (stats->l1 == NULL) {
+		cache_l1_line_t *l1 = aligned_alloc(64, num_lines * sizeof(cache_l1_line_t));
+		if (l1 == NULL) {
+			return NULL;
+		}
+		for (int i = 0; i < num_lines; i++) {
+			l1[i].disk_num = -1;
+			l1[i].refs = 0;
+		}
+		__atomic_store_n(&stats->l1, l1, __ATOMIC_RELEASE);
+	}
+	return &stats->l1[(h >> 32) & (num_lines - 1)];
+}
+
+/* returns whether |line| holds the block at |disk_num| and |block_num| as of
+ * generation |generation| of its stripe */
+static bool l1_holds(const cache_l1_line_t *line, int disk_num, int block_num, uint32_t generation) {
+	return line->disk_num == disk_num && line->block_num == block_num && line->generation == generation;
+}
+
+/* fills |line| with the block at |disk_num| and |block_num|, read from the
+ * shard after generation |generation| of its stripe was loaded, and returns
+ * whether it could: a held line is left alone */
+static bool l1_fill(cache_l1_line_t *line, int disk_num, int block_num, uint32_t generation,
+                    const uint8_t *block) {
+	if (__atomic_load_n(&line->refs, __ATOMIC_ACQUIRE) != 0) {
+		return false;
+	}
+	line->disk_num = disk_num;
+	line->block_num = block_num;
+	line->generation = generation;
+	memcpy(line->block, block, JBOD_BLOCK_SIZE);
+	return true;
+}
+
+/* returns the L1 line whose block |ref| points to, or NULL */
+static cache_l1_line_t *l1_find_ref(const uint8_t *ref) {
+	int num_lines = cache_config.l1_entries;
+	for (int i = 0; num_lines > 0 && i < CACHE_MAX_THREADS - 1; i++) {
+		cache_l1_line_t *l1 = __atomic_load_n(&thread_stats[i].l1, __ATOMIC_ACQUIRE);
+		if (l1 != NULL && ref >= (const uint8_t *) l1 && ref < (const uint8_t *) (l1 + num_lines)) {
+			return &l1[(ref - (const uint8_t *) l1) / sizeof(cache_l1_line_t)];
+		}
+	}
+	return NULL;
+}
+
+/* moves the block at |disk_num| and |block_num|, with hash |h|, from the
+ * compressed tier into shard |s|, which the caller holds locked, and copies
+ * it to |buf|; returns its entry, or -1 if the tier does not hold it */
+static int shard_promote(cache_shard_t *s, int disk_num, int block_num, uint64_t h, uint8_t *buf) {
+	if (tier == NULL || !ztier_take(tier, disk_num, block_num, h, buf)) {
+		return -1;
+	}
+	stats_bump(&stats_slot()->counters.tier_hits);
+	return shard_insert(s, disk_num, block_num, buf, false);
+}
+
+/* counts a lookup on disk |disk_num| in the calling thread's stats */
+static void lookup_record(cache_thread_stats_t *stats, int disk_num) {
+	stats_bump(&stats->policy_queries[cache_policy]);
+	uint64_t *counts = stats_disk(stats, disk_num);
+	if (counts != NULL) {
+		stats_bump(&counts[0]);
+	}
+}
+
+/* counts a lookup of the block with hash |h| of shard |s| in the miss-ratio
+ * curve and the admission filter */
+static void lookup_sample(cache_shard_t *s, uint64_t h) {
+	if (mrc != NULL) {
+		mrc_record(mrc, h);
+	}
+	tinylfu_t *sketch = __atomic_load_n(&s->sketch, __ATOMIC_RELAXED);
+	if (sketch != NULL) {
+		tinylfu_record(sketch, h);
+	}
+}
+
+/* counts a hit on disk |disk_num| in the calling thread's stats */
+static void lookup_hit(cache_thread_stats_t *stats, int disk_num) {
+	stats_bump(&stats->counters.hits);
+	uint64_t *counts = stats_disk(stats, disk_num);
+	if (counts != NULL) {
+		stats_bump(&counts[1]);
+	}
+	stats_bump(&stats->policy_hits[cache_policy]);
+}
+
+/* looks the block at |disk_num| and |block_num|, with hash |h|, up in the
+ * shards of |table|, whose epoch the calling thread is in, copying it to
+ * |buf| and, if |line| is not NULL, into that L1 line as of |generation|;
+ * returns 1 if the block is cached and -1 if not */
+static int lookup_shard(cache_thread_stats_t *stats, cache_shard_t *table, int disk_num, int block_num,
+                        uint64_t h, cache_l1_line_t *line, uint32_t generation, uint8_t *buf) {
+	// Count the access for the miss-ratio curve and the admission filter
+	cache_shard_t *s = shard_of(table, h);
+	lookup_sample(s, h);
+
+	// Try to copy the block without the lock, and take the lock only if that
+	// fails; a block the shard does not hold may be in the compressed tier
+	int e = entry_read_unlocked(s, h, disk_num, block_num, buf);
+	if (e == -1) {
+		s = shard_lock(table, h);
+		e = entry_find(s, disk_num, block_num);
+		if (e != -1 && s->entry_data[e] != -1) {
+			memcpy(buf, s->blocks[s->entry_data[e]], JBOD_BLOCK_SIZE);
+		} else {
+			e = shard_promote(s, disk_num, block_num, h, buf);
+		}
+		shard_unlock(s);
+	}
+	if (e == -1) {
+		return -1;
+	}
+
+	// Mark the block referenced and keep a copy in the L1
+	entry_reference(s, e);
+	if (line != NULL) {
+		l1_fill(line, disk_num, block_num, generation, buf);
+	}
+	lookup_hit(stats, disk_num);
+	return 1;
+}
+
+/* prefetches the index group, or the set, that a lookup of the block with
+ * hash |h| in |table| probes first */
+static void lookup_prefetch(cache_shard_t *table, uint64_t h) {
+	cache_shard_t *s = shard_of(table, h);
+	if (s->ways != 0) {
+		__builtin_prefetch(&s->entry_block[set_first(s, h)]);
+		__builtin_prefetch(&s->entry_disk[set_first(s, h)]);
+	} else {
+		__builtin_prefetch(&s->index_tags[(h & s->index_group_mask) * INDEX_GROUP]);
+	}
+}
+
 // Look up a block in the cache
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
 	// Increment the number of cache queries
-	num_queries++;
+	cache_thread_stats_t *stats = stats_slot();
+	stats_bump(&stats->counters.queries);
+
+	// Check if the cache is enabled, if the buffer is valid, and if the disk and block numbers are valid
+	if (!cache_enabled() || buf == NULL || disk_num < 0 || block_num < 0) {
+		return -1;
+	}
+
+	// Serve the block from the thread's L1 if it holds a current copy
+	uint64_t h = index_hash(disk_num, block_num);
+	lookup_record(stats, disk_num);
+	cache_l1_line_t *line = l1_line(stats, h);
+	uint32_t generation = line == NULL ? 0 : __atomic_load_n(l1_stripe(h), __ATOMIC_ACQUIRE);
+	if (line != NULL && l1_holds(line, disk_num, block_num, generation)) {
+		memcpy(buf, line->block, JBOD_BLOCK_SIZE);
+		stats_bump(&stats->counters.l1_hits);
+		lookup_hit(stats, disk_num);
+		return 1;
+	}
+
+	// Otherwise look in the block's shard
+	int rc = lookup_shard(stats, epoch_enter(stats), disk_num, block_num, h, line, generation, buf);
+	epoch_exit(stats);
+	return rc;
+}
 
-	// Check if the cache is enabled, if the buffer is valid, and if the disk and block numbers are within a valid range
-	if (!cache_enabled() || buf == NULL || disk_num < 0 || block_num < 0 || disk_num > 15 || block_num > 255) {
+int cache_lookup_many(const cache_key_t *keys, int n, uint8_t **bufs, uint64_t *hit_mask) {
+	// Check the batch once; a key that no block can have just misses
+	if (!cache_enabled() || keys == NULL || bufs == NULL || hit_mask == NULL || n < 0 || n > CACHE_BATCH_MAX) {
 		return -1;
 	}
+	cache_thread_stats_t *stats = stats_slot();
+	*hit_mask = 0;
 
-	// Loop through the cache and check if the block is in the cache
-	for (int i = 0; i < cache_size; i++) {
-		if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-			// If the block is in the cache, copy the block data to the buffer, update the access time, and return success
-			num_hits++;
-			memcpy(buf, cache[i].block, JBOD_BLOCK_SIZE);
-			cache[i].access_time = ++clock;
-			return 1;
+	// Serve what the thread's L1 holds and hash the rest
+	uint64_t hashes[CACHE_BATCH_MAX];
+	cache_l1_line_t *lines[CACHE_BATCH_MAX];
+	uint32_t generations[CACHE_BATCH_MAX];
+	uint64_t pending = 0;
+	for (int i = 0; i < n; i++) {
+		int disk_num = keys[i].disk_num, block_num = keys[i].block_num;
+		stats_bump(&stats->counters.queries);
+		if (bufs[i] == NULL || disk_num < 0 || block_num < 0) {
+			continue;
+		}
+		hashes[i] = index_hash(disk_num, block_num);
+		lookup_record(stats, disk_num);
+		lines[i] = l1_line(stats, hashes[i]);
+		generations[i] = lines[i] == NULL ? 0 : __atomic_load_n(l1_stripe(hashes[i]), __ATOMIC_ACQUIRE);
+		if (lines[i] != NULL && l1_holds(lines[i], disk_num, block_num, generations[i])) {
+			memcpy(bufs[i], lines[i]->block, JBOD_BLOCK_SIZE);
+			stats_bump(&stats->counters.l1_hits);
+			lookup_hit(stats, disk_num);
+			*hit_mask |= 1ull << i;
+		} else {
+			pending |= 1ull << i;
+		}
+	}
+	if (pending == 0) {
+		return __builtin_popcountll(*hit_mask);
+	}
+
+	// Look the rest up in their shards within one epoch, starting the loads of
+	// every index group they probe before the first probe waits on its own
+	cache_shard_t *table = epoch_enter(stats);
+	for (uint64_t m = pending; m != 0; m &= m - 1) {
+		lookup_prefetch(table, hashes[__builtin_ctzll(m)]);
+	}
+	for (uint64_t m = pending; m != 0; m &= m - 1) {
+		int i = __builtin_ctzll(m);
+		if (lookup_shard(stats, table, keys[i].disk_num, keys[i].block_num, hashes[i], lines[i], generations[i],
+		                 bufs[i]) == 1) {
+			*hit_mask |= 1ull << i;
+		}
+	}
+	epoch_exit(stats);
+	return __builtin_popcountll(*hit_mask);
+}
+
+
+int cache_get_ref(int disk_num, int block_num, uint8_t *buf, cache_ref_t *ref) {
+	ref->data = NULL;
+	ref->held = false;
+	cache_thread_stats_t *stats = stats_slot();
+	stats_bump(&stats->counters.queries);
+	if (!cache_enabled() || disk_num < 0 || block_num < 0) {
+		return -1;
+	}
+
+	// Pin the thread's L1 line if it holds a current copy
+	uint64_t h = index_hash(disk_num, block_num);
+	lookup_record(stats, disk_num);
+	cache_l1_line_t *line = l1_line(stats, h);
+	uint32_t generation = line == NULL ? 0 : __atomic_load_n(l1_stripe(h), __ATOMIC_ACQUIRE);
+	if (line != NULL && l1_holds(line, disk_num, block_num, generation)) {
+		__atomic_add_fetch(&line->refs, 1, __ATOMIC_RELAXED);
+		stats_bump(&stats->counters.l1_hits);
+		lookup_hit(stats, disk_num);
+		ref->data = line->block;
+		ref->held = true;
+		return 1;
+	}
+
+	// Count the access as cache_lookup does, then find the block under the lock
+	cache_shard_t *table = epoch_enter(stats);
+	lookup_sample(shard_of(table, h), h);
+	cache_shard_t *s = shard_lock(table, h);
+	int e = entry_find(s, disk_num, block_num);
+	if (e == -1 || s->entry_data[e] == -1) {
+		uint8_t block[JBOD_BLOCK_SIZE];
+		e = shard_promote(s, disk_num, block_num, h, block);
+	}
+	if (e != -1) {
+		// Copy the block into the L1 and hold the line there if it is free, or
+		// else hold its payload slot, unless no spare would be left to write
+		// the entry to while it is held, in which case hand out a copy
+		int d = s->entry_data[e];
+		if (line != NULL && l1_fill(line, disk_num, block_num, generation, s->blocks[d])) {
+			__atomic_add_fetch(&line->refs, 1, __ATOMIC_RELAXED);
+			ref->data = line->block;
+			ref->held = true;
+		} else if (s->slot_refs[d] != 0 || s->held_live < s->num_spare) {
+			if (s->slot_refs[d] == 0) {
+				s->held_live++;
+				__atomic_add_fetch(&s->num_held, 1, __ATOMIC_RELAXED);
+			}
+			s->slot_refs[d]++;
+			ref->data = s->blocks[d];
+			ref->held = true;
+		} else {
+			memcpy(buf, s->blocks[d], JBOD_BLOCK_SIZE);
+			ref->data = buf;
+		}
+		entry_reference(s, e);
+	}
+	shard_unlock(s);
+	epoch_exit(stats);
+
+	if (ref->data == NULL) {
+		return -1;
+	}
+	lookup_hit(stats, disk_num);
+	return 1;
+}
+
+/* returns the shard of |table| whose slab holds |ref|, or NULL */
+static cache_shard_t *table_find_ref(cache_shard_t *table, const uint8_t *ref) {
+	for (int i = 0; table != NULL && i < num_shards; i++) {
+		cache_shard_t *s = &table[i];
+		if (ref >= s->blocks[0] && ref < s->blocks[s->num_slots]) {
+			return s;
 		}
 	}
-	
-	// If the block is not in the cache, return failure
-  	return -1;
+	return NULL;
 }
 
+void cache_put_ref(cache_ref_t *ref) {
+	// A copy holds nothing of the cache's
+	const uint8_t *data = ref->data;
+	bool held = ref->held;
+	ref->data = NULL;
+	ref->held = false;
+	if (!held) {
+		return;
+	}
+
+	// A block served from an L1 is held in its line, which any thread may put
+	cache_l1_line_t *line = l1_find_ref(data);
+	if (line != NULL) {
+		__atomic_sub_fetch(&line->refs, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	// Find the shard the block is held in, which may be one cache_resize
+	// has replaced but waits to free. No epoch is needed: neither table can be
+	// freed while the ref is held, since a resize waits for the refs into the
+	// table it replaced and resizes do not overlap. The current table is
+	// searched first, so that a resize swapping it meanwhile leaves the
+	// block's shard in the retired table.
+	cache_shard_t *s = table_find_ref(__atomic_load_n(&shards, __ATOMIC_ACQUIRE), data);
+	if (s == NULL) {
+		s = table_find_ref(__atomic_load_n(&retired, __ATOMIC_ACQUIRE), data);
+	}
+	assert(s != NULL);
+
+	// Release the slot; an orphaned slot becomes a spare once no one holds it
+	pthread_mutex_lock(&s->lock);
+	int d = (data - s->blocks[0]) / JBOD_BLOCK_SIZE;
+	assert((s->slot_refs[d] & ~SLOT_ORPHAN) > 0);
+	if (--s->slot_refs[d] == SLOT_ORPHAN) {
+		s->slot_refs[d] = 0;
+		s->spare_slots[s->num_spare++] = d;
+	} else if (s->slot_refs[d] == 0) {
+		s->held_live--;
+	}
+	bool released = s->slot_refs[d] == 0;
+	pthread_mutex_unlock(&s->lock);
+
+	// Count the slot out last: a replaced shard may be freed as soon as its
+	// count drops to zero
+	if (released) {
+		__atomic_sub_fetch(&s->num_held, 1, __ATOMIC_RELEASE);
+	}
+}
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
+	if (!cache_enabled()) {
+		return;
+	}
+
 	// Look for the cache entry corresponding to the given disk block
-	for (int i = 0; i < cache_size; i++) {
-		if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-			// Update the cache entry with the new block contents and access time
-			memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
-			cache[i].access_time = ++clock;
-			return;
-		}
+	cache_thread_stats_t *stats = stats_slot();
+	stats_bump(&stats->counters.updates);
+	uint64_t h = index_hash(disk_num, block_num);
+	cache_shard_t *s = shard_lock(epoch_enter(stats), h);
+	int e = entry_find(s, disk_num, block_num);
+	if (e != -1 && s->entry_data[e] != -1) {
+		// Update the cache entry with the new block contents and mark it recently used
+		entry_dirty(s, e);
+		entry_own_slot(s, e);
+		memcpy(s->blocks[s->entry_data[e]], buf, JBOD_BLOCK_SIZE);
+		entry_refresh(s, e);
+		stats_bump(&stats->counters.update_hits);
+	}
+	// If the cache entry is not found, do nothing but update the block's copy
+	// in the compressed tier, and make its L1 copies stale; both may outlive
+	// its entry
+	if (tier != NULL) {
+		ztier_update(tier, disk_num, block_num, h, buf);
+	}
+	if (cache_config.l1_entries > 0) {
+		__atomic_add_fetch(l1_stripe(h), 1, __ATOMIC_RELEASE);
+	}
+	shard_unlock(s);
+	epoch_exit(stats);
+}
+
+int cache_invalidate(int disk_num, int block_num) {
+	if (!cache_enabled() || disk_num < 0 || block_num < 0) {
+		return -1;
+	}
+
+	// Drop the block's entry, if it holds the block, pinned or not
+	cache_thread_stats_t *stats = stats_slot();
+	uint64_t h = index_hash(disk_num, block_num);
+	cache_shard_t *s = shard_lock(epoch_enter(stats), h);
+	int e = entry_find(s, disk_num, block_num);
+	int rc = 0;
+	if (e != -1 && s->entry_data[e] != -1) {
+		entry_remove(s, e);
+		stats_bump(&stats->counters.invalidations);
+		rc = 1;
+	}
+
+	// Along with its copy in the compressed tier and in every thread's L1
+	uint8_t scratch[JBOD_BLOCK_SIZE];
+	if (tier != NULL) {
+		ztier_take(tier, disk_num, block_num, h, scratch);
+	}
+	if (cache_config.l1_entries > 0) {
+		__atomic_add_fetch(l1_stripe(h), 1, __ATOMIC_RELEASE);
 	}
-	// If the cache entry is not found, do nothing
+	shard_unlock(s);
+	epoch_exit(stats);
+	return rc;
 }
 
 
 int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
+    return cache_insert_with(disk_num, block_num, buf, CACHE_PRIORITY_NORMAL);
+}
+
+int cache_insert_with(int disk_num, int block_num, const uint8_t *buf, cache_priority_t priority) {
     // Check if the cache is enabled and the input parameters are valid
-    if (!cache_enabled() || buf == NULL || disk_num < 0 || block_num < 0 || disk_num > 15 || block_num > 255) {
+    if (!cache_enabled() || buf == NULL || disk_num < 0 || block_num < 0 ||
+        priority < 0 || priority >= CACHE_PRIORITY_COUNT) {
         return -1;
     }
+    cache_thread_stats_t *stats = stats_slot();
+    uint64_t h = index_hash(disk_num, block_num);
+    cache_shard_t *s = shard_lock(epoch_enter(stats), h);
 
-    int least_used = 0;
-    // Look for an existing cache entry for the given disk and block number
-    for(int i = 0; i < cache_size; i++) {
-        if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-            return -1; // Entry already exists, return an error
-        }
-        // Find the least recently used entry
-        if (cache[i].access_time < cache[least_used].access_time) {
-            least_used = i;
-        }
+    // Insert the block into its shard, where its priority puts it; fails if
+    // there is already an entry for it
+    int e = shard_insert(s, disk_num, block_num, buf, false);
+    if (e != -1) {
+        entry_prioritize(s, e, priority);
     }
-    // Insert the new cache entry in the least recently used slot
-    cache[least_used].valid = true;
-    cache[least_used].disk_num = disk_num;
-    cache[least_used].block_num = block_num;
-    memcpy(cache[least_used].block, buf, JBOD_BLOCK_SIZE);
-    cache[least_used].access_time = 1;
+    shard_unlock(s);
+    epoch_exit(stats);
+    if (e == -1) {
+        return -1;
+    }
+    stats_bump(&stats->counters.inserts);
     return 1;
 }
 
 
+int cache_insert_many(const cache_key_t *keys, int n, uint8_t *const *bufs) {
+	// Check the batch once; blocks with keys no block can have are skipped
+	if (!cache_enabled() || keys == NULL || bufs == NULL || n < 0 || n > CACHE_BATCH_MAX) {
+		return -1;
+	}
+	uint64_t hashes[CACHE_BATCH_MAX];
+	uint64_t pending = 0;
+	for (int i = 0; i < n; i++) {
+		if (bufs[i] != NULL && keys[i].disk_num >= 0 && keys[i].block_num >= 0) {
+			hashes[i] = index_hash(keys[i].disk_num, keys[i].block_num);
+			pending |= 1ull << i;
+		}
+	}
+
+	// Insert the blocks shard by shard, in the order given within each, so
+	// that every shard is locked once however many of the blocks it caches
+	cache_thread_stats_t *stats = stats_slot();
+	cache_shard_t *table = epoch_enter(stats);
+	int inserted = 0;
+	while (pending != 0) {
+		int first = __builtin_ctzll(pending);
+		cache_shard_t *s = shard_lock(table, hashes[first]);
+		uint32_t shard = shard_index(hashes[first]);
+		for (uint64_t m = pending; m != 0; m &= m - 1) {
+			int i = __builtin_ctzll(m);
+			if (shard_index(hashes[i]) != shard) {
+				continue;
+			}
+			pending &= ~(1ull << i);
+			int e = shard_insert(s, keys[i].disk_num, keys[i].block_num, bufs[i], false);
+			shard_clean(s);
+			if (e != -1) {
+				stats_bump(&stats->counters.inserts);
+				inserted++;
+			}
+		}
+		shard_unlock(s);
+	}
+	epoch_exit(stats);
+	return inserted;
+}
+
+int cache_pin(int disk_num, int block_num) {
+	if (!cache_enabled() || disk_num < 0 || block_num < 0) {
+		return -1;
+	}
+
+	// Pin the block's entry if it holds the block and the shard can spare it
+	cache_thread_stats_t *stats = stats_slot();
+	cache_shard_t *s = shard_lock(epoch_enter(stats), index_hash(disk_num, block_num));
+	int e = entry_find(s, disk_num, block_num);
+	int rc = (e != -1 && s->entry_data[e] != -1 && entry_pin(s, e)) ? 1 : -1;
+	shard_unlock(s);
+	epoch_exit(stats);
+	return rc;
+}
+
+int cache_unpin(int disk_num, int block_num) {
+	if (!cache_enabled() || disk_num < 0 || block_num < 0) {
+		return -1;
+	}
+
+	cache_thread_stats_t *stats = stats_slot();
+	cache_shard_t *s = shard_lock(epoch_enter(stats), index_hash(disk_num, block_num));
+	int e = entry_find(s, disk_num, block_num);
+	int rc = -1;
+	if (e != -1 && s->entry_pinned[e]) {
+		entry_unpin(s, e);
+		rc = 1;
+	}
+	shard_unlock(s);
+	epoch_exit(stats);
+	return rc;
+}
+
+// Save the cached blocks to a file
+int cache_save(const char *path) {
+	// Check if the cache is enabled and the path is valid
+	if (!cache_enabled() || path == NULL) {
+		return -1;
+	}
+
+	// Write to a temporary file that replaces the old one only once complete,
+	// so that a crash never leaves a torn file behind
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+		return -1;
+	}
+	FILE *f = fopen(tmp_path, "wb");
+	if (f == NULL) {
+		return -1;
+	}
+
+	// Keep resizes out while the shards are written one at a time, each locked
+	pthread_mutex_lock(&resize_lock);
+	int most = 0;
+	for (int i = 0; i < num_shards; i++) {
+		most = shards[i].num_entries > most ? shards[i].num_entries : most;
+	}
+	int *order = malloc(most * sizeof(int));
+	set_rank_t *ranks = malloc(most * sizeof(set_rank_t));
+	cache_file_header_t header = { CACHE_FILE_MAGIC, CACHE_FILE_VERSION, JBOD_BLOCK_SIZE, 0 };
+	int rc = order != NULL && ranks != NULL && fwrite(&header, sizeof(header), 1, f) == 1 ? 1 : -1;
+	for (int i = 0; i < num_shards && rc == 1; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		int n = shard_save(&shards[i], f, order, ranks);
+		pthread_mutex_unlock(&shards[i].lock);
+		header.num_records += n;
+		rc = n == -1 ? -1 : 1;
+	}
+	pthread_mutex_unlock(&resize_lock);
+	free(order);
+	free(ranks);
+
+	// Fill in the number of records and put the file in place
+	if (rc == 1 && (fseek(f, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, f) != 1 || fflush(f) != 0 ||
+	                fsync(fileno(f)) != 0)) {
+		rc = -1;
+	}
+	if (fclose(f) != 0 || rc == -1 || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return 1;
+}
+
+// Load the blocks saved by cache_save into the cache
+int cache_load(const char *path, cache_validator_t validate) {
+	// Check if the cache is enabled and the path is valid
+	if (!cache_enabled() || path == NULL) {
+		return -1;
+	}
+
+	// Map the file rather than reading it, so that the records are only
+	// copied once, into the cache
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(cache_file_header_t)) {
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	// Check that the file is one cache_save wrote for blocks of this size
+	const cache_file_header_t *header = map;
+	size_t body = st.st_size - sizeof(cache_file_header_t);
+	if (memcmp(header->magic, CACHE_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != CACHE_FILE_VERSION || header->block_size != JBOD_BLOCK_SIZE ||
+	    body % sizeof(cache_file_record_t) != 0 || body / sizeof(cache_file_record_t) != header->num_records) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	// Insert the records in file order, skipping the damaged ones and the ones
+	// the caller finds out of date. The intact records are validated a batch
+	// at a time, so that a validator asking the server pays a round trip per
+	// batch rather than per block, and outside the shard lock
+	const cache_file_record_t *records = (const cache_file_record_t *) (header + 1);
+	cache_thread_stats_t *stats = stats_slot();
+	int loaded = 0;
+	uint64_t next = 0;
+	while (next < header->num_records) {
+		const cache_file_record_t *batch[CACHE_BATCH_MAX];
+		cache_key_t keys[CACHE_BATCH_MAX];
+		const uint8_t *bufs[CACHE_BATCH_MAX];
+		int n = 0;
+		for (; next < header->num_records && n < CACHE_BATCH_MAX; next++) {
+			const cache_file_record_t *r = &records[next];
+			if (r->disk_num < 0 || r->block_num < 0 || r->checksum != record_checksum(r)) {
+				continue;
+			}
+			batch[n] = r;
+			keys[n] = (cache_key_t) { r->disk_num, r->block_num };
+			bufs[n++] = r->block;
+		}
+		uint64_t valid_mask = (n == CACHE_BATCH_MAX) ? ~0ull : (1ull << n) - 1;
+		if (validate != NULL && validate(keys, n, bufs, &valid_mask) == -1) {
+			continue;
+		}
+		for (int i = 0; i < n; i++) {
+			const cache_file_record_t *r = batch[i];
+			if (!(valid_mask & (1ull << i))) {
+				continue;
+			}
+			cache_shard_t *s = shard_lock(epoch_enter(stats), index_hash(r->disk_num, r->block_num));
+			int e = shard_insert(s, r->disk_num, r->block_num, r->block, r->flags & RECORD_ADMITTED);
+			if (e != -1 && (r->flags & RECORD_REFERENCED)) {
+				entry_reference(s, e);
+			}
+			shard_unlock(s);
+			epoch_exit(stats);
+			loaded += e != -1;
+		}
+	}
+
+	munmap(map, st.st_size);
+	return loaded;
+}
+
 bool cache_enabled(void) {
-	return cache != NULL && cache_size > 0;
+	return shards != NULL && cache_size > 0;
+}
+
+int cache_policy_by_name(const char *name) {
+	for (int i = 0; i < CACHE_POLICY_COUNT; i++) {
+		if (strcmp(name, policies[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+double cache_miss_ratio(int num_entries) {
+	return mrc == NULL || num_entries < 0 ? -1 : mrc_miss_ratio(mrc, num_entries);
+}
+
+void cache_get_stats(cache_stats_t *stats) {
+	// Sum the counters of every thread, one uint64_t at a time
+	uint64_t sums[sizeof(cache_counters_t) / sizeof(uint64_t)];
+	for (size_t i = 0; i < sizeof(sums) / sizeof(sums[0]); i++) {
+		sums[i] = stats_sum(offsetof(cache_thread_stats_t, counters) + i * sizeof(uint64_t));
+	}
+	cache_counters_t counters;
+	memcpy(&counters, sums, sizeof(counters));
+
+	memset(stats, 0, sizeof(*stats));
+	stats->num_entries = cache_config.num_entries;
+	stats->queries = counters.queries;
+	stats->hits = counters.hits;
+	stats->l1_hits = counters.l1_hits;
+	stats->tier_hits = counters.tier_hits;
+	if (tier != NULL) {
+		stats->tier_blocks = ztier_usage(tier, &stats->tier_bytes);
+	} else {
+		stats->tier_blocks = tier_last_blocks;
+		stats->tier_bytes = tier_last_bytes;
+	}
+	stats->num_disks = stats_disks;
+	stats->inserts = counters.inserts;
+	stats->evictions = counters.evictions;
+	stats->updates = counters.updates;
+	stats->update_hits = counters.update_hits;
+	stats->invalidations = counters.invalidations;
+	memcpy(stats->eviction_age, counters.eviction_age, sizeof(stats->eviction_age));
+	if (mrc != NULL) {
+		stats->first_lookups = mrc_reuse_histogram(mrc, stats->reuse_distance, CACHE_STATS_BUCKETS);
+	}
+}
+
+void cache_get_disk_stats(int disk_num, uint64_t *queries, uint64_t *hits) {
+	*queries = 0;
+	*hits = 0;
+	if (disk_num < 0 || disk_num >= stats_disks) {
+		return;
+	}
+	for (int i = 0; i < CACHE_MAX_THREADS; i++) {
+		uint64_t *counts = __atomic_load_n(&thread_stats[i].disk_counts, __ATOMIC_ACQUIRE);
+		if (counts != NULL) {
+			*queries += __atomic_load_n(&counts[disk_num * 2], __ATOMIC_RELAXED);
+			*hits += __atomic_load_n(&counts[disk_num * 2 + 1], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int cache_set_stats_disks(int num_disks) {
+	uint64_t *resized[CACHE_MAX_THREADS];
+
+	if (num_disks <= 0) {
+		return -1;
+	}
+	if (num_disks == stats_disks) {
+		return 1;
+	}
+
+	// Allocate every thread's new counters before giving up any old ones
+	for (int i = 0; i < CACHE_MAX_THREADS; i++) {
+		resized[i] = NULL;
+		if (thread_stats[i].disk_counts != NULL &&
+		    (resized[i] = calloc((size_t) num_disks * 2, sizeof(uint64_t))) == NULL) {
+			while (i-- > 0) {
+				free(resized[i]);
+			}
+			return -1;
+		}
+	}
+
+	// Carry the counts of the disks both sizes cover over
+	int common = num_disks < stats_disks ? num_disks : stats_disks;
+	for (int i = 0; i < CACHE_MAX_THREADS; i++) {
+		if (resized[i] != NULL) {
+			memcpy(resized[i], thread_stats[i].disk_counts, (size_t) common * 2 * sizeof(uint64_t));
+		}
+		free(thread_stats[i].disk_counts);
+		thread_stats[i].disk_counts = resized[i];
+	}
+	stats_disks = num_disks;
+	return 1;
+}
+
+/* writes the |n| counts of |values| to |f| as a JSON array */
+static void dump_counts(FILE *f, const uint64_t *values, int n) {
+	fputc('[', f);
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "%s%" PRIu64, i > 0 ? "," : "", values[i]);
+	}
+	fputc(']', f);
+}
+
+/* writes the lookups (|which| 0) or hits (|which| 1) of each of the |n|
+ * disks to |f| as a JSON array */
+static void dump_disk_counts(FILE *f, int n, int which) {
+	uint64_t counts[2];
+
+	fputc('[', f);
+	for (int i = 0; i < n; i++) {
+		cache_get_disk_stats(i, &counts[0], &counts[1]);
+		fprintf(f, "%s%" PRIu64, i > 0 ? "," : "", counts[which]);
+	}
+	fputc(']', f);
+}
+
+void cache_dump_stats(FILE *f) {
+	cache_stats_t stats;
+	cache_get_stats(&stats);
+
+	fprintf(f, "{\"num_entries\":%d,\"queries\":%" PRIu64 ",\"hits\":%" PRIu64 ",\"l1_hits\":%" PRIu64
+	        ",\"tier_hits\":%" PRIu64 ",\"tier_blocks\":%" PRIu64 ",\"tier_bytes\":%zu,\"disk_queries\":",
+	        stats.num_entries, stats.queries, stats.hits, stats.l1_hits, stats.tier_hits, stats.tier_blocks,
+	        stats.tier_bytes);
+	dump_disk_counts(f, stats.num_disks, 0);
+	fprintf(f, ",\"disk_hits\":");
+	dump_disk_counts(f, stats.num_disks, 1);
+	fprintf(f, ",\"inserts\":%" PRIu64 ",\"evictions\":%" PRIu64 ",\"updates\":%" PRIu64
+	        ",\"update_hits\":%" PRIu64 ",\"invalidations\":%" PRIu64 ",\"eviction_age\":",
+	        stats.inserts, stats.evictions, stats.updates, stats.update_hits, stats.invalidations);
+	dump_counts(f, stats.eviction_age, CACHE_STATS_BUCKETS);
+	fprintf(f, ",\"reuse_distance\":[");
+	for (int i = 0; i < CACHE_STATS_BUCKETS; i++) {
+		fprintf(f, "%s%.0f", i > 0 ? "," : "", stats.reuse_distance[i]);
+	}
+	fprintf(f, "],\"first_lookups\":%.0f}\n", stats.first_lookups);
 }
 
 void cache_print_hit_rate(void) {
-	fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
-}
\ No newline at end of file
+	uint64_t num_queries = stats_sum(offsetof(cache_thread_stats_t, counters.queries));
+	uint64_t num_hits = stats_sum(offsetof(cache_thread_stats_t, counters.hits));
+	if (num_queries > 0) {
+		fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
+	} else {
+		fprintf(stderr, "Hit rate:   n/a (no lookups)\n");
+	}
+
+	// Break the hit rate down by every policy that has seen queries
+	for (int i = 0; i < CACHE_POLICY_COUNT; i++) {
+		uint64_t queries = stats_sum(offsetof(cache_thread_stats_t, policy_queries[i]));
+		uint64_t hits = stats_sum(offsetof(cache_thread_stats_t, policy_hits[i]));
+		if (queries > 0) {
+			fprintf(stderr, "  %s: %5.1f%% (%" PRIu64 " of %" PRIu64 ")\n", policies[i].name,
+			        100 * (float) hits / queries, hits, queries);
+		}
+	}
+
+	// Show how much the compressed tier added, and how well it packed its blocks
+	cache_stats_t stats;
+	cache_get_stats(&stats);
+	if (stats.tier_hits > 0 || stats.tier_blocks > 0) {
+		fprintf(stderr, "  compressed tier: %" PRIu64 " hits, %" PRIu64 " blocks in %zu bytes (%.1fx)\n",
+		        stats.tier_hits, stats.tier_blocks, stats.tier_bytes,
+		        stats.tier_bytes > 0 ? (double) stats.tier_blocks * JBOD_BLOCK_SIZE / stats.tier_bytes : 0);
+	}
+
+	// Print the miss-ratio curve at doubling sizes, up to where it flattens out
+	if (mrc != NULL && mrc_miss_ratio(mrc, 0) >= 0) {
+		uint64_t flat = mrc_max_distance(mrc);
+		fprintf(stderr, "LRU miss ratio by cache size (%.1f%% of blocks sampled):\n", 100 * mrc_sample_rate(mrc));
+		for (uint64_t size = 1;; size *= 2) {
+			fprintf(stderr, "  %6" PRIu64 ": %5.1f%%\n", size, 100 * mrc_miss_ratio(mrc, size));
+			if (size >= flat) {
+				break;
+			}
+		}
+	}
+}
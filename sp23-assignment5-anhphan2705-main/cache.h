@@ -3,23 +3,100 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "jbod.h"
 #include "util.h"
 
+/* Eviction policies of a fully associative cache. LRU evicts the least
+ * recently used block. ARC balances recently and frequently used blocks and
+ * remembers as many evicted blocks as it caches, so that a scan does not
+ * flush blocks that are used over and over. A lookup hit only sets the
+ * block's reference bit, and a referenced block is given a second chance
+ * when it comes up for eviction, so recency is approximated as in CLOCK
+ * (and ARC behaves as CAR). */
+typedef enum {
+  CACHE_POLICY_LRU = 0,
+  CACHE_POLICY_ARC,
+  CACHE_POLICY_COUNT
+} cache_policy_t;
+
+/* Describes how cache_create_with organizes the cache. Fields left at 0
+ * give a single fully associative LRU cache. */
+#define CACHE_MAX_SHARDS 64
+#define CACHE_MAX_PIN_PERCENT 90
+
 typedef struct {
-  bool valid;
-  int disk_num;
-  int block_num;
-  uint8_t block[JBOD_BLOCK_SIZE];
-  int access_time;
-} cache_entry_t;
+  int num_entries;
+  /* 0 for a fully associative cache. Otherwise the entries, a multiple of
+   * |ways|, are split into sets of |ways| entries; a block may only be
+   * cached in the set its address hashes to, which evicts its least
+   * recently used entry, so |policy| must be CACHE_POLICY_LRU. */
+  int ways;
+  /* how a fully associative cache evicts */
+  cache_policy_t policy;
+  /* admit blocks the W-TinyLFU way (fully associative only): new blocks
+   * enter an LRU window of 10% of the entries, and a block leaving it only
+   * replaces the policy's victim if a sketch counting every lookup says it
+   * was looked up more often recently */
+  bool tinylfu;
+  /* up to CACHE_MAX_SHARDS equal shards, each caching the blocks whose
+   * address hashes to it under a lock of its own; the entries must divide
+   * evenly into them, and the sets or the policy work within each shard */
+  int shards;
+  /* sample the lookups to estimate the miss ratio of a fully associative
+   * LRU cache of any size (see cache_miss_ratio) */
+  bool mrc;
+  /* 0, or a power of two up to 1024: each of the first 63 threads keeps a
+   * direct-mapped L1 of that many blocks it hit on, served without writing
+   * shared memory and made stale by updates through a generation counter
+   * shared with a stripe of blocks. The policy does not see L1 hits, and
+   * since the filter and the curve must, it excludes |tinylfu| and |mrc|. */
+  int l1_entries;
+  /* 0, or the bytes of a compressed tier (see ztier.h) that evicted blocks
+   * go on to and that lookups missing the shards take them back from */
+  size_t tier_bytes;
+  /* the percentage, up to CACHE_MAX_PIN_PERCENT, of each shard's blocks
+   * that may be pinned with cache_pin */
+  int pin_percent;
+} cache_config_t;
+
+/* cache_lookup, cache_insert and cache_update may be called from several
+ * threads at once; creating and destroying the cache may not overlap with
+ * any other call. Inserts and updates lock the block's shard, while a
+ * lookup that hits copies the block without locking and checks that no
+ * writer changed it meanwhile. Hit counts are kept per thread and summed
+ * when printed. */
 
 /* Returns 1 on success and -1 on failure. Should allocate a space for
- * |num_entries| cache entries, each of type cache_entry_t. Calling it again
- * without first calling cache_destroy (see below) should fail. */
+ * |num_entries| cache entries. Entry metadata is kept in dense per-field
+ * arrays and the blocks in a separate page-aligned slab, each shard's in a
+ * single mapping that uses huge pages when it is large enough (see
+ * arena.h). Calling it again without first calling cache_destroy (see
+ * below) should fail. */
 int cache_create(int num_entries);
 
+/* Returns 1 on success and -1 on failure. Like cache_create, but organizes
+ * the cache as described by |config|. The number of entries is bounded by
+ * memory rather than by a fixed limit. */
+int cache_create_with(const cache_config_t *config);
+
+/* Returns 1 on success and -1 on failure. Changes the number of entries of
+ * the cache to |num_entries|, which must suit its configuration as for
+ * cache_create_with, keeping its blocks: growing keeps all of them, and
+ * shrinking keeps the ones the policy would have evicted last. May be called
+ * while other threads use the cache; they wait for it only if they need a
+ * shard lock while the blocks are being moved over, or if they are beyond
+ * the first 63 threads to use the cache. */
+int cache_resize(int num_entries);
+
+/* Returns 1 on success and -1 on failure. Drops every block from the cache,
+ * its compressed tier and the threads' L1s, keeping its configuration and
+ * counters, for when the array starts over from zeroed disks. Fails, and
+ * drops nothing, while a block is pinned with cache_pin or held with
+ * cache_get_ref. Lookups may run alongside, as with cache_resize. */
+int cache_clear(void);
+
 /* Returns 1 on success and -1 on failure. Frees the space allocated by
  * cache_create function above. */
 int cache_destroy(void);
@@ -29,20 +106,185 @@ int cache_destroy(void);
  * block to |buf|, which must not be NULL. */
 int cache_lookup(int disk_num, int block_num, uint8_t *buf);
 
+/* The key of a block in the batched calls below, which take up to
+ * CACHE_BATCH_MAX blocks at a time. */
+#define CACHE_BATCH_MAX 64
+
+typedef struct {
+  int disk_num;
+  int block_num;
+} cache_key_t;
+
+/* Returns the number of blocks found, or -1 if the batch is invalid. Looks
+ * up the |n| blocks of |keys| as cache_lookup would, copying each block found
+ * to its buffer in |bufs| and setting bit i of |hit_mask| if block i was
+ * found. The batch is checked and the table entered once, and the index
+ * groups of all the blocks are prefetched before the first is probed. */
+int cache_lookup_many(const cache_key_t *keys, int n, uint8_t **bufs, uint64_t *hit_mask);
+
+/* Returns the number of blocks inserted, or -1 if the batch is invalid.
+ * Inserts the |n| blocks of |keys| with the contents in |bufs| as
+ * cache_insert would, skipping blocks already cached and locking each shard
+ * once for all of its blocks. */
+int cache_insert_many(const cache_key_t *keys, int n, uint8_t *const *bufs);
+
+/* A block read with cache_get_ref: |data| points to its contents, held in
+ * the cache if |held| is set and copied to the caller's buffer if not. */
+typedef struct {
+  const uint8_t *data;
+  bool held;
+} cache_ref_t;
+
+/* Returns 1 on a hit and -1 if the block is not cached. Points |ref| at
+ * the cached block at |disk_num| and |block_num| without copying it, and
+ * counts as a lookup. The block is held, and |ref|'s held set, until |ref|
+ * is handed to cache_put_ref; if too many of its shard's blocks are held
+ * already (up to 8 per shard), the block is copied to |buf| instead and
+ * |ref| points there with held clear. Holding a block does not keep it
+ * cached: it is updated, invalidated and evicted like any other, and the
+ * ref keeps the contents it was taken with. Refs must be put before the
+ * cache is destroyed, and a thread calling cache_resize must not hold any,
+ * since the resize waits for the refs into the shards it replaces. */
+int cache_get_ref(int disk_num, int block_num, uint8_t *buf, cache_ref_t *ref);
+
+/* Releases the block |ref| holds, if any, and clears |ref|; does nothing
+ * for a copy or a ref that was never filled. */
+void cache_put_ref(cache_ref_t *ref);
+
 /* Returns 1 on success and -1 on failure. Inserts an entry for |disk_num| and
  * |block_num| into cache. Returns -1 if there is already an existing entry in the cache
  * with |disk_num| and |block_num|.If there cache is full, should evict least
- * recently used entry and insert the new entry. */
+ * recently used entry and insert the new entry. Lookups, updates and inserts
+ * all count as uses, and a new entry starts as the most recently used. */
 int cache_insert(int disk_num, int block_num, const uint8_t *buf);
 
+/* Where cache_insert_with places a new block. A normal block is the most
+ * recently used, as with cache_insert. A high priority block also starts
+ * out as if it had been hit, so that it is passed over the first time it
+ * comes up for eviction. A low priority block, such as one prefetched, is
+ * placed where the next block is evicted from, so that a scan of such
+ * blocks only ever replaces its own blocks once the cache is full. */
+typedef enum {
+  CACHE_PRIORITY_NORMAL = 0,
+  CACHE_PRIORITY_HIGH,
+  CACHE_PRIORITY_LOW,
+  CACHE_PRIORITY_COUNT
+} cache_priority_t;
+
+/* Returns 1 on success and -1 on failure. Like cache_insert, but places the
+ * block by |priority|. */
+int cache_insert_with(int disk_num, int block_num, const uint8_t *buf, cache_priority_t priority);
+
+/* Returns 1 on success and -1 on failure. Pins the cached block at
+ * |disk_num| and |block_num|, so that it is never evicted until
+ * cache_unpin; pinning a pinned block succeeds. Fails if the block is not
+ * cached, or if pinning it would pin more than |pin_percent| of its shard's
+ * blocks or leave its set, the admission window or the policy's part of
+ * the cache without a block to evict. A shrinking cache_resize
+ * keeps pinned blocks pinned as far as the smaller shards allow. */
+int cache_pin(int disk_num, int block_num);
+
+/* Returns 1 on success and -1 if the block is not pinned. Unpins the block
+ * at |disk_num| and |block_num|, which becomes the most recently used. */
+int cache_unpin(int disk_num, int block_num);
+
 /* If the entry with |disk_num| and |block_num| exists, updates the
  * corresponding block with data from |buf| */
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Returns 1 if the block was cached, 0 if it was not and -1 on failure.
+ * Drops the block at |disk_num| and |block_num| from the cache, pinned or
+ * not, including its copies in the compressed tier and the threads' L1s,
+ * for when another writer made it stale. References taken with
+ * cache_get_ref keep the contents they point to. */
+int cache_invalidate(int disk_num, int block_num);
+
+/* Returns 1 on success and -1 on failure. Writes every cached block, with
+ * its key and its place in the eviction order, to the file at |path|,
+ * replacing it only once the new file is complete, so that a restarted
+ * program can warm its cache with cache_load. */
+int cache_save(const char *path);
+
+/* Decides which blocks read back by cache_load may be cached, a batch of
+ * up to CACHE_BATCH_MAX at a time: sets bit i of |valid_mask| if |bufs[i]|
+ * still holds the contents of block |keys[i]|, and returns -1 if it could
+ * not tell, when none of the batch is cached. */
+typedef int (*cache_validator_t)(const cache_key_t *keys, int n, const uint8_t *const *bufs, uint64_t *valid_mask);
+
+/* Returns the number of blocks inserted on success and -1 on failure. Maps
+ * the file written by cache_save at |path| and inserts its blocks into the
+ * cache, which must already be created, in the order that restores their
+ * recency. Blocks already cached, blocks whose record is damaged and, unless
+ * |validate| is NULL, blocks it rejects are skipped. When the cache is
+ * smaller than the saved one, the blocks inserted first, the ones it would
+ * have evicted first, are evicted again to make room. */
+int cache_load(const char *path, cache_validator_t validate);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
-/* Prints the hit rate of the cache. */
+/* Returns the policy called |name| ("lru" or "arc"), or -1 if there is none. */
+int cache_policy_by_name(const char *name);
+
+/* Returns the miss ratio a fully associative LRU cache of |num_entries|
+ * entries would have had on the lookups of the last cache created with
+ * |mrc| set, estimated from a spatially hashed sample of the blocks
+ * (SHARDS), or -1 if there is no such cache or it had no lookups. The
+ * estimate stays available after the cache is destroyed. */
+double cache_miss_ratio(int num_entries);
+
+/* Counters of the current cache, or of the last one until the next is
+ * created. They are kept per thread without atomics and summed when read,
+ * so they cost little enough to stay on. Lookups and hits are also counted
+ * by disk, for as many disks as cache_set_stats_disks was last given.
+ * Histograms are on a log scale: bucket 0 counts the value 0 and bucket i
+ * the values from 2^(i-1) up to 2^i, with the last bucket open-ended. The
+ * age of an evicted block is the number of blocks inserted into its shard
+ * since it was; blocks a shrinking cache_resize leaves out count as
+ * evicted. Reuse distances, the number of distinct blocks looked up
+ * between two lookups of the same block, are only filled in for a cache
+ * created with |mrc| set, estimated from its sample, with the lookups of
+ * blocks never looked up before in |first_lookups|. */
+#define CACHE_STATS_BUCKETS 32
+
+typedef struct {
+  int num_entries;
+  uint64_t queries;
+  uint64_t hits;
+  uint64_t l1_hits;         /* of which served by a thread's L1 */
+  uint64_t tier_hits;       /* of which taken from the compressed tier */
+  uint64_t tier_blocks;     /* blocks in the compressed tier */
+  size_t tier_bytes;        /* bytes of its budget they take */
+  int num_disks;             /* disks counted by cache_get_disk_stats */
+  uint64_t inserts;         /* blocks inserted, not counting blocks already cached */
+  uint64_t evictions;
+  uint64_t updates;         /* cache_update calls */
+  uint64_t update_hits;     /* of which found the block cached */
+  uint64_t invalidations;   /* blocks cache_invalidate dropped */
+  uint64_t eviction_age[CACHE_STATS_BUCKETS];
+  double reuse_distance[CACHE_STATS_BUCKETS];
+  double first_lookups;
+} cache_stats_t;
+
+/* Fills in |stats| with the counters described above. */
+void cache_get_stats(cache_stats_t *stats);
+
+/* Stores the lookups and hits of disk |disk_num| in |queries| and |hits|,
+ * 0 for disks that are not counted. */
+void cache_get_disk_stats(int disk_num, uint64_t *queries, uint64_t *hits);
+
+/* Returns 1 on success and -1 on failure. Counts lookups and hits for the
+ * first |num_disks| disks from now on (16 until called), keeping the counts
+ * of the disks already counted; mdadm calls it with the geometry at mount.
+ * May not overlap with any other call, like cache_create. */
+int cache_set_stats_disks(int num_disks);
+
+/* Writes the counters of cache_get_stats to |f| as one line of JSON. */
+void cache_dump_stats(FILE *f);
+
+/* Prints the hit rate of the cache, followed by the hit rate of every policy
+ * used by a cache since the program started and, if the last cache was
+ * created with |mrc| set, its estimated miss-ratio curve. */
 void cache_print_hit_rate(void);
 
 #endif
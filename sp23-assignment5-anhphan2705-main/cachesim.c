@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "jbod.h"
+
+#define CACHESIM_ARGUMENTS "hj:s:p:a:S:fz:d:b:"
+#define USAGE                                                  \
+  "USAGE: cachesim [-h] [-j jobs] [-s sizes] [-p policies] [-a ways] [-S shards] [-f] [-z tier_bytes]\n" \
+  "                [-d disks] [-b blocks] trace-file...\n"      \
+  "\n"                                                         \
+  "where:\n"                                                   \
+  "    -h - help mode (display this message)\n"                \
+  "    -j - simulations run at once (default the number of CPUs)\n" \
+  "    -s - comma-separated cache sizes (default 16,64,256,1024,4096)\n" \
+  "    -p - comma-separated eviction policies (default lru,arc)\n" \
+  "    -a - ways per set of a set-associative cache (default 0, fully associative)\n" \
+  "    -S - number of independently locked cache shards (default 1)\n" \
+  "    -f - only cache blocks the TinyLFU filter admits\n"   \
+  "    -z - keep evicted blocks compressed in a second tier of this many bytes\n" \
+  "    -d - disks in the array (default 16)\n"                 \
+  "    -b - blocks per disk (default 256)\n"                   \
+  "\n"                                                         \
+  "Replays the block accesses mdadm makes for each trace, in the tester's\n" \
+  "workload format, against the cache with every policy and size, and\n" \
+  "against Belady's optimal offline policy, and prints their hit rates and\n" \
+  "the cost the JBOD would charge for the resulting operations.\n"
+
+/* cost of each JBOD command, as the server charges it */
+#define COST_MOUNT 1000
+#define COST_SEEK_TO_DISK 500
+#define COST_SEEK_TO_BLOCK 50
+#define COST_READ 100
+#define COST_WRITE 200
+
+/* the most simulations cachesim keeps track of */
+#define MAX_SIZES 32
+#define MAX_POLICIES CACHE_POLICY_COUNT
+
+/* a block access mdadm makes: a cache lookup, read from the JBOD on a miss
+ * and then inserted, or a write or fill of |len| bytes of |byte| at
+ * |offset|, which updates the cached copy */
+typedef enum {
+	EVENT_LOOKUP,
+	EVENT_WRITE,
+	EVENT_FILL,
+	EVENT_MOUNT,
+	EVENT_UNMOUNT,
+} event_kind_t;
+
+typedef struct {
+	uint8_t kind;
+	uint8_t byte;
+	uint16_t offset;
+	uint16_t len;
+	uint32_t disk_num;
+	uint32_t block_num;
+} event_t;
+
+typedef struct {
+	const char *path;
+	event_t *events;
+	int num_events;
+	int capacity;
+	uint64_t lookups;
+	uint64_t writes;
+	int32_t *next_use;  /* for each lookup, the event of the next lookup of its block, or INT32_MAX */
+} trace_t;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t cost;
+	int ok;
+} result_t;
+
+/* the JBOD head as mdadm tracks it, with the cost of moving it */
+typedef struct {
+	int valid;
+	uint32_t disk_num;
+	uint32_t block_num;
+	uint64_t cost;
+} head_t;
+
+static uint32_t num_disks = JBOD_NUM_DISKS;
+static uint32_t blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK;
+
+/* adds the cost of a |cost| command on block |block_num| of disk
+ * |disk_num|, seeking there first as mdadm's seek_to does */
+static void head_operation(head_t *head, uint32_t disk_num, uint32_t block_num, int cost) {
+	if (!head->valid || head->disk_num != disk_num || head->block_num != block_num) {
+		if (!head->valid || head->disk_num != disk_num) {
+			head->cost += COST_SEEK_TO_DISK;
+		}
+		head->cost += COST_SEEK_TO_BLOCK;
+		head->valid = 1;
+		head->disk_num = disk_num;
+		head->block_num = block_num;
+	}
+	head->cost += cost;
+	head->block_num++;
+}
+
+static void trace_add(trace_t *t, event_t event) {
+	if (t->num_events == t->capacity) {
+		t->capacity = t->capacity ? 2 * t->capacity : 4096;
+		t->events = realloc(t->events, t->capacity * sizeof(event_t));
+		if (t->events == NULL) {
+			err(1, "cannot hold the events of %s", t->path);
+		}
+	}
+	t->events[t->num_events++] = event;
+	t->lookups += event.kind == EVENT_LOOKUP;
+	t->writes += event.kind == EVENT_WRITE || event.kind == EVENT_FILL;
+}
+
+/* adds the block accesses of a read, write or fill of |len| bytes at |addr|
+ * to the trace, block by block as mdadm's read_range, write_range and
+ * fill_range make them without write combining */
+static void trace_add_range(trace_t *t, event_kind_t kind, uint64_t addr, uint32_t len, uint8_t byte) {
+	while (len > 0) {
+		// Split the address as translate_address does
+		uint64_t linear_block = addr / JBOD_BLOCK_SIZE;
+		int offset = addr % JBOD_BLOCK_SIZE;
+		int num_bytes = len < (uint32_t) (JBOD_BLOCK_SIZE - offset) ? (int) len : JBOD_BLOCK_SIZE - offset;
+		event_t event = { EVENT_LOOKUP, byte, offset, num_bytes, linear_block / blocks_per_disk,
+		                  linear_block % blocks_per_disk };
+
+		// Writes of part of a block read it first, and whole blocks are filled
+		// on the server
+		if (kind == EVENT_LOOKUP || num_bytes < JBOD_BLOCK_SIZE) {
+			trace_add(t, event);
+		}
+		if (kind != EVENT_LOOKUP) {
+			event.kind = (kind == EVENT_FILL && num_bytes == JBOD_BLOCK_SIZE) ? EVENT_FILL : EVENT_WRITE;
+			trace_add(t, event);
+		}
+		addr += num_bytes;
+		len -= num_bytes;
+	}
+}
+
+/* reads the workload at |path| into |t|, skipping the operations mdadm
+ * would reject */
+static void trace_load(trace_t *t, const char *path) {
+	char line[256], cmd[32];
+	uint64_t addr;
+	uint32_t len, ch;
+	uint64_t array_size = (uint64_t) num_disks * blocks_per_disk * JBOD_BLOCK_SIZE;
+
+	memset(t, 0, sizeof(*t));
+	t->path = path;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		err(1, "cannot open trace %s", path);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "MOUNT", 5) == 0) {
+			trace_add(t, (event_t) { .kind = EVENT_MOUNT });
+		} else if (strncmp(line, "UNMOUNT", 7) == 0) {
+			trace_add(t, (event_t) { .kind = EVENT_UNMOUNT });
+		} else if (sscanf(line, "%7s %20" SCNu64 " %4u %3u", cmd, &addr, &len, &ch) == 4) {
+			bool fill = strcmp(cmd, "FILL") == 0;
+			if (addr + len > array_size || (len > 1024 && !fill)) {
+				continue;
+			}
+			if (strcmp(cmd, "READ") == 0) {
+				trace_add_range(t, EVENT_LOOKUP, addr, len, 0);
+			} else if (strcmp(cmd, "WRITE") == 0 || fill) {
+				trace_add_range(t, fill ? EVENT_FILL : EVENT_WRITE, addr, len, ch);
+			}
+		}
+	}
+	fclose(f);
+
+	// Link every lookup to the next lookup of its block, for the optimal policy
+	int32_t *last = malloc((size_t) num_disks * blocks_per_disk * sizeof(int32_t));
+	t->next_use = malloc(t->num_events * sizeof(int32_t));
+	if (last == NULL || (t->next_use == NULL && t->num_events > 0)) {
+		err(1, "cannot index the lookups of %s", path);
+	}
+	for (size_t i = 0; i < (size_t) num_disks * blocks_per_disk; i++) {
+		last[i] = INT32_MAX;
+	}
+	for (int i = t->num_events - 1; i >= 0; i--) {
+		const event_t *e = &t->events[i];
+		if (e->kind == EVENT_LOOKUP) {
+			size_t id = (size_t) e->disk_num * blocks_per_disk + e->block_num;
+			t->next_use[i] = last[id];
+			last[id] = i;
+		}
+	}
+	free(last);
+}
+
+/* replays |t| against a cache created with |config|, keeping the disks'
+ * contents so that the cache holds the blocks mdadm would give it */
+static result_t simulate_cache(const trace_t *t, const cache_config_t *config) {
+	result_t r = { 0, 0, 0 };
+	head_t head = { 0, 0, 0, 0 };
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	uint8_t *image = calloc((size_t) num_disks * blocks_per_disk, JBOD_BLOCK_SIZE);
+	if (image == NULL || cache_create_with(config) != 1) {
+		free(image);
+		return r;
+	}
+
+	for (int i = 0; i < t->num_events; i++) {
+		const event_t *e = &t->events[i];
+		uint8_t *block = image + ((size_t) e->disk_num * blocks_per_disk + e->block_num) * JBOD_BLOCK_SIZE;
+		switch (e->kind) {
+		case EVENT_MOUNT:
+			// Every mount starts from zeroed disks
+			memset(image, 0, (size_t) num_disks * blocks_per_disk * JBOD_BLOCK_SIZE);
+			head.valid = 0;
+			head.cost += COST_MOUNT;
+			break;
+		case EVENT_UNMOUNT:
+			head.cost += COST_MOUNT;
+			break;
+		case EVENT_LOOKUP:
+			if (cache_lookup(e->disk_num, e->block_num, buf) == 1) {
+				r.hits++;
+			} else {
+				head_operation(&head, e->disk_num, e->block_num, COST_READ);
+				cache_insert(e->disk_num, e->block_num, block);
+			}
+			break;
+		case EVENT_WRITE:
+		case EVENT_FILL:
+			memset(block + e->offset, e->byte, e->len);
+			head_operation(&head, e->disk_num, e->block_num, COST_WRITE);
+			cache_update(e->disk_num, e->block_num, block);
+			break;
+		}
+	}
+
+	cache_destroy();
+	free(image);
+	r.cost = head.cost;
+	r.ok = 1;
+	return r;
+}
+
+/* a max-heap of blocks by the event of their next lookup; entries go stale
+ * when the block is looked up again or evicted and are skipped then */
+typedef struct {
+	int32_t next;
+	uint32_t id;
+} heap_entry_t;
+
+static void heap_push(heap_entry_t *heap, int *n, heap_entry_t entry) {
+	int i = (*n)++;
+	while (i > 0 && heap[(i - 1) / 2].next < entry.next) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = entry;
+}
+
+static heap_entry_t heap_pop(heap_entry_t *heap, int *n) {
+	heap_entry_t top = heap[0], last = heap[--(*n)];
+	int i = 0;
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= *n) {
+			break;
+		}
+		if (child + 1 < *n && heap[child + 1].next > heap[child].next) {
+			child++;
+		}
+		if (heap[child].next <= last.next) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (*n > 0) {
+		heap[i] = last;
+	}
+	return top;
+}
+
+/* replays |t| against Belady's MIN with room for |size| blocks: a miss
+ * evicts the cached block looked up again furthest in the future, or skips
+ * caching the missed block if that is itself looked up again last */
+static result_t simulate_optimal(const trace_t *t, int size) {
+	result_t r = { 0, 0, 0 };
+	head_t head = { 0, 0, 0, 0 };
+	size_t num_blocks = (size_t) num_disks * blocks_per_disk;
+	int32_t *cached_next = malloc(num_blocks * sizeof(int32_t));
+	heap_entry_t *heap = malloc((t->lookups + 1) * sizeof(heap_entry_t));
+	int heap_size = 0, num_cached = 0;
+	if (cached_next == NULL || heap == NULL) {
+		free(cached_next);
+		free(heap);
+		return r;
+	}
+	for (size_t i = 0; i < num_blocks; i++) {
+		cached_next[i] = -1;
+	}
+
+	for (int i = 0; i < t->num_events; i++) {
+		const event_t *e = &t->events[i];
+		uint32_t id = e->disk_num * blocks_per_disk + e->block_num;
+		switch (e->kind) {
+		case EVENT_MOUNT:
+			head.valid = 0;
+			head.cost += COST_MOUNT;
+			break;
+		case EVENT_UNMOUNT:
+			head.cost += COST_MOUNT;
+			break;
+		case EVENT_LOOKUP:
+			if (cached_next[id] != -1) {
+				r.hits++;
+			} else {
+				head_operation(&head, e->disk_num, e->block_num, COST_READ);
+				if (size <= 0) {
+					break;
+				}
+				if (num_cached == size) {
+					// Drop stale entries until the top is a cached block's current one
+					while (cached_next[heap[0].id] != heap[0].next) {
+						heap_pop(heap, &heap_size);
+					}
+					if (heap[0].next <= t->next_use[i]) {
+						break;
+					}
+					cached_next[heap_pop(heap, &heap_size).id] = -1;
+					num_cached--;
+				}
+				num_cached++;
+			}
+			cached_next[id] = t->next_use[i];
+			heap_push(heap, &heap_size, (heap_entry_t) { t->next_use[i], id });
+			break;
+		case EVENT_WRITE:
+		case EVENT_FILL:
+			head_operation(&head, e->disk_num, e->block_num, COST_WRITE);
+			break;
+		}
+
+		// Compact the heap when stale entries have filled it
+		if (heap_size > (int) t->lookups) {
+			int n = 0;
+			for (int j = 0; j < heap_size; j++) {
+				if (cached_next[heap[j].id] == heap[j].next) {
+					heap[n++] = heap[j];
+				}
+			}
+			heap_size = 0;
+			for (int j = 0; j < n; j++) {
+				heap_push(heap, &heap_size, heap[j]);
+			}
+		}
+	}
+
+	free(cached_next);
+	free(heap);
+	r.cost = head.cost;
+	r.ok = 1;
+	return r;
+}
+
+/* one simulation: a trace against a policy (or the optimal one, -1) at a size */
+typedef struct {
+	const trace_t *trace;
+	int policy;
+	int size;
+	result_t result;
+	pid_t pid;
+	int fd;
+} job_t;
+
+static cache_config_t base_config = { .ways = 0, .policy = CACHE_POLICY_LRU, .shards = 1 };
+
+static result_t run_job(const job_t *job) {
+	if (job->policy == -1) {
+		return simulate_optimal(job->trace, job->size);
+	}
+	cache_config_t config = base_config;
+	config.num_entries = job->size;
+	config.policy = job->policy;
+	return simulate_cache(job->trace, &config);
+}
+
+/* waits for the job running as |pid| and collects its result */
+static void reap_job(job_t *jobs, int num_jobs, pid_t pid) {
+	for (int i = 0; i < num_jobs; i++) {
+		if (jobs[i].pid == pid) {
+			if (read(jobs[i].fd, &jobs[i].result, sizeof(result_t)) != sizeof(result_t)) {
+				jobs[i].result.ok = 0;
+			}
+			close(jobs[i].fd);
+			jobs[i].pid = 0;
+			return;
+		}
+	}
+}
+
+/* runs every job, up to |parallel| at once. The cache is one per process,
+ * so each simulation runs in a process of its own and sends its result back
+ * over a pipe. */
+static void run_jobs(job_t *jobs, int num_jobs, int parallel) {
+	int running = 0;
+	for (int i = 0; i < num_jobs; i++) {
+		if (running == parallel) {
+			reap_job(jobs, num_jobs, wait(NULL));
+			running--;
+		}
+		int fds[2];
+		if (pipe(fds) == -1) {
+			err(1, "cannot create a pipe");
+		}
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == -1) {
+			err(1, "cannot start a simulation");
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			result_t r = run_job(&jobs[i]);
+			_exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+		}
+		close(fds[1]);
+		jobs[i].pid = pid;
+		jobs[i].fd = fds[0];
+		running++;
+	}
+	while (running > 0) {
+		reap_job(jobs, num_jobs, wait(NULL));
+		running--;
+	}
+}
+
+/* returns the name of |policy|, "opt" for the optimal one */
+static const char *policy_name(int policy) {
+	static const char *names[CACHE_POLICY_COUNT] = { [CACHE_POLICY_LRU] = "lru", [CACHE_POLICY_ARC] = "arc" };
+	return policy == -1 ? "opt" : names[policy];
+}
+
+/* prints a table of the jobs of one trace, |num_policies| columns and
+ * |num_sizes| rows, with the hit rate or the cost of each */
+static void print_table(const trace_t *t, const job_t *jobs, const int *policies, int num_policies,
+                        const int *sizes, int num_sizes, bool cost) {
+	printf("%6s", "size");
+	for (int p = 0; p < num_policies; p++) {
+		printf(" %12s", policy_name(policies[p]));
+	}
+	printf("\n");
+	for (int s = 0; s < num_sizes; s++) {
+		printf("%6d", sizes[s]);
+		for (int p = 0; p < num_policies; p++) {
+			const result_t *r = &jobs[s * num_policies + p].result;
+			if (!r->ok) {
+				printf(" %12s", "-");
+			} else if (cost) {
+				printf(" %12" PRIu64, r->cost);
+			} else {
+				printf(" %11.1f%%", t->lookups ? 100.0 * r->hits / t->lookups : 0.0);
+			}
+		}
+		printf("\n");
+	}
+}
+
+/* parses the comma-separated list |list| into at most |max| values with
+ * |parse|, which returns -1 for a value it does not take */
+static int parse_list(const char *list, int *values, int max, int (*parse)(const char *)) {
+	char copy[256];
+	int n = 0;
+	snprintf(copy, sizeof(copy), "%s", list);
+	for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+		if (n == max || (values[n] = parse(item)) == -1) {
+			return -1;
+		}
+		n++;
+	}
+	return n;
+}
+
+static int parse_size(const char *s) {
+	int size = atoi(s);
+	return size > 0 ? size : -1;
+}
+
+int main(int argc, char *argv[]) {
+	int ch, parallel = sysconf(_SC_NPROCESSORS_ONLN);
+	int sizes[MAX_SIZES], policies[MAX_POLICIES + 1];
+	int num_sizes = parse_list("16,64,256,1024,4096", sizes, MAX_SIZES, parse_size);
+	int num_policies = parse_list("lru,arc", policies, MAX_POLICIES, cache_policy_by_name);
+
+	while ((ch = getopt(argc, argv, CACHESIM_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h':
+			fprintf(stderr, USAGE);
+			return 0;
+		case 'j':
+			parallel = atoi(optarg);
+			break;
+		case 's':
+			num_sizes = parse_list(optarg, sizes, MAX_SIZES, parse_size);
+			break;
+		case 'p':
+			num_policies = parse_list(optarg, policies, MAX_POLICIES, cache_policy_by_name);
+			break;
+		case 'a':
+			base_config.ways = atoi(optarg);
+			break;
+		case 'S':
+			base_config.shards = atoi(optarg);
+			break;
+		case 'f':
+			base_config.tinylfu = true;
+			break;
+		case 'z':
+			base_config.tier_bytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			num_disks = atoi(optarg);
+			break;
+		case 'b':
+			blocks_per_disk = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return -1;
+		}
+	}
+	if (num_sizes <= 0 || num_policies <= 0) {
+		errx(1, "sizes must be positive and policies one of lru and arc");
+	}
+	if (optind == argc || parallel <= 0 || num_disks == 0 || blocks_per_disk == 0) {
+		fprintf(stderr, USAGE);
+		return -1;
+	}
+	policies[num_policies++] = -1;
+
+	// Load every trace up front, so that the simulations share it
+	int num_traces = argc - optind;
+	trace_t *traces = calloc(num_traces, sizeof(trace_t));
+	int per_trace = num_sizes * num_policies;
+	job_t *jobs = calloc((size_t) num_traces * per_trace, sizeof(job_t));
+	if (traces == NULL || jobs == NULL) {
+		err(1, "cannot hold the traces");
+	}
+	for (int t = 0; t < num_traces; t++) {
+		trace_load(&traces[t], argv[optind + t]);
+		for (int s = 0; s < num_sizes; s++) {
+			for (int p = 0; p < num_policies; p++) {
+				job_t *job = &jobs[t * per_trace + s * num_policies + p];
+				job->trace = &traces[t];
+				job->size = sizes[s];
+				job->policy = policies[p];
+			}
+		}
+	}
+	run_jobs(jobs, num_traces * per_trace, parallel);
+
+	for (int t = 0; t < num_traces; t++) {
+		const trace_t *trace = &traces[t];
+		result_t uncached = simulate_optimal(trace, 0);
+		printf("%s: %" PRIu64 " lookups, %" PRIu64 " block writes, cost without a cache %" PRIu64 "\n",
+		       trace->path, trace->lookups, trace->writes, uncached.cost);
+		printf("hit rate\n");
+		print_table(trace, &jobs[t * per_trace], policies, num_policies, sizes, num_sizes, false);
+		printf("estimated cost\n");
+		print_table(trace, &jobs[t * per_trace], policies, num_policies, sizes, num_sizes, true);
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "jbod.h"
+
+#define CACHETEST_ARGUMENTS "hn:t:"
+#define USAGE                                                  \
+  "USAGE: cachetest [-h] [-n operations] [-t threads]\n"       \
+  "\n"                                                         \
+  "where:\n"                                                   \
+  "    -h - help mode (display this message)\n"                \
+  "    -n - lookups or writes each thread makes per mode (default 300000)\n" \
+  "    -t - threads per mode, of which a third write (default 8)\n" \
+  "\n"                                                         \
+  "Checks every cache mode while reader threads race writer threads and the\n" \
+  "main thread resizes the cache. A hit must return a whole block that was\n" \
+  "written to that disk and block. Before that, checks which blocks a\n" \
+  "shrink and a grow keep, and that refs past the pins are copies.\n" \
+  "Exits with 1 if any check fails.\n"
+
+/* the blocks the threads use; more than the cache holds, so that it evicts */
+#define TEST_KEYS 600
+
+/* the blocks the resize checks use, from 0 up */
+#define RESIZE_KEYS 4000
+
+/* the sizes the main thread cycles through while the threads run */
+static const int resize_sizes[] = { 512, 128, 1024, 256, 64 };
+
+/* the cache modes checked */
+static const cache_config_t modes[] = {
+	{ .num_entries = 256, .policy = CACHE_POLICY_LRU, .shards = 1 },
+	{ .num_entries = 256, .policy = CACHE_POLICY_ARC, .shards = 1 },
+	{ .num_entries = 256, .policy = CACHE_POLICY_LRU, .tinylfu = true, .shards = 1 },
+	{ .num_entries = 256, .ways = 8, .shards = 1 },
+	{ .num_entries = 256, .policy = CACHE_POLICY_LRU, .shards = 4 },
+	{ .num_entries = 256, .policy = CACHE_POLICY_ARC, .tinylfu = true, .shards = 4 },
+	{ .num_entries = 256, .ways = 4, .shards = 4 },
+};
+
+static int operations = 300000;
+static int failures;
+static long hits;
+static int running;
+
+/* fills |buf| with the |version|th contents of block |k|, which record the
+ * version and the block and are checksummed by the rest of the bytes */
+static void fill_block(uint8_t *buf, int k, uint32_t version) {
+	for (int i = 0; i < JBOD_BLOCK_SIZE; i++) {
+		buf[i] = (uint8_t) (version * 31 + k * 7 + i);
+	}
+	memcpy(buf, &version, sizeof(version));
+	memcpy(buf + sizeof(version), &k, sizeof(k));
+}
+
+/* returns 1 if |buf| holds some version of block |k|, 0 if it is torn or
+ * belongs to another block */
+static int check_block(const uint8_t *buf, int k) {
+	uint32_t version;
+	int owner;
+
+	memcpy(&version, buf, sizeof(version));
+	memcpy(&owner, buf + sizeof(version), sizeof(owner));
+	if (owner != k) {
+		return 0;
+	}
+	for (int i = sizeof(version) + sizeof(owner); i < JBOD_BLOCK_SIZE; i++) {
+		if (buf[i] != (uint8_t) (version * 31 + k * 7 + i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* looks up random blocks, checking every hit */
+static void *reader(void *arg) {
+	unsigned int seed = (unsigned int) (intptr_t) arg;
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	long found = 0;
+	int bad = 0;
+
+	for (int i = 0; i < operations; i++) {
+		int k = rand_r(&seed) % TEST_KEYS;
+		if (cache_lookup(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf) == 1) {
+			found++;
+			bad += !check_block(buf, k);
+		}
+	}
+	__atomic_fetch_add(&hits, found, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&failures, bad, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* inserts and updates random blocks with new versions */
+static void *writer(void *arg) {
+	unsigned int seed = (unsigned int) (intptr_t) arg;
+	uint8_t buf[JBOD_BLOCK_SIZE];
+
+	for (int i = 0; i < operations; i++) {
+		int k = rand_r(&seed) % TEST_KEYS;
+		fill_block(buf, k, i);
+		if (rand_r(&seed) & 1) {
+			cache_insert(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf);
+		} else {
+			cache_update(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf);
+		}
+	}
+	__atomic_fetch_sub(&running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* returns how many of blocks |first| to |last| - 1 the cache holds, marking
+ * them in |held| if it is not NULL and counting torn ones in |failures| */
+static int count_held(int first, int last, bool *held) {
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	int n = 0;
+
+	for (int k = first; k < last; k++) {
+		bool hit = cache_lookup(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf) == 1;
+		if (hit) {
+			n++;
+			failures += !check_block(buf, k);
+		}
+		if (held != NULL) {
+			held[k] = hit;
+		}
+	}
+	return n;
+}
+
+/* checks which blocks cache_resize keeps on a cache configured as |config|
+ * with 256 entries; returns the number of failed checks */
+static int test_resize(const cache_config_t *config) {
+	static bool held[RESIZE_KEYS];
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	int failed = 0;
+
+	if (config->num_entries != 256 || cache_create_with(config) != 1) {
+		warnx("cannot create the cache");
+		return 1;
+	}
+	failures = 0;
+
+	// Fill the cache in order, so that the first blocks are the first to go
+	for (int k = 0; k < 256; k++) {
+		fill_block(buf, k, 0);
+		cache_insert(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf);
+	}
+
+	// Shrinking keeps at most the new size, and a plain LRU or ARC cache,
+	// whose order is exact, keeps the newest half
+	failed += cache_resize(128) != 1;
+	int kept = count_held(0, 256, held);
+	failed += kept > 128;
+	if (config->ways == 0 && !config->tinylfu && config->shards == 1) {
+		failed += count_held(128, 256, NULL) != 128;
+	}
+
+	// Growing keeps every block
+	failed += cache_resize(4096) != 1;
+	for (int k = 0; k < 256; k++) {
+		failed += held[k] && cache_lookup(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf) != 1;
+	}
+
+	// The grown cache holds new blocks without evicting, unless a set fills
+	for (int k = 1000; k < RESIZE_KEYS; k++) {
+		fill_block(buf, k, 0);
+		cache_insert(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf);
+	}
+	int added = count_held(1000, RESIZE_KEYS, NULL);
+	if (config->ways == 0) {
+		failed += count_held(0, 256, NULL) != kept || added != RESIZE_KEYS - 1000;
+	}
+
+	// Growing further keeps them all too, and sizes below one are refused
+	failed += cache_resize(100000) != 1 || count_held(1000, RESIZE_KEYS, NULL) != added;
+	failed += cache_resize(0) != -1 || cache_resize(-1) != -1;
+	failed += failures;
+	cache_destroy();
+
+	printf("%-4s %4d ways %-3s %2d shards: shrink kept %3d, grow added %4d, %s\n",
+	       config->policy == CACHE_POLICY_ARC ? "arc" : "lru", config->ways, config->tinylfu ? "tlf" : "",
+	       config->shards, kept, added, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* checks that cache_get_ref still returns every cached block, and counts it
+ * as a hit, once its shard cannot hold more, that a held block keeps its
+ * contents when updated, and that cache_clear fails while blocks are held
+ * or pinned; returns the number of failed checks */
+static int test_refs(void) {
+	uint8_t buf[JBOD_BLOCK_SIZE], copy[JBOD_BLOCK_SIZE];
+	cache_ref_t refs[64];
+	cache_stats_t stats;
+	int failed = 0, copies = 0;
+
+	cache_config_t config = { .num_entries = 64, .pin_percent = 10 };
+	if (cache_create_with(&config) != 1) {
+		warnx("cannot create the cache");
+		return 1;
+	}
+	for (int k = 0; k < 64; k++) {
+		fill_block(buf, k, 0);
+		cache_insert(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf);
+	}
+
+	// Hold a ref to every block; those past the pins come back as copies
+	for (int k = 0; k < 64; k++) {
+		int rc = cache_get_ref(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, copy, &refs[k]);
+		failed += rc != 1 || !check_block(refs[k].data, k);
+		failed += refs[k].held == (refs[k].data == copy);
+		copies += !refs[k].held;
+	}
+	cache_get_stats(&stats);
+	failed += copies == 0 || stats.queries != 64 || stats.hits != 64;
+
+	// Updating a held block leaves the ref with the contents it was taken with
+	for (int k = 0; k < 64; k++) {
+		if (refs[k].held) {
+			fill_block(buf, k, 1);
+			cache_update(k % JBOD_NUM_DISKS, k / JBOD_NUM_DISKS, buf);
+			uint32_t version;
+			memcpy(&version, refs[k].data, sizeof(version));
+			failed += !check_block(refs[k].data, k) || version != 0;
+			break;
+		}
+	}
+
+	// The cache cannot be cleared while refs are held, or a block pinned
+	failed += cache_clear() != -1;
+	for (int k = 0; k < 64; k++) {
+		cache_put_ref(&refs[k]);
+		failed += refs[k].held || refs[k].data != NULL;
+	}
+	failed += cache_pin(0, 0) != 1 || cache_clear() != -1;
+	failed += cache_unpin(0, 0) != 1 || cache_clear() != 1 || count_held(0, 64, NULL) != 0;
+	cache_destroy();
+
+	printf("refs: %d of 64 copied, %lu hits, %s\n", copies, (unsigned long) stats.hits, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* runs |threads| readers and writers on a cache configured as |config|,
+ * resizing it until they are done, and prints what they found; returns the
+ * number of failed checks */
+static int test_mode(const cache_config_t *config, int threads) {
+	pthread_t tids[threads];
+	int resizes = 0, failed_resizes = 0;
+
+	if (cache_create_with(config) != 1) {
+		warnx("cannot create the cache");
+		return 1;
+	}
+
+	// The last third of the threads write
+	failures = 0;
+	hits = 0;
+	running = threads;
+	for (int t = 0; t < threads; t++) {
+		void *(*worker)(void *) = (t < threads - threads / 3) ? reader : writer;
+		if (pthread_create(&tids[t], NULL, worker, (void *) (intptr_t) (t + 1)) != 0) {
+			errx(1, "cannot start thread %d", t);
+		}
+	}
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0) {
+		int size = resize_sizes[resizes++ % (sizeof(resize_sizes) / sizeof(resize_sizes[0]))];
+		failed_resizes += cache_resize(size * config->shards) != 1;
+	}
+	for (int t = 0; t < threads; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	cache_destroy();
+
+	printf("%-4s %4d ways %-3s %2d shards: %8ld hits, %d torn, %d resizes, %d failed\n",
+	       config->policy == CACHE_POLICY_ARC ? "arc" : "lru", config->ways, config->tinylfu ? "tlf" : "",
+	       config->shards, hits, failures, resizes, failed_resizes);
+	return failures + failed_resizes;
+}
+
+int main(int argc, char *argv[]) {
+	int ch, threads = 8, failed = 0;
+
+	while ((ch = getopt(argc, argv, CACHETEST_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h':
+			fprintf(stderr, USAGE);
+			return 0;
+		case 'n':
+			operations = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return -1;
+		}
+	}
+	if (operations <= 0 || threads < 2) {
+		errx(1, "operations must be positive and there must be at least two threads");
+	}
+
+	failed += test_refs() != 0;
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		failed += test_resize(&modes[m]) != 0;
+	}
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		failed += test_mode(&modes[m], threads) != 0;
+	}
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Runs every trace against the in-tree server under each tester mode that
+# must reproduce the expected output, then checks the statistics the random
+# trace prints. Run it from this directory after "make tester server", or
+# through "make check". Exits with 1 if any run differs.
+
+failed=0
+out=$(mktemp)
+err=$(mktemp)
+trap 'rm -f "$out" "$err"; kill $server 2>/dev/null' EXIT
+
+# Starts ./server with the given arguments, stopping the previous one
+start_server() {
+  kill $server 2>/dev/null
+  wait $server 2>/dev/null
+  ./server "$@" >/dev/null 2>&1 &
+  server=$!
+  sleep 0.3
+}
+
+# Runs every trace with the given tester arguments
+run_traces() {
+  for trace in simple linear random fill; do
+    if ./tester "$@" -w traces/$trace-input >"$out" 2>"$err" &&
+       cmp -s "$out" traces/$trace-expected-output; then
+      echo "ok      $trace $*"
+    else
+      echo "FAILED  $trace $*"
+      failed=1
+    fi
+  done
+}
+
+# Runs the random trace with the given tester arguments and compares what it
+# prints to stderr with traces/random-expected-$1; the statistics are
+# deterministic for a single-threaded trace
+check_stats() {
+  name=$1
+  shift
+  if ./tester "$@" -w traces/random-input >"$out" 2>"$err" &&
+     cmp -s "$err" traces/random-expected-$name; then
+    echo "ok      random $name $*"
+  else
+    echo "FAILED  random $name $*"
+    failed=1
+  fi
+}
+
+start_server
+run_traces
+run_traces -x
+run_traces -k
+run_traces -c
+run_traces -q 20000000
+run_traces -s 64
+run_traces -s 64 -a 4
+run_traces -x -s 64 -p arc
+run_traces -x -s 64 -f
+run_traces -s 64 -t 16
+run_traces -x -s 64 -z 65536
+check_stats mrc -s 64 -m
+check_stats stats -s 64 -j
+
+# The log-structured layout needs spare disks for its cleaner
+start_server -s 3
+run_traces -x -l
+run_traces -x -l -s 64
+
+exit $failed
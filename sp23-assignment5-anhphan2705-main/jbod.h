@@ -7,6 +7,7 @@
 #define JBOD_DISK_SIZE            65536
 #define JBOD_BLOCK_SIZE           256
 #define JBOD_NUM_BLOCKS_PER_DISK  (JBOD_DISK_SIZE / JBOD_BLOCK_SIZE)
+#define JBOD_FILL_BYTE_SHIFT      8
 
 typedef enum {
   JBOD_MOUNT,
@@ -16,6 +17,13 @@ typedef enum {
   JBOD_READ_BLOCK,
   JBOD_WRITE_BLOCK,
   JBOD_SIGN_BLOCK,
+  JBOD_FILL_BLOCK,   /* like JBOD_WRITE_BLOCK, but the block is filled with the
+                        byte in bits 8-15 of the op and no payload is sent */
+  JBOD_GET_GEOMETRY, /* returns the number of disks, blocks per disk and spare
+                        disks after the array as three big-endian 32-bit words
+                        at the start of the block */
+  JBOD_INVALIDATE,   /* v3 only: pushed by the server to drop a cached block,
+                        and sent back by the client once it has (see net.h) */
   JBOD_NUM_CMDS,
 } jbod_cmd_t;
 
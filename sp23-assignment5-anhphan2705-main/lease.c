@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "lease.h"
+
+typedef struct {
+	uint32_t disk_num;
+	uint32_t block_num;
+	uint64_t expiry_ms;
+} lease_t;
+
+/* the leases, oldest first, in a ring that doubles when it fills up */
+static lease_t *leases = NULL;
+static uint32_t capacity = 0;
+static uint32_t first = 0;
+static uint32_t count = 0;
+
+uint64_t lease_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int lease_add(uint32_t disk_num, uint32_t block_num, uint64_t expiry_ms) {
+	// The queue is only in order of expiry if every lease runs out after the last
+	if (count > 0 && leases[(first + count - 1) % capacity].expiry_ms > expiry_ms) {
+		return -1;
+	}
+
+	// Grow the ring, unrolling it into the new array
+	if (count == capacity) {
+		uint32_t new_capacity = capacity > 0 ? 2 * capacity : 64;
+		lease_t *grown = malloc(new_capacity * sizeof(lease_t));
+		if (grown == NULL) {
+			return -1;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			grown[i] = leases[(first + i) % capacity];
+		}
+		free(leases);
+		leases = grown;
+		capacity = new_capacity;
+		first = 0;
+	}
+
+	leases[(first + count) % capacity] = (lease_t) { disk_num, block_num, expiry_ms };
+	count++;
+	return 1;
+}
+
+bool lease_expired(uint64_t now_ms, uint32_t *disk_num, uint32_t *block_num) {
+	if (count == 0 || leases[first].expiry_ms > now_ms) {
+		return false;
+	}
+	*disk_num = leases[first].disk_num;
+	*block_num = leases[first].block_num;
+	first = (first + 1) % capacity;
+	count--;
+	return true;
+}
+
+void lease_clear(void) {
+	free(leases);
+	leases = NULL;
+	capacity = 0;
+	first = 0;
+	count = 0;
+}
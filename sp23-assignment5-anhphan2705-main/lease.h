@@ -0,0 +1,29 @@
+#ifndef LEASE_H_
+#define LEASE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Read leases on the blocks a client caches over a v3 connection (see
+ * net.h). A cached block may only be used until its lease runs out, so the
+ * leases are queued in the order they run out; the server grants them all
+ * for the same time, which makes that the order they were granted in. This
+ * module only keeps the queue; mdadm drops the blocks. */
+
+/* Returns a monotonic timestamp in milliseconds, the clock leases run on. */
+uint64_t lease_now_ms(void);
+
+/* Returns 1 on success and -1 on failure. Records that the cached copy of
+ * block |block_num| of disk |disk_num| may be used until |expiry_ms|, which
+ * fails if a lease already recorded runs out later. */
+int lease_add(uint32_t disk_num, uint32_t block_num, uint64_t expiry_ms);
+
+/* Returns true and sets |disk_num| and |block_num| to the block of the
+ * oldest lease if it ran out by |now_ms|, forgetting the lease; returns
+ * false if it did not. */
+bool lease_expired(uint64_t now_ms, uint32_t *disk_num, uint32_t *block_num);
+
+/* Forgets every lease. */
+void lease_clear(void);
+
+#endif
@@ -0,0 +1,241 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "lfs.h"
+
+/* segment states */
+#define SEG_FREE    0
+#define SEG_ACTIVE  1  /* holds a disk's log head */
+#define SEG_USED    2
+
+static uint32_t *l2p = NULL;         /* logical -> physical block */
+static uint32_t *p2l = NULL;         /* physical -> logical block */
+static uint16_t *seg_live = NULL;    /* live blocks in each segment */
+static uint8_t *seg_state = NULL;
+static uint32_t *disk_live = NULL;   /* live blocks on each disk */
+static uint32_t *disk_free = NULL;   /* free segments on each disk */
+static uint32_t *disk_head = NULL;   /* next block of each disk's log, or LFS_UNMAPPED */
+static uint32_t *disk_cursor = NULL; /* where to look for the next free segment */
+
+static uint32_t num_disks = 0;
+static uint32_t blocks_per_disk = 0;
+static uint32_t segs_per_disk = 0;
+static uint64_t logical_blocks = 0;
+static uint32_t active_disk = 0;
+
+static uint64_t num_appends = 0;
+static uint64_t num_relocated = 0;
+static uint64_t num_cleaned = 0;
+
+/* returns the segment holding physical block |pba| */
+static uint32_t segment_of(uint32_t pba) {
+	return (pba / blocks_per_disk) * segs_per_disk + (pba % blocks_per_disk) / LFS_SEGMENT_BLOCKS;
+}
+
+/* returns the first physical block of segment |seg| */
+static uint32_t segment_start(uint32_t seg) {
+	return (seg / segs_per_disk) * blocks_per_disk + (seg % segs_per_disk) * LFS_SEGMENT_BLOCKS;
+}
+
+/* returns the number of blocks in segment |seg|; the last one on a disk may
+ * be short */
+static uint32_t segment_length(uint32_t seg) {
+	uint32_t first = (seg % segs_per_disk) * LFS_SEGMENT_BLOCKS;
+	return (blocks_per_disk - first < LFS_SEGMENT_BLOCKS) ? blocks_per_disk - first : LFS_SEGMENT_BLOCKS;
+}
+
+uint64_t lfs_reserve_blocks(uint32_t disks, uint32_t blocks) {
+	uint64_t reserve = (uint64_t) disks * blocks / 8;
+
+	// Each disk needs room for a log head and a segment for the cleaner
+	if (reserve < (uint64_t) disks * 2 * LFS_SEGMENT_BLOCKS) {
+		reserve = (uint64_t) disks * 2 * LFS_SEGMENT_BLOCKS;
+	}
+	return reserve;
+}
+
+int lfs_create(uint32_t disks, uint32_t blocks, uint64_t logical) {
+	uint64_t physical_blocks = (uint64_t) disks * blocks;
+
+	// Block numbers must fit the 32-bit maps, and the cleaner needs its
+	// reserve on top of the logical blocks
+	if (l2p != NULL || physical_blocks >= LFS_UNMAPPED || blocks < 2 * LFS_SEGMENT_BLOCKS ||
+	    logical == 0 || logical + lfs_reserve_blocks(disks, blocks) > physical_blocks) {
+		return -1;
+	}
+
+	num_disks = disks;
+	blocks_per_disk = blocks;
+	segs_per_disk = (blocks + LFS_SEGMENT_BLOCKS - 1) / LFS_SEGMENT_BLOCKS;
+	logical_blocks = logical;
+
+	// Allocate the maps and per-segment and per-disk state
+	l2p = malloc(logical_blocks * sizeof(*l2p));
+	p2l = malloc(physical_blocks * sizeof(*p2l));
+	seg_live = calloc((uint64_t) disks * segs_per_disk, sizeof(*seg_live));
+	seg_state = calloc((uint64_t) disks * segs_per_disk, sizeof(*seg_state));
+	disk_live = calloc(disks, sizeof(*disk_live));
+	disk_free = calloc(disks, sizeof(*disk_free));
+	disk_head = calloc(disks, sizeof(*disk_head));
+	disk_cursor = calloc(disks, sizeof(*disk_cursor));
+	if (!l2p || !p2l || !seg_live || !seg_state || !disk_live || !disk_free || !disk_head || !disk_cursor) {
+		lfs_destroy();
+		return -1;
+	}
+
+	// Nothing is mapped and every segment is free
+	memset(l2p, 0xff, logical_blocks * sizeof(*l2p));
+	memset(p2l, 0xff, physical_blocks * sizeof(*p2l));
+	for (uint32_t d = 0; d < disks; d++) {
+		disk_free[d] = segs_per_disk;
+		disk_head[d] = LFS_UNMAPPED;
+	}
+	active_disk = 0;
+	num_appends = num_relocated = num_cleaned = 0;
+	return 1;
+}
+
+void lfs_destroy(void) {
+	free(l2p);
+	free(p2l);
+	free(seg_live);
+	free(seg_state);
+	free(disk_live);
+	free(disk_free);
+	free(disk_head);
+	free(disk_cursor);
+	l2p = p2l = NULL;
+	seg_live = NULL;
+	seg_state = NULL;
+	disk_live = disk_free = disk_head = disk_cursor = NULL;
+	logical_blocks = 0;
+}
+
+bool lfs_enabled(void) {
+	return l2p != NULL;
+}
+
+uint64_t lfs_logical_blocks(void) {
+	return logical_blocks;
+}
+
+uint32_t lfs_lookup(uint32_t lba) {
+	return (lba < logical_blocks) ? l2p[lba] : LFS_UNMAPPED;
+}
+
+uint32_t lfs_reverse(uint32_t pba) {
+	return (p2l != NULL && pba < (uint64_t) num_disks * blocks_per_disk) ? p2l[pba] : LFS_UNMAPPED;
+}
+
+uint32_t lfs_append_target(bool cleaning) {
+	uint32_t d = active_disk;
+
+	// Keep appending to the open segment
+	if (disk_head[d] != LFS_UNMAPPED) {
+		return disk_head[d];
+	}
+
+	// Open a new segment, leaving the last free one to the cleaner
+	if (disk_free[d] > 1 || (cleaning && disk_free[d] > 0)) {
+		uint32_t base = d * segs_per_disk;
+		while (seg_state[base + disk_cursor[d]] != SEG_FREE) {
+			disk_cursor[d] = (disk_cursor[d] + 1) % segs_per_disk;
+		}
+		seg_state[base + disk_cursor[d]] = SEG_ACTIVE;
+		disk_free[d]--;
+		disk_head[d] = segment_start(base + disk_cursor[d]);
+		return disk_head[d];
+	}
+
+	return LFS_UNMAPPED;
+}
+
+void lfs_commit(uint32_t lba, uint32_t pba) {
+	uint32_t old = l2p[lba];
+	uint32_t seg = segment_of(pba);
+	uint32_t d = pba / blocks_per_disk;
+
+	// The previous version of the block, if any, is now garbage
+	if (old != LFS_UNMAPPED) {
+		p2l[old] = LFS_UNMAPPED;
+		seg_live[segment_of(old)]--;
+		disk_live[old / blocks_per_disk]--;
+	}
+
+	// Map the new version
+	l2p[lba] = pba;
+	p2l[pba] = lba;
+	seg_live[seg]++;
+	disk_live[d]++;
+	num_appends++;
+
+	// Advance the log head, closing the segment once it is full
+	if (pba + 1 - segment_start(seg) == segment_length(seg)) {
+		seg_state[seg] = SEG_USED;
+		disk_head[d] = LFS_UNMAPPED;
+	} else {
+		disk_head[d] = pba + 1;
+	}
+}
+
+int lfs_pick_victim(uint32_t *first_pba, uint32_t *num_blocks) {
+	uint32_t base = active_disk * segs_per_disk;
+	uint32_t victim = LFS_UNMAPPED;
+	uint32_t best_disk = active_disk;
+
+	// Greedy choice: the closed segment with the fewest live blocks
+	for (uint32_t s = base; s < base + segs_per_disk; s++) {
+		if (seg_state[s] == SEG_USED && (victim == LFS_UNMAPPED || seg_live[s] < seg_live[victim])) {
+			victim = s;
+		}
+	}
+
+	// Look for a disk with more room if cleaning here frees little
+	if (victim == LFS_UNMAPPED || seg_live[victim] * 2 > segment_length(victim)) {
+		for (uint32_t d = 0; d < num_disks; d++) {
+			if (disk_live[d] < disk_live[best_disk]) {
+				best_disk = d;
+			}
+		}
+	}
+
+	if (best_disk != active_disk) {
+		// Switch the log over; the new disk may not need cleaning at all
+		active_disk = best_disk;
+		if (disk_head[best_disk] != LFS_UNMAPPED || disk_free[best_disk] > 1) {
+			return 0;
+		}
+		return lfs_pick_victim(first_pba, num_blocks);
+	}
+
+	if (victim == LFS_UNMAPPED || seg_live[victim] == segment_length(victim)) {
+		return -1;
+	}
+
+	*first_pba = segment_start(victim);
+	*num_blocks = segment_length(victim);
+	return 1;
+}
+
+void lfs_release_segment(uint32_t first_pba, uint32_t num_moved) {
+	uint32_t seg = segment_of(first_pba);
+
+	seg_state[seg] = SEG_FREE;
+	disk_free[first_pba / blocks_per_disk]++;
+	num_relocated += num_moved;
+	num_cleaned++;
+}
+
+uint32_t lfs_free_segments(void) {
+	return disk_free[active_disk];
+}
+
+void lfs_print_stats(void) {
+	uint64_t user_appends = num_appends - num_relocated;
+	fprintf(stderr, "Log appends: %lu, relocated: %lu, segments cleaned: %lu, write amplification: %.2f\n",
+	        (unsigned long) num_appends, (unsigned long) num_relocated, (unsigned long) num_cleaned,
+	        user_appends ? (double) num_appends / user_appends : 0.0);
+}
@@ -0,0 +1,78 @@
+#ifndef LFS_H_
+#define LFS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Log-structured layout for mdadm. Logical blocks are remapped to physical
+ * blocks, and every write is appended at the head of a per-disk log, so a
+ * stream of random writes reaches the JBOD as sequential appends. Each disk is
+ * divided into segments of LFS_SEGMENT_BLOCKS blocks. The cleaner reclaims a
+ * segment by moving its live blocks to the log head. There is no background
+ * cleaner, which would race the single connection to the server: mdadm runs
+ * it within a write once the active disk is down to its last free segment,
+ * and from mdadm_log_clean when the caller is idle. This module only keeps
+ * the metadata; mdadm performs the I/O. Physical blocks are numbered
+ * disk * blocks_per_disk + block. */
+
+#define LFS_SEGMENT_BLOCKS      16
+#define LFS_IDLE_FREE_SEGMENTS  4
+#define LFS_UNMAPPED            UINT32_MAX
+
+/* Returns the number of physical blocks the cleaner needs beyond the logical
+ * capacity on |num_disks| disks of |blocks_per_disk| blocks: one eighth of
+ * them, and at least two segments per disk. */
+uint64_t lfs_reserve_blocks(uint32_t num_disks, uint32_t blocks_per_disk);
+
+/* Returns 1 on success and -1 on failure. Allocates the maps for
+ * |logical_blocks| logical blocks stored on |num_disks| disks of
+ * |blocks_per_disk| blocks, all of them unwritten. Fails if fewer than
+ * lfs_reserve_blocks() of the physical blocks are left over for the
+ * cleaner, so the reserve has to come from disks beyond the logical array. */
+int lfs_create(uint32_t num_disks, uint32_t blocks_per_disk, uint64_t logical_blocks);
+
+/* Frees the maps allocated by lfs_create. */
+void lfs_destroy(void);
+
+/* Returns true if the log-structured layout is active. */
+bool lfs_enabled(void);
+
+/* Returns the number of logical blocks that can be stored. */
+uint64_t lfs_logical_blocks(void);
+
+/* Returns the physical block holding logical block |lba|, or LFS_UNMAPPED if
+ * it was never written (and so reads as zeroes). */
+uint32_t lfs_lookup(uint32_t lba);
+
+/* Returns the logical block stored in physical block |pba|, or LFS_UNMAPPED
+ * if that block is free, holds a stale version or does not exist. */
+uint32_t lfs_reverse(uint32_t pba);
+
+/* Returns the physical block at the head of the log that the next write
+ * should go to, or LFS_UNMAPPED if the active disk has to be cleaned first.
+ * Only the cleaner (|cleaning| set) may use a disk's last free segment. */
+uint32_t lfs_append_target(bool cleaning);
+
+/* Records that logical block |lba| was written to |pba|, the block last
+ * returned by lfs_append_target, and advances the log head. */
+void lfs_commit(uint32_t lba, uint32_t pba);
+
+/* Chooses a segment to clean, the one with the fewest live blocks on the
+ * active disk. If cleaning that disk would free nothing, the active disk moves
+ * to the disk with the most reclaimable space first. Stores the first
+ * physical block and length of the segment in |first_pba| and |num_blocks|.
+ * Returns 1 on success, 0 if the log moved to a disk with a free segment so
+ * that there is nothing to clean, and -1 if no space can be reclaimed. */
+int lfs_pick_victim(uint32_t *first_pba, uint32_t *num_blocks);
+
+/* Marks the segment starting at |first_pba| free once its |num_moved| live
+ * blocks have been moved, counting them as relocated. */
+void lfs_release_segment(uint32_t first_pba, uint32_t num_moved);
+
+/* Returns the number of free segments on the active disk. */
+uint32_t lfs_free_segments(void);
+
+/* Prints append, cleaning and write amplification counters. */
+void lfs_print_stats(void);
+
+#endif
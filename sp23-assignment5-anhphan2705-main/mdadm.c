@@ -1,32 +1,197 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <arpa/inet.h>
 
 #include "mdadm.h"
 #include "jbod.h"
 #include "cache.h"
 #include "net.h"
+#include "lfs.h"
+#include "wcb.h"
+#include "lease.h"
+#include "qos.h"
+#include "util.h"
 
 int is_mounted = 0;
 
+/* geometry of the array; the v1 protocol can only address 16 disks of 256
+ * blocks, with the extended protocol the server reports it at mount time,
+ * along with the spare disks that follow the array */
+static uint32_t num_disks = JBOD_NUM_DISKS;
+static uint32_t spare_disks = 0;
+static uint32_t blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK;
+static int blocks_per_disk_shift = 8;  /* -1 if not a power of two */
+static uint64_t array_size = (uint64_t) JBOD_NUM_DISKS * JBOD_DISK_SIZE;
+
+/* where the JBOD head is after our last operation; reads and writes advance
+ * it by one block, so sequential accesses need no further seeks */
+static int head_valid = 0;
+static uint32_t head_disk = 0;
+static uint32_t head_block = 0;
+
+/* the most blocks a read of up to 1024 bytes covers */
+#define RANGE_MAX_BLOCKS (1024 / JBOD_BLOCK_SIZE + 1)
+
+/* whether the next mount uses the log-structured layout of lfs.c */
+static int log_structured = 0;
+
+/* the invalidations handled while fetch_blocks waits on its batch, with the
+ * versions they announce; a block read before one of them came is stale.
+ * -1 while no batch is in flight, and past REVOKED_MAX once they no longer
+ * fit, which makes every block of the batch stale. */
+#define REVOKED_MAX 16
+static cache_key_t revoked[REVOKED_MAX];
+static uint32_t revoked_versions[REVOKED_MAX];
+static int num_revoked = -1;
+
+static int flush_buffered(void);
+
+
+uint64_t encode_operation(int cmd, uint32_t disk_num, uint32_t block_num) {
+	return JBOD_OP(cmd, disk_num, block_num);
+}
 
-uint32_t encode_operation(int cmd, int disk_num, int block_num) {
-	return (cmd << 26) | (disk_num << 22) | (block_num) ;
+/* records the geometry of the array and precomputes the shift used by
+ * translate_address */
+static void set_geometry(uint32_t disks, uint32_t blocks, uint32_t spares) {
+	num_disks = disks;
+	spare_disks = spares;
+	blocks_per_disk = blocks;
+	array_size = (uint64_t) disks * blocks * JBOD_BLOCK_SIZE;
+
+	blocks_per_disk_shift = -1;
+	if ((blocks & (blocks - 1)) == 0) {
+		blocks_per_disk_shift = 0;
+		while ((1u << blocks_per_disk_shift) < blocks)
+			blocks_per_disk_shift++;
+	}
 }
 
-int mdadm_mount(void) {
-	uint32_t op = encode_operation(JBOD_MOUNT, 0, 0);
-	int mount = jbod_client_operation(op, NULL);
-	if (mount == 0) {
-		is_mounted = 1;
+/* drops the block another client is about to write from the cache; the
+ * log-structured layout, which would remap it, is never used over v3 */
+static void invalidate_block(uint32_t disk_num, uint32_t block_num, uint32_t version) {
+	cache_invalidate(disk_num, block_num);
+
+	if (num_revoked >= 0 && num_revoked < REVOKED_MAX) {
+		revoked[num_revoked] = (cache_key_t) { disk_num, block_num };
+		revoked_versions[num_revoked] = version;
+	}
+	if (num_revoked >= 0 && num_revoked <= REVOKED_MAX) {
+		num_revoked++;
+	}
+}
+
+/* returns whether an invalidation handled during the last batch made the
+ * copy of |key| it read at version |version| stale */
+static int is_revoked(const cache_key_t *key, uint32_t version) {
+	if (num_revoked > REVOKED_MAX) {
 		return 1;
 	}
-  return -1;
+	for (int i = 0; i < num_revoked; i++) {
+		if (revoked[i].disk_num == key->disk_num && revoked[i].block_num == key->block_num &&
+		    revoked_versions[i] > version) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
-int mdadm_unmount(void) {
-	uint32_t op = encode_operation(JBOD_UNMOUNT, 0, 0);
-	int mount = jbod_client_operation(op, NULL);
+/* drops the cached blocks that other clients are about to write and those
+ * whose lease ran out; only over v3 do other clients' writes reach the
+ * cache, and it must be done before the cache is trusted */
+static int drop_stale(void) {
+	uint32_t disk_num, block_num;
+
+	if (jbod_protocol() != JBOD_PROTO_V3 || !cache_enabled()) {
+		return 1;
+	}
+	if (jbod_client_poll() == -1) {
+		return -1;
+	}
+	uint64_t now = lease_now_ms();
+	while (lease_expired(now, &disk_num, &block_num)) {
+		cache_invalidate(disk_num, block_num);
+	}
+	return 1;
+}
+
+/* mounts the array for mdadm_mount, once it was admitted */
+static int mount_array(void) {
+	uint64_t op = encode_operation(JBOD_MOUNT, 0, 0);
+	int mount = jbod_client_operation64(op, NULL);
+	if (mount != 0) {
+		return -1;
+	}
+
+	// Ask the server how large the array is when it can be more than 1 MiB
+	if (jbod_protocol() != JBOD_PROTO_V1) {
+		uint8_t reply[JBOD_BLOCK_SIZE];
+		uint32_t geometry[3];
+		if (jbod_client_operation64(encode_operation(JBOD_GET_GEOMETRY, 0, 0), reply) != 0) {
+			return -1;
+		}
+		memcpy(geometry, reply, sizeof(geometry));
+		set_geometry(ntohl(geometry[0]), ntohl(geometry[1]), ntohl(geometry[2]));
+	} else {
+		set_geometry(JBOD_NUM_DISKS, JBOD_NUM_BLOCKS_PER_DISK, 0);
+	}
+
+	// Count cache lookups for every disk; if that fails they just go uncounted
+	cache_set_stats_disks(num_disks);
+
+	// Blocks cached before this mount are stale: a fresh mount starts from
+	// zeroed disks, and other clients wrote the array of one we joined. They
+	// cannot be dropped while pinned or held by a ref
+	if (cache_enabled() && cache_clear() != 1) {
+		jbod_client_operation64(encode_operation(JBOD_UNMOUNT, 0, 0), NULL);
+		return -1;
+	}
+
+	// A fresh mount starts from zeroed disks, so start from an empty map.
+	// The log spans the spare disks too, which hold the cleaner's reserve,
+	// so that every address of the array stays usable
+	lfs_destroy();
+	if (log_structured) {
+		// Its map lives in this client alone, so other clients could neither
+		// read the array nor tell this one which of its blocks they write
+		if (jbod_protocol() == JBOD_PROTO_V3) {
+			fprintf(stderr, "The log-structured layout cannot be shared with other clients over v3\n");
+			jbod_client_operation64(encode_operation(JBOD_UNMOUNT, 0, 0), NULL);
+			return -1;
+		}
+		uint64_t reserve = lfs_reserve_blocks(num_disks + spare_disks, blocks_per_disk);
+		if ((uint64_t) spare_disks * blocks_per_disk < reserve) {
+			fprintf(stderr, "The log-structured layout needs %lu spare blocks for its cleaner, "
+			        "but the array has %u spare disks of %u blocks\n",
+			        (unsigned long) reserve, spare_disks, blocks_per_disk);
+			jbod_client_operation64(encode_operation(JBOD_UNMOUNT, 0, 0), NULL);
+			return -1;
+		}
+		if (lfs_create(num_disks + spare_disks, blocks_per_disk, (uint64_t) num_disks * blocks_per_disk) == -1) {
+			jbod_client_operation64(encode_operation(JBOD_UNMOUNT, 0, 0), NULL);
+			return -1;
+		}
+	}
+
+	// Over v3, other clients may write the blocks we cache
+	lease_clear();
+	jbod_set_invalidate_handler(invalidate_block);
+
+	head_valid = 0;
+	is_mounted = 1;
+	return 1;
+}
+
+/* unmounts the array for mdadm_unmount, once it was admitted */
+static int unmount_array(void) {
+	// Nothing may stay behind in the write-combining buffer
+	if (is_mounted && flush_buffered() == -1) {
+		return -1;
+	}
+
+	uint64_t op = encode_operation(JBOD_UNMOUNT, 0, 0);
+	int mount = jbod_client_operation64(op, NULL);
 
 	if (mount == 0) {
 		is_mounted = 0;
@@ -36,6 +201,26 @@ int mdadm_unmount(void) {
   return -1;
 }
 
+/* Mounting and unmounting are admitted like every other request, so that
+ * they never overlap another thread's use of the connection */
+int mdadm_mount(void) {
+	qos_admit(0);
+	int rc = mount_array();
+	qos_done();
+	return rc;
+}
+
+int mdadm_unmount(void) {
+	qos_admit(0);
+	int rc = unmount_array();
+	qos_done();
+	return rc;
+}
+
+uint64_t mdadm_size(void) {
+	return array_size;
+}
+
 
 int min(int a, int b) 
 {
@@ -43,74 +228,365 @@ int min(int a, int b)
 }
 
 
-void translate_address(uint32_t address, int *disk_num, int *block_num, int*offset) {
-	*disk_num = address/ JBOD_DISK_SIZE;
- 	*block_num = (address % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
- 	*offset = (address % JBOD_DISK_SIZE) % JBOD_BLOCK_SIZE;
+void translate_address(uint64_t address, uint32_t *disk_num, uint32_t *block_num, int *offset) {
+	uint64_t linear_block = address / JBOD_BLOCK_SIZE;
+
+	*offset = address % JBOD_BLOCK_SIZE;
+	if (blocks_per_disk_shift >= 0) {
+		*disk_num = linear_block >> blocks_per_disk_shift;
+		*block_num = linear_block & (blocks_per_disk - 1);
+	} else {
+		*disk_num = linear_block / blocks_per_disk;
+		*block_num = linear_block % blocks_per_disk;
+	}
 }
 
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
-  // Check if the disk is mounted
-  if (!is_mounted) {
-      return -1;
-  }
+/* positions the JBOD head at |block_num| of |disk_num|, skipping the seeks
+ * that our own tracking says are unnecessary */
+static int seek_to(uint32_t disk_num, uint32_t block_num) {
+	if (head_valid && head_disk == disk_num && head_block == block_num) {
+		return 1;
+	}
 
-  // Check if the read length is too long
-  if (len > 1024) {
-      return -1;
-  }
+	int same_disk = head_valid && head_disk == disk_num;
+	head_valid = 0;
+	if (!same_disk) {
+		if (jbod_client_operation64(encode_operation(JBOD_SEEK_TO_DISK, disk_num, 0), NULL) != 0) {
+			return -1;
+		}
+	}
+	if (jbod_client_operation64(encode_operation(JBOD_SEEK_TO_BLOCK, disk_num, block_num), NULL) != 0) {
+		return -1;
+	}
+
+	head_valid = 1;
+	head_disk = disk_num;
+	head_block = block_num;
+	return 1;
+}
+
+/* seeks to the block named in |op| and issues the read, write or fill there,
+ * advancing our copy of the head with it */
+static int block_operation(uint64_t op, uint8_t *block) {
+	if (seek_to(JBOD_OP_DISK(op), JBOD_OP_BLOCK(op)) == -1) {
+		return -1;
+	}
+	if (jbod_client_operation64(op, block) != 0) {
+		head_valid = 0;
+		return -1;
+	}
+	head_block++;
+	return 1;
+}
+
+/* returns the op for |cmd| on physical block |pba| of the log-structured
+ * layout */
+static uint64_t physical_operation(int cmd, uint32_t pba) {
+	return encode_operation(cmd, pba / blocks_per_disk, pba % blocks_per_disk);
+}
+
+/* moves the live blocks of one segment to the log head so the segment can be
+ * reused; returns 1 if a segment was cleaned, 0 if the log moved to a disk
+ * with free space instead and -1 on failure */
+static int log_clean(void) {
+	uint8_t live[LFS_SEGMENT_BLOCKS][JBOD_BLOCK_SIZE];
+	uint32_t lbas[LFS_SEGMENT_BLOCKS];
+	uint32_t first_pba, num_blocks, pba;
+	int num_live = 0;
+
+	int rc = lfs_pick_victim(&first_pba, &num_blocks);
+	if (rc != 1) {
+		return rc;
+	}
+
+	// Read the live blocks of the victim in one sequential pass
+	for (uint32_t i = 0; i < num_blocks; i++) {
+		uint32_t lba = lfs_reverse(first_pba + i);
+		if (lba == LFS_UNMAPPED) {
+			continue;
+		}
+		if (block_operation(physical_operation(JBOD_READ_BLOCK, first_pba + i), live[num_live]) == -1) {
+			return -1;
+		}
+		lbas[num_live++] = lba;
+	}
+
+	// Append them at the log head, dipping into the cleaner's reserve
+	for (int i = 0; i < num_live; i++) {
+		if ((pba = lfs_append_target(true)) == LFS_UNMAPPED ||
+		    block_operation(physical_operation(JBOD_WRITE_BLOCK, pba), live[i]) == -1) {
+			return -1;
+		}
+		lfs_commit(lbas[i], pba);
+	}
+
+	lfs_release_segment(first_pba, num_live);
+	return 1;
+}
+
+/* reads the |n| blocks of |keys| from the JBOD into |bufs|, caching them.
+ * The seeks block_operation would make and the reads all go out as one
+ * pipelined batch, so that the blocks cost a single round trip. Over v3
+ * only the blocks leased to us are cached, and only until the lease runs
+ * out. */
+static int fetch_blocks(const cache_key_t *keys, int n, uint8_t **bufs) {
+	uint64_t ops[JBOD_MAX_BATCH];
+	uint8_t *blocks[JBOD_MAX_BATCH];
+	jbod_lease_t leases[JBOD_MAX_BATCH];
+	int read_ops[JBOD_MAX_BATCH];
+	int num_ops = 0;
+
+	// Each block takes up to two seeks and a read
+	assert(n * 3 <= JBOD_MAX_BATCH);
+
+	int valid = head_valid;
+	uint32_t disk = head_disk, block = head_block;
+	for (int i = 0; i < n; i++) {
+		uint64_t op = encode_operation(JBOD_READ_BLOCK, keys[i].disk_num, keys[i].block_num);
+		read_ops[i] = -1;
+		if (lfs_enabled()) {
+			// Blocks that were never written read as zeroes, like a fresh mount
+			uint32_t pba = lfs_lookup(keys[i].disk_num * blocks_per_disk + keys[i].block_num);
+			if (pba == LFS_UNMAPPED) {
+				memset(bufs[i], 0, JBOD_BLOCK_SIZE);
+				continue;
+			}
+			op = physical_operation(JBOD_READ_BLOCK, pba);
+		}
+
+		// Seek only where our copy of the head says seek_to would
+		uint32_t op_disk = JBOD_OP_DISK(op), op_block = JBOD_OP_BLOCK(op);
+		if (!valid || disk != op_disk) {
+			ops[num_ops] = encode_operation(JBOD_SEEK_TO_DISK, op_disk, 0);
+			blocks[num_ops++] = NULL;
+		}
+		if (!valid || disk != op_disk || block != op_block) {
+			ops[num_ops] = encode_operation(JBOD_SEEK_TO_BLOCK, op_disk, op_block);
+			blocks[num_ops++] = NULL;
+		}
+		read_ops[i] = num_ops;
+		ops[num_ops] = op;
+		blocks[num_ops++] = bufs[i];
+		valid = 1;
+		disk = op_disk;
+		block = op_block + 1;
+	}
+
+	// A lease runs from when we asked for it, a little before the server granted it
+	uint64_t sent_ms = lease_now_ms();
+	head_valid = 0;
+	num_revoked = 0;
+	int rc = (num_ops > 0) ? jbod_client_batch64(ops, blocks, leases, num_ops) : 0;
+	num_revoked = -1;
+	if (rc != 0) {
+		return -1;
+	}
+	head_valid = valid;
+	head_disk = disk;
+	head_block = block;
+
+	if (cache_enabled() && jbod_protocol() != JBOD_PROTO_V3) {
+		cache_insert_many(keys, n, bufs);
+	} else if (cache_enabled()) {
+		// Leave out the blocks the server would not lease and those an
+		// invalidation that came after them made stale
+		cache_key_t leased[JBOD_MAX_BATCH];
+		uint8_t *leased_bufs[JBOD_MAX_BATCH];
+		int num_leased = 0;
+		for (int i = 0; i < n; i++) {
+			int r = read_ops[i];
+			if (r == -1 || leases[r].lease_ms == 0 || is_revoked(&keys[i], leases[r].version) ||
+			    lease_add(keys[i].disk_num, keys[i].block_num, sent_ms + leases[r].lease_ms) == -1) {
+				continue;
+			}
+			leased[num_leased] = keys[i];
+			leased_bufs[num_leased++] = bufs[i];
+		}
+		cache_insert_many(leased, num_leased, leased_bufs);
+	}
+	return 1;
+}
+
+/* reads one block from the JBOD, caching it */
+static int fetch_block(uint32_t disk_num, uint32_t block_num, uint8_t *buf) {
+	cache_key_t key = { disk_num, block_num };
+	return fetch_blocks(&key, 1, &buf);
+}
+
+/* reads one block, from the cache when it holds the block */
+static int read_block(uint32_t disk_num, uint32_t block_num, uint8_t *buf) {
+	if (cache_enabled() && cache_lookup(disk_num, block_num, buf) == 1) {
+		return 1;
+	}
+	return fetch_block(disk_num, block_num, buf);
+}
+
+/* writes one block through to the JBOD and keeps the cached copy current.
+ * If |fill| is not -1 the server generates the block, which must already
+ * hold |fill| in every byte, with JBOD_FILL_BLOCK. */
+static int write_block(uint32_t disk_num, uint32_t block_num, uint8_t *buf, int fill) {
+	int cmd = (fill == -1) ? JBOD_WRITE_BLOCK : JBOD_FILL_BLOCK;
+	uint64_t fill_bits = (fill == -1) ? 0 : (uint64_t) fill << JBOD_OP_FILL_SHIFT;
+
+	if (lfs_enabled()) {
+		// Append the new version at the log head, cleaning first if the
+		// active disk has run out of segments
+		uint32_t pba;
+		while ((pba = lfs_append_target(false)) == LFS_UNMAPPED) {
+			if (log_clean() == -1) {
+				return -1;
+			}
+		}
+		if (block_operation(physical_operation(cmd, pba) | fill_bits, buf) == -1) {
+			return -1;
+		}
+		lfs_commit(disk_num * blocks_per_disk + block_num, pba);
+	} else if (block_operation(encode_operation(cmd, disk_num, block_num) | fill_bits, buf) == -1) {
+		return -1;
+	}
+
+	if (cache_enabled()) {
+		cache_update(disk_num, block_num, buf);
+	}
+	return 1;
+}
 
-  // Check if the buffer is null but the length is positive
-  if (buf == NULL && len > 0) {
+/* writes the buffered bytes of |entry| back, merging them into the current
+ * contents of the block, and frees the entry */
+static int write_back(wcb_entry_t *entry) {
+	uint8_t block[JBOD_BLOCK_SIZE];
+
+	if (read_block(entry->disk_num, entry->block_num, block) == -1) {
+		return -1;
+	}
+	wcb_overlay(entry, block);
+	if (write_block(entry->disk_num, entry->block_num, block, -1) == -1) {
+		return -1;
+	}
+
+	wcb_release(entry);
+	return 1;
+}
+
+/* writes back the buffered blocks whose timeout has passed */
+static int write_back_expired(void) {
+	wcb_entry_t *entry;
+
+	while ((entry = wcb_expired()) != NULL) {
+		if (write_back(entry) == -1) {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/* adds a sub-block write to the write-combining buffer; the block goes out
+ * once all of its bytes were written, without reading it first */
+static int buffer_write(uint32_t disk_num, uint32_t block_num, int offset, int len, const uint8_t *buf) {
+	wcb_entry_t *entry = wcb_find(disk_num, block_num);
+
+	// Make room by writing back the entry that has waited longest
+	while (entry == NULL && (entry = wcb_alloc(disk_num, block_num)) == NULL) {
+		if (write_back(wcb_oldest()) == -1) {
+			return -1;
+		}
+	}
+
+	if (wcb_merge(entry, offset, len, buf)) {
+		int rc = write_block(disk_num, block_num, entry->block, -1);
+		wcb_release(entry);
+		return rc;
+	}
+	return 1;
+}
+
+/* drops the buffered bytes of a block that is being overwritten in full */
+static void discard_buffered(uint32_t disk_num, uint32_t block_num) {
+	wcb_entry_t *entry = wcb_enabled() ? wcb_find(disk_num, block_num) : NULL;
+
+	if (entry != NULL) {
+		wcb_release(entry);
+	}
+}
+
+/* returns whether a request of |len| bytes at |addr| with buffer |buf| fits
+ * the mounted array, and is no longer than |max_len|; checked before the
+ * request is admitted, so that QoS only charges requests that can run */
+static bool request_valid(uint64_t addr, uint32_t len, const void *buf, uint32_t max_len) {
+	return is_mounted && len <= max_len && (buf != NULL || len == 0) && addr + len <= array_size;
+}
+
+static int read_range(uint64_t addr, uint32_t len, uint8_t *buf) {
+  // Check if the disk is still mounted; another thread may have unmounted it
+  // since the request was checked
+  if (!is_mounted) {
       return -1;
   }
 
-  // Check if the read extends beyond the disk size
-  if (addr + len > 1048576) {
+  // Drop cached blocks other clients made stale, and write back buffered
+  // blocks that have waited too long
+  if (drop_stale() == -1 || (wcb_enabled() && write_back_expired() == -1)) {
       return -1;
   }
 
-  // Initialize variables for disk, block, and offset
-  int disk_num = 0;
-  int block_num = 0;
+  // Translate the range into the blocks it covers
+  cache_key_t keys[RANGE_MAX_BLOCKS];
+  uint8_t blocks[RANGE_MAX_BLOCKS][JBOD_BLOCK_SIZE];
+  uint8_t *bufs[RANGE_MAX_BLOCKS];
+  uint32_t disk_num = 0;
+  uint32_t block_num = 0;
   int offset = 0;
-  int temp_addr = addr;
-  int num_read = 0;
-
-  // Translate the starting address to disk, block, and offset values
-  translate_address(temp_addr, &disk_num, &block_num, &offset);
-
-  // Seek to the correct disk and block
-  uint32_t op_disk = encode_operation(JBOD_SEEK_TO_DISK, disk_num, block_num);
-  uint32_t op_block = encode_operation(JBOD_SEEK_TO_BLOCK, disk_num, block_num);
-  jbod_client_operation(op_disk, NULL);
-  jbod_client_operation(op_block, NULL);
-
-  // Loop until the entire read length has been processed
-  while (len > 0) {
-    // Read the next block into a temporary buffer
-    uint8_t sbuf[256];
-    uint32_t op_read = encode_operation(JBOD_READ_BLOCK, 0, 0);
-    jbod_client_operation(op_read, sbuf);
+  int n = 0;
+  for (uint32_t num_covered = 0; num_covered < len; n++) {
+    translate_address(addr + num_covered, &disk_num, &block_num, &offset);
+    keys[n].disk_num = disk_num;
+    keys[n].block_num = block_num;
+    bufs[n] = blocks[n];
+    num_covered += JBOD_BLOCK_SIZE - offset;
+  }
+  translate_address(addr, &disk_num, &block_num, &offset);
+
+  // Copy a read within one block straight out of the cache when nothing
+  // buffered has to be laid over it, and otherwise look all the blocks up at
+  // once; either way the blocks the cache missed are not looked up again
+  uint64_t hit_mask = 0;
+  if (n == 1 && cache_enabled() && !(wcb_enabled() && wcb_find(disk_num, block_num) != NULL)) {
+    cache_ref_t ref;
+    if (cache_get_ref(disk_num, block_num, blocks[0], &ref) == 1) {
+      memcpy(buf, ref.data + offset, len);
+      cache_put_ref(&ref);
+      return len;
+    }
+  } else if (cache_enabled()) {
+    cache_lookup_many(keys, n, bufs, &hit_mask);
+  }
 
-    // Determine how many bytes can be read from the current block
-    int bytes_read = min(len, min(256, 256 - offset));
+  // Read the blocks the cache missed from the JBOD in one batch
+  cache_key_t missing[RANGE_MAX_BLOCKS];
+  uint8_t *missing_bufs[RANGE_MAX_BLOCKS];
+  int num_missing = 0;
+  for (int i = 0; i < n; i++) {
+    if (!(hit_mask & (1ull << i))) {
+      missing[num_missing] = keys[i];
+      missing_bufs[num_missing++] = bufs[i];
+    }
+  }
+  if (num_missing > 0 && fetch_blocks(missing, num_missing, missing_bufs) == -1) {
+    return -1;
+  }
 
-    // Copy the bytes from the temporary buffer to the output buffer
-    memcpy(buf + num_read, sbuf + offset, len);
+  // Apply writes that are still sitting in the write-combining buffer and
+  // copy the requested part of each block to the output buffer
+  uint32_t num_read = 0;
+  for (int i = 0; i < n; i++) {
+    wcb_entry_t *entry = wcb_enabled() ? wcb_find(keys[i].disk_num, keys[i].block_num) : NULL;
+    if (entry != NULL) {
+      wcb_overlay(entry, bufs[i]);
+    }
 
-    // Update the read counters and seek to the next block if necessary
+    int bytes_read = min(len - num_read, JBOD_BLOCK_SIZE - offset);
+    memcpy(buf + num_read, bufs[i] + offset, bytes_read);
     num_read += bytes_read;
-    len -= bytes_read;
-    block_num += 1;
-    if (block_num == 256) {
-      block_num = 0;
-      disk_num++;
-      op_disk = encode_operation(JBOD_SEEK_TO_DISK, disk_num, block_num);
-      op_block = encode_operation(JBOD_SEEK_TO_BLOCK, disk_num, block_num);
-      jbod_client_operation(op_disk, NULL);
-      jbod_client_operation(op_block, NULL);
-    }
     offset = 0;
   }
 
@@ -120,73 +596,305 @@ int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
 
 
 
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
-  // Check if the disks are mounted
+static int write_range(uint64_t addr, uint32_t len, const uint8_t *buf) {
+  // Check if the disks are still mounted
   if (!is_mounted) {
       return -1;
   }
 
-  // Check if the data length is too large
-  if (len > 1024) {
+  // Drop cached blocks other clients made stale, and write back buffered
+  // blocks that have waited too long
+  if (drop_stale() == -1 || (wcb_enabled() && write_back_expired() == -1)) {
       return -1;
   }
 
-  // Check if the data buffer is null but length is non-zero
-  if (buf == NULL && len > 0) {
+  // Initialize variables
+  uint32_t write_count = 0;
+  uint32_t disk_num = 0;
+  uint32_t block_num = 0;
+  int offset = 0;
+
+  // Loop through the data to write
+  while (write_count < len) {
+      // Translate the address to disk, block, and offset
+      translate_address(addr, &disk_num, &block_num, &offset);
+      int num_bytes = min(len - write_count, JBOD_BLOCK_SIZE - offset);
+
+      if (num_bytes < JBOD_BLOCK_SIZE && wcb_enabled()) {
+          // Combine partial writes to the block instead of doing a
+          // read-modify-write for each of them
+          if (buffer_write(disk_num, block_num, offset, num_bytes, buf + write_count) == -1) {
+              return -1;
+          }
+      } else {
+          // Read the block unless it is about to be overwritten entirely
+          uint8_t mybuf[JBOD_BLOCK_SIZE];
+          if (num_bytes < JBOD_BLOCK_SIZE && read_block(disk_num, block_num, mybuf) == -1) {
+              return -1;
+          }
+
+          // Copy the data to write into the block buffer and write it back
+          memcpy(mybuf + offset, buf + write_count, num_bytes);
+          discard_buffered(disk_num, block_num);
+          if (write_block(disk_num, block_num, mybuf, -1) == -1) {
+              return -1;
+          }
+      }
+
+      // Update the counters
+      write_count += num_bytes;
+      addr += num_bytes;
+  }
+
+  // Return the number of bytes written
+  return len;
+}
+
+
+static int fill_range(uint64_t addr, uint32_t len, uint8_t byte) {
+  // Check if the disks are still mounted
+  if (!is_mounted) {
       return -1;
   }
 
-  // Check if the data goes beyond the disk size
-  if (addr + len > 1048576) {
+  // Drop cached blocks other clients made stale
+  if (drop_stale() == -1) {
       return -1;
   }
 
+  // Partial blocks still need a read-modify-write, so keep a block of the
+  // fill byte around to hand to write_range
+  uint8_t fill_buf[JBOD_BLOCK_SIZE];
+  memset(fill_buf, byte, sizeof(fill_buf));
+
   // Initialize variables
-  int temp_len = len;
-  int write_count = 0;
-  int disk_num = 0;
-  int block_num = 0;
+  uint32_t fill_count = 0;
+  uint32_t disk_num = 0;
+  uint32_t block_num = 0;
   int offset = 0;
 
-  // Loop through the data to write
-  while (write_count < len) {
+  // Loop through the range to fill
+  while (fill_count < len) {
       // Translate the address to disk, block, and offset
       translate_address(addr, &disk_num, &block_num, &offset);
-
-      // Read the block data from the disk
-      uint8_t mybuf[256];
-      uint32_t op_disk = encode_operation(JBOD_SEEK_TO_DISK, disk_num, 0);
-      uint32_t op_block = encode_operation(JBOD_SEEK_TO_BLOCK, disk_num, block_num);
-      uint32_t op_read = encode_operation(JBOD_READ_BLOCK, disk_num, block_num);
-      jbod_client_operation(op_disk, NULL);
-      jbod_client_operation(op_block, NULL);
-      jbod_client_operation(op_read, mybuf);
-
-      // Copy the data to write into the block buffer
-      int num_bytes = min(temp_len, 256 - offset);
-      memcpy(mybuf + offset, buf + write_count, num_bytes);
-
-      // Write the block data back to the disk
-      uint32_t op_write = encode_operation(JBOD_WRITE_BLOCK, disk_num, block_num);
-      jbod_client_operation(op_disk, NULL);
-      jbod_client_operation(op_block, NULL);
-      jbod_client_operation(op_write, mybuf);
-
-      // If we've written to the last block on the disk, move to the next disk
-      if (block_num == 256) {
-          disk_num++;
-          block_num = 0;
-          jbod_client_operation(op_disk, NULL);
-          jbod_client_operation(op_block, NULL);
+      int num_bytes = min(len - fill_count, JBOD_BLOCK_SIZE - offset);
+
+      if (num_bytes < JBOD_BLOCK_SIZE) {
+          // Head or tail of the range: merge the fill byte into the block
+          if (write_range(addr, num_bytes, fill_buf) == -1) {
+              return -1;
+          }
+      } else {
+          // Whole block: let the server generate it from the fill byte
+          discard_buffered(disk_num, block_num);
+          if (write_block(disk_num, block_num, fill_buf, byte) == -1) {
+              return -1;
+          }
       }
 
-      // Reset the offset and update the counters
-      offset = 0;
-      temp_len -= num_bytes;
-      write_count += num_bytes;
+      // Update the counters
+      fill_count += num_bytes;
       addr += num_bytes;
   }
 
-  // Return the number of bytes written
+  // Return the number of bytes filled
   return len;
-}
\ No newline at end of file
+}
+
+
+/* writes back everything held in the write-combining buffer */
+static int flush_buffered(void) {
+	wcb_entry_t *entry;
+
+	if (!is_mounted || drop_stale() == -1) {
+		return -1;
+	}
+
+	while (wcb_enabled() && (entry = wcb_oldest()) != NULL) {
+		if (write_back(entry) == -1) {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/* Every request is admitted by the QoS scheduler, which also keeps threads
+ * from using the connection at the same time, with or without QoS handles */
+int mdadm_read(uint64_t addr, uint32_t len, uint8_t *buf) {
+	if (!request_valid(addr, len, buf, 1024)) {
+		return -1;
+	}
+	qos_admit(len);
+	int rc = read_range(addr, len, buf);
+	qos_done();
+	return rc;
+}
+
+int mdadm_write(uint64_t addr, uint32_t len, const uint8_t *buf) {
+	if (!request_valid(addr, len, buf, 1024)) {
+		return -1;
+	}
+	qos_admit(len);
+	int rc = write_range(addr, len, buf);
+	qos_done();
+	return rc;
+}
+
+int mdadm_fill(uint64_t addr, uint32_t len, uint8_t byte) {
+	if (!request_valid(addr, len, &byte, UINT32_MAX)) {
+		return -1;
+	}
+	qos_admit(len);
+	int rc = fill_range(addr, len, byte);
+	qos_done();
+	return rc;
+}
+
+int mdadm_sign_block(int disk_num, int block_num, uint8_t *buf) {
+	uint8_t reply[JBOD_BLOCK_SIZE];
+
+	if (!is_mounted || disk_num < 0 || block_num < 0 || (uint32_t) disk_num >= num_disks ||
+	    (uint32_t) block_num >= blocks_per_disk) {
+		return -1;
+	}
+
+	// Sign the physical block holding it; a block never written reads as
+	// zeroes. The map is only looked at once admitted, as writes change it
+	qos_admit(0);
+	uint64_t op = encode_operation(JBOD_SIGN_BLOCK, disk_num, block_num);
+	uint32_t pba = lfs_enabled() ? lfs_lookup(disk_num * blocks_per_disk + block_num) : 0;
+	int rc = 0;
+	if (lfs_enabled() && pba == LFS_UNMAPPED) {
+		memset(reply, 0, JBOD_BLOCK_SIZE);
+		snprintf((char *) reply, JBOD_BLOCK_SIZE, "SIG(disk,block) %2d %3d : %s\n",
+		         disk_num, block_num, sha1_sig(reply, JBOD_BLOCK_SIZE));
+	} else {
+		if (lfs_enabled()) {
+			op = physical_operation(JBOD_SIGN_BLOCK, pba);
+		}
+		rc = jbod_client_operation64(op, reply);
+	}
+	qos_done();
+	if (rc != 0) {
+		return -1;
+	}
+
+	// The reply reads "SIG(disk,block) <disk> <block> : <signature>"; name
+	// the logical block rather than where the log put it
+	reply[JBOD_BLOCK_SIZE - 1] = '\0';
+	char *sig = strstr((char *) reply, " : ");
+	if (sig == NULL) {
+		return -1;
+	}
+	snprintf((char *) buf, JBOD_BLOCK_SIZE, "SIG(disk,block) %2d %3d%s", disk_num, block_num, sig);
+	return 1;
+}
+
+/* returns whether the signature in |reply|, as the server words it, is
+ * that of |buf| */
+static bool signature_matches(const uint8_t *reply, const uint8_t *buf) {
+	uint8_t copy[JBOD_BLOCK_SIZE];
+
+	const char *sig = strstr((const char *) reply, " : ");
+	memcpy(copy, buf, JBOD_BLOCK_SIZE);
+	const char *expected = sha1_sig(copy, JBOD_BLOCK_SIZE);
+	return sig != NULL && strncmp(sig + 3, expected, strlen(expected)) == 0;
+}
+
+int mdadm_blocks_current(const cache_key_t *keys, int n, const uint8_t *const *bufs, uint64_t *valid_mask) {
+	static const uint8_t zeroes[JBOD_BLOCK_SIZE];
+	uint8_t replies[JBOD_MAX_BATCH][JBOD_BLOCK_SIZE];
+	uint64_t ops[JBOD_MAX_BATCH];
+	uint8_t *blocks[JBOD_MAX_BATCH];
+	int signed_keys[JBOD_MAX_BATCH];
+
+	*valid_mask = 0;
+	if (!is_mounted || n < 0 || n > CACHE_BATCH_MAX) {
+		return -1;
+	}
+
+	// Sign the blocks a pipelined batch at a time, each in the physical block
+	// holding it; the map is only looked at once admitted, as writes change it
+	qos_admit(0);
+	int rc = 0;
+	for (int first = 0; rc == 0 && first < n; first += JBOD_MAX_BATCH) {
+		int end = (n - first > JBOD_MAX_BATCH) ? first + JBOD_MAX_BATCH : n;
+		int num_ops = 0;
+		for (int i = first; i < end; i++) {
+			int disk_num = keys[i].disk_num, block_num = keys[i].block_num;
+			if (disk_num < 0 || block_num < 0 || (uint32_t) disk_num >= num_disks ||
+			    (uint32_t) block_num >= blocks_per_disk) {
+				continue;
+			}
+			uint64_t op = encode_operation(JBOD_SIGN_BLOCK, disk_num, block_num);
+			if (lfs_enabled()) {
+				// A block never written reads as zeroes
+				uint32_t pba = lfs_lookup(disk_num * blocks_per_disk + block_num);
+				if (pba == LFS_UNMAPPED) {
+					if (memcmp(bufs[i], zeroes, JBOD_BLOCK_SIZE) == 0) {
+						*valid_mask |= 1ull << i;
+					}
+					continue;
+				}
+				op = physical_operation(JBOD_SIGN_BLOCK, pba);
+			}
+			signed_keys[num_ops] = i;
+			ops[num_ops] = op;
+			blocks[num_ops] = replies[num_ops];
+			num_ops++;
+		}
+		rc = (num_ops > 0) ? jbod_client_batch64(ops, blocks, NULL, num_ops) : 0;
+
+		// Compare each signature with that of the block read back
+		for (int j = 0; rc == 0 && j < num_ops; j++) {
+			if (signature_matches(replies[j], bufs[signed_keys[j]])) {
+				*valid_mask |= 1ull << signed_keys[j];
+			}
+		}
+	}
+	qos_done();
+	if (rc != 0) {
+		*valid_mask = 0;
+		return -1;
+	}
+	return __builtin_popcountll(*valid_mask);
+}
+
+int mdadm_set_log_structured(int enable) {
+	if (is_mounted) {
+		return -1;
+	}
+	log_structured = enable;
+	return 1;
+}
+
+int mdadm_log_clean(int max_segments) {
+	int cleaned = 0;
+
+	if (!is_mounted || !lfs_enabled()) {
+		return -1;
+	}
+
+	// Build up free segments ahead of the next burst of writes
+	qos_admit(0);
+	for (int i = 0; i < max_segments && lfs_free_segments() < LFS_IDLE_FREE_SEGMENTS; i++) {
+		int rc = log_clean();
+		if (rc == -1) {
+			break;
+		}
+		cleaned += rc;
+	}
+	qos_done();
+	return cleaned;
+}
+
+int mdadm_set_write_combining(int num_entries, int timeout_ms) {
+	return wcb_create(num_entries, timeout_ms);
+}
+
+int mdadm_flush(void) {
+	qos_admit(0);
+	int rc = flush_buffered();
+	qos_done();
+	return rc;
+}
@@ -2,19 +2,78 @@
 #define MDADM_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "jbod.h"
 #include "cache.h"
+#include "qos.h"
 
-/* Return 1 on success and -1 on failure */
+/* Return 1 on success and -1 on failure. Empties the cache, whose blocks
+ * predate the mount; fails while one of them is pinned or held by a ref. */
 int mdadm_mount(void);
 
 /* Return 1 on success and -1 on failure */
 int mdadm_unmount(void);
 
+/* Return the size of the mounted array in bytes. With the extended (v2/v3)
+ * protocol the geometry is queried from the server at mount time. */
+uint64_t mdadm_size(void);
+
+/* Selects the log-structured layout (see lfs.h) for the following mounts:
+ * writes are appended sequentially to a per-disk log and remapped, at the
+ * cost of an in-memory block map. The cleaner's reserve of one eighth of the
+ * disks, or two segments per disk if that is more, comes from the spare disks
+ * the server reports, so the array keeps its size; mounting fails if they are
+ * too few. The block map is private to this client, so the array may not be
+ * shared: mounting over the coherent (v3) protocol fails. Return 1 on success
+ * and -1 if the array is mounted. */
+int mdadm_set_log_structured(int enable);
+
+/* Runs the log cleaner for up to |max_segments| segments while the disk
+ * being logged to has fewer than LFS_IDLE_FREE_SEGMENTS free segments, so
+ * that idle time pays for the space later writes need. Return the number of
+ * segments cleaned, -1 if the log-structured layout is not in use. */
+int mdadm_log_clean(int max_segments);
+
+/* Buffers sub-block writes in |num_entries| write-combining entries (see
+ * wcb.h), 0 to turn it off. A block is written once all of its bytes have
+ * been written, when its entry is needed for another block, |timeout_ms|
+ * after its first buffered write (checked on the next mdadm call) or on
+ * mdadm_flush. Reads always see the buffered bytes. Return 1 on success and
+ * -1 on failure, including while writes are still buffered. */
+int mdadm_set_write_combining(int num_entries, int timeout_ms);
+
+/* Writes back everything held in the write-combining buffer. Return 1 on
+ * success and -1 on failure. */
+int mdadm_flush(void);
+
+/* Stores the server's signature of block |block_num| of disk |disk_num| of
+ * the mounted array in |buf|, one JBOD_BLOCK_SIZE line naming that block,
+ * wherever the log-structured layout put it. Return 1 on success and -1 on
+ * failure. */
+int mdadm_sign_block(int disk_num, int block_num, uint8_t *buf);
+
+/* Returns the number of current blocks, or -1 on failure. Sets bit i of
+ * |valid_mask| if |bufs[i]| holds the current contents of block |keys[i]|
+ * of the mounted array, for the |n| blocks of a batch of up to
+ * CACHE_BATCH_MAX, going by the SHA-1 signatures the server computes with
+ * JBOD_SIGN_BLOCK. The signatures are asked for in pipelined batches, a
+ * round trip per JBOD_MAX_BATCH blocks. Fits cache_load as the validator of
+ * a saved cache. */
+int mdadm_blocks_current(const cache_key_t *keys, int n, const uint8_t *const *bufs, uint64_t *valid_mask);
+
+/* Every mdadm call that talks to the server, mounting included, is admitted
+ * through the QoS scheduler of qos.h under the calling thread's handle,
+ * which also keeps the calls of several threads from overlapping. */
+
 /* Return the number of bytes read on success, -1 on failure. */
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
+int mdadm_read(uint64_t addr, uint32_t len, uint8_t *buf);
 
 /* Return the number of bytes written on success, -1 on failure. */
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
+int mdadm_write(uint64_t addr, uint32_t len, const uint8_t *buf);
+
+/* Sets |len| bytes starting at |addr| to |byte|. Whole blocks are filled on
+ * the server with JBOD_FILL_BLOCK, so only a header crosses the wire for
+ * them. Return the number of bytes filled on success, -1 on failure. */
+int mdadm_fill(uint64_t addr, uint32_t len, uint8_t byte);
 
 #endif
@@ -0,0 +1,250 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mrc.h"
+
+/* a sampled block and the time of its last access, for rebuilding */
+typedef struct {
+	uint32_t time;
+	uint64_t key;
+} mrc_sample_t;
+
+/* returns the sample value of the block with hash |h|, from bits the cache
+ * does not use to place the block */
+static uint32_t sample_value(uint64_t h) {
+	return (uint32_t) (h >> 40) & (MRC_MODULUS - 1);
+}
+
+/* returns the table slot holding the block with hash |h|, or the empty slot
+ * it would go in */
+static uint32_t table_slot(const mrc_t *mrc, uint64_t h) {
+	uint32_t mask = (1u << mrc->table_bits) - 1;
+	uint32_t slot = (h * 0x9e3779b97f4a7c15ULL) >> (64 - mrc->table_bits);
+	while (mrc->times[slot] != 0 && mrc->keys[slot] != h) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+/* adds |delta| to the count at access time |t| */
+static void tree_add(mrc_t *mrc, uint32_t t, int delta) {
+	for (; t <= mrc->num_times; t += t & -t) {
+		mrc->tree[t] += delta;
+	}
+}
+
+/* returns the number of blocks last accessed at or before time |t| */
+static uint32_t tree_sum(const mrc_t *mrc, uint32_t t) {
+	uint32_t sum = 0;
+	for (; t > 0; t -= t & -t) {
+		sum += mrc->tree[t];
+	}
+	return sum;
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint32_t x = ((const mrc_sample_t *) a)->time, y = ((const mrc_sample_t *) b)->time;
+	return x < y ? -1 : x > y;
+}
+
+/* drops the blocks no longer sampled and numbers the last accesses of the
+ * others from 1 in the order they were made, rebuilding the table and the
+ * tree, so that the access times never run out */
+static void rebuild(mrc_t *mrc) {
+	mrc_sample_t *samples = mrc->scratch;
+	uint32_t slots = 1u << mrc->table_bits;
+	int n = 0;
+
+	// Collect the blocks still sampled, oldest access first
+	for (uint32_t i = 0; i < slots; i++) {
+		if (mrc->times[i] != 0 && sample_value(mrc->keys[i]) < mrc->threshold) {
+			samples[n++] = (mrc_sample_t) { mrc->times[i], mrc->keys[i] };
+		}
+	}
+	qsort(samples, n, sizeof(mrc_sample_t), compare_samples);
+
+	// Put them back with their new times, and build the tree bottom up
+	memset(mrc->times, 0, slots * sizeof(uint32_t));
+	memset(mrc->tree, 0, (mrc->num_times + 1) * sizeof(uint32_t));
+	for (int i = 0; i < n; i++) {
+		uint32_t slot = table_slot(mrc, samples[i].key);
+		mrc->keys[slot] = samples[i].key;
+		mrc->times[slot] = i + 1;
+	}
+	for (uint32_t t = 1; t <= mrc->num_times; t++) {
+		mrc->tree[t] += t <= (uint32_t) n;
+		uint32_t parent = t + (t & -t);
+		if (parent <= mrc->num_times) {
+			mrc->tree[parent] += mrc->tree[t];
+		}
+	}
+	mrc->num_keys = n;
+	mrc->now = n;
+}
+
+/* adds |weight| accesses at reuse distance |distance| to the histogram */
+static void hist_add(mrc_t *mrc, uint64_t distance, double weight) {
+	// Widen the buckets until the distance fits, merging neighbours
+	while (distance / mrc->bucket_width >= MRC_BUCKETS) {
+		for (int i = 0; i < MRC_BUCKETS / 2; i++) {
+			mrc->hist[i] = mrc->hist[2 * i] + mrc->hist[2 * i + 1];
+		}
+		for (int i = MRC_BUCKETS / 2; i < MRC_BUCKETS; i++) {
+			mrc->hist[i] = 0;
+		}
+		mrc->bucket_width *= 2;
+	}
+	mrc->hist[distance / mrc->bucket_width] += weight;
+}
+
+mrc_t *mrc_create(int max_keys) {
+	if (max_keys < 1) {
+		return NULL;
+	}
+	mrc_t *mrc = calloc(1, sizeof(mrc_t));
+	if (mrc == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&mrc->lock, NULL);
+
+	// Keep the table at most half full, and give every block a few access times
+	// before the times are renumbered
+	mrc->max_keys = max_keys;
+	mrc->threshold = MRC_MODULUS;
+	mrc->bucket_width = 1;
+	mrc->table_bits = 1;
+	while ((1 << mrc->table_bits) < 2 * (max_keys + 1)) {
+		mrc->table_bits++;
+	}
+	mrc->num_times = 4 * (uint32_t) max_keys;
+	mrc->keys = malloc(((size_t) 1 << mrc->table_bits) * sizeof(uint64_t));
+	mrc->times = calloc((size_t) 1 << mrc->table_bits, sizeof(uint32_t));
+	mrc->tree = calloc(mrc->num_times + 1, sizeof(uint32_t));
+	mrc->scratch = malloc((max_keys + 1) * sizeof(mrc_sample_t));
+	if (mrc->keys == NULL || mrc->times == NULL || mrc->tree == NULL || mrc->scratch == NULL) {
+		mrc_destroy(mrc);
+		return NULL;
+	}
+	return mrc;
+}
+
+void mrc_destroy(mrc_t *mrc) {
+	if (mrc == NULL) {
+		return;
+	}
+	free(mrc->keys);
+	free(mrc->times);
+	free(mrc->tree);
+	free(mrc->scratch);
+	pthread_mutex_destroy(&mrc->lock);
+	free(mrc);
+}
+
+void mrc_record(mrc_t *mrc, uint64_t h) {
+	// Skip blocks outside the sample without locking
+	if (sample_value(h) >= __atomic_load_n(&mrc->threshold, __ATOMIC_RELAXED)) {
+		return;
+	}
+	pthread_mutex_lock(&mrc->lock);
+	if (sample_value(h) >= mrc->threshold) {
+		pthread_mutex_unlock(&mrc->lock);
+		return;
+	}
+	double weight = (double) MRC_MODULUS / mrc->threshold;
+	if (mrc->now == mrc->num_times) {
+		rebuild(mrc);
+	}
+
+	uint32_t slot = table_slot(mrc, h);
+	if (mrc->times[slot] != 0) {
+		// Count the sampled blocks accessed since this one last was, and scale
+		// the count up to all blocks
+		uint32_t last = mrc->times[slot];
+		uint32_t distance = tree_sum(mrc, mrc->now) - tree_sum(mrc, last);
+		hist_add(mrc, (uint64_t) (distance * weight), weight);
+		tree_add(mrc, last, -1);
+	} else {
+		// A first access misses at every size, so only counts in the total
+		mrc->keys[slot] = h;
+		mrc->num_keys++;
+	}
+	mrc->times[slot] = ++mrc->now;
+	tree_add(mrc, mrc->now, 1);
+	mrc->total += weight;
+
+	// Halve the sampling rate while too many blocks are sampled
+	while (mrc->num_keys > mrc->max_keys && mrc->threshold > 1) {
+		__atomic_store_n(&mrc->threshold, mrc->threshold / 2, __ATOMIC_RELAXED);
+		rebuild(mrc);
+	}
+	pthread_mutex_unlock(&mrc->lock);
+}
+
+double mrc_miss_ratio(mrc_t *mrc, int cache_size) {
+	pthread_mutex_lock(&mrc->lock);
+	if (mrc->total == 0) {
+		pthread_mutex_unlock(&mrc->lock);
+		return -1;
+	}
+
+	// Accesses closer than the cache size hit; a bucket the size cuts through
+	// counts in proportion
+	double hits = 0;
+	for (int i = 0; i < MRC_BUCKETS && i * mrc->bucket_width < (uint64_t) cache_size; i++) {
+		uint64_t start = i * mrc->bucket_width;
+		if (start + mrc->bucket_width <= (uint64_t) cache_size) {
+			hits += mrc->hist[i];
+		} else {
+			hits += mrc->hist[i] * (cache_size - start) / mrc->bucket_width;
+		}
+	}
+	double ratio = 1 - hits / mrc->total;
+	pthread_mutex_unlock(&mrc->lock);
+	return ratio;
+}
+
+double mrc_sample_rate(mrc_t *mrc) {
+	return (double) __atomic_load_n(&mrc->threshold, __ATOMIC_RELAXED) / MRC_MODULUS;
+}
+
+uint64_t mrc_max_distance(mrc_t *mrc) {
+	pthread_mutex_lock(&mrc->lock);
+	int last = MRC_BUCKETS - 1;
+	while (last >= 0 && mrc->hist[last] == 0) {
+		last--;
+	}
+	uint64_t distance = (last + 1) * mrc->bucket_width;
+	pthread_mutex_unlock(&mrc->lock);
+	return distance;
+}
+
+double mrc_reuse_histogram(mrc_t *mrc, double *counts, int n) {
+	pthread_mutex_lock(&mrc->lock);
+	for (int k = 0; k < n; k++) {
+		counts[k] = 0;
+	}
+
+	// Spread every bucket evenly over the log-scale buckets its distances fall in
+	double reused = 0;
+	for (int i = 0; i < MRC_BUCKETS; i++) {
+		if (mrc->hist[i] == 0) {
+			continue;
+		}
+		uint64_t start = i * mrc->bucket_width, end = start + mrc->bucket_width;
+		for (int k = 0; k < n; k++) {
+			uint64_t lo = k == 0 ? 0 : (uint64_t) 1 << (k - 1);
+			uint64_t hi = k == n - 1 ? UINT64_MAX : (uint64_t) 1 << k;
+			lo = lo > start ? lo : start;
+			hi = hi < end ? hi : end;
+			if (lo < hi) {
+				counts[k] += mrc->hist[i] * (hi - lo) / mrc->bucket_width;
+			}
+		}
+		reused += mrc->hist[i];
+	}
+	double first = mrc->total - reused;
+	pthread_mutex_unlock(&mrc->lock);
+	return first;
+}
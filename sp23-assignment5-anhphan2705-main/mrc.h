@@ -0,0 +1,81 @@
+#ifndef MRC_H_
+#define MRC_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Miss-ratio curve of an LRU cache, estimated online with SHARDS
+ * (Waldspurger, Park, Garthwaite and Ahmad, "Efficient MRC Construction with
+ * SHARDS"). Only accesses to blocks whose hash falls below a threshold are
+ * sampled, so a block is either always or never sampled. The reuse distance
+ * of each sampled access, the number of distinct sampled blocks accessed
+ * since the last access to the same block, is scaled by the inverse of the
+ * sampling rate into the reuse distance over all blocks, and a histogram of
+ * the scaled distances gives the miss ratio at every cache size. The sample
+ * starts with every block and tracks at most max_keys blocks: once there are
+ * more, the rate is halved and the blocks above the new threshold dropped
+ * (fixed-size SHARDS). Blocks are identified by a 64-bit hash of their
+ * address. mrc_record may be called by several threads at once; the
+ * sampled accesses take a lock. */
+
+#define MRC_MAX_KEYS  8192
+#define MRC_MODULUS   (1u << 24)
+#define MRC_BUCKETS   1024
+
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t threshold;   /* blocks whose sample value is below it are sampled */
+  int max_keys;
+
+  /* the sampled blocks and the time of their last access, in an open
+   * addressing table of 2^table_bits slots; time 0 marks an empty slot */
+  uint64_t *keys;
+  uint32_t *times;
+  int table_bits;
+  int num_keys;
+
+  /* a Fenwick tree over the access times, with a one at the last access
+   * time of every sampled block, so that the blocks accessed since a time
+   * are counted in logarithmic time */
+  uint32_t *tree;
+  uint32_t num_times;
+  uint32_t now;
+
+  /* histogram of scaled reuse distances in buckets of bucket_width blocks,
+   * weighted by the inverse of the sampling rate; the width doubles when a
+   * distance would not fit */
+  double hist[MRC_BUCKETS];
+  uint64_t bucket_width;
+  double total;         /* all accesses, first ones included */
+
+  void *scratch;        /* room to sort the sampled blocks by time */
+} mrc_t;
+
+/* Returns an estimator sampling at most |max_keys| blocks, or NULL on
+ * failure. */
+mrc_t *mrc_create(int max_keys);
+
+/* Frees the estimator; NULL is ignored. */
+void mrc_destroy(mrc_t *mrc);
+
+/* Counts an access to the block with hash |h|. */
+void mrc_record(mrc_t *mrc, uint64_t h);
+
+/* Returns the estimated miss ratio of an LRU cache of |cache_size| blocks
+ * over the accesses so far, or -1 if there were none. */
+double mrc_miss_ratio(mrc_t *mrc, int cache_size);
+
+/* Returns the fraction of blocks currently sampled. */
+double mrc_sample_rate(mrc_t *mrc);
+
+/* Returns the largest reuse distance seen, rounded up to a bucket: the
+ * curve is flat beyond it. */
+uint64_t mrc_max_distance(mrc_t *mrc);
+
+/* Writes the estimated number of accesses at each reuse distance to |counts|
+ * on a log scale: |counts[0]| for distance 0 and |counts[k]| for distances
+ * from 2^(k-1) up to 2^k, the last of the |n| buckets taking all longer
+ * ones. Returns the estimated number of first accesses, which have none. */
+double mrc_reuse_histogram(mrc_t *mrc, double *counts, int n);
+
+#endif
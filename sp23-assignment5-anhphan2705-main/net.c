@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <err.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
@@ -16,7 +17,7 @@ int cli_sd = -1;
 
 /* attempts to read n bytes from fd; returns true on success and false on
  * failure */
-static bool nread(int fd, int len, uint8_t *buf) {
+bool nread(int fd, int len, uint8_t *buf) {
 	int byte_read_total = 0;
 	int byte_read_current = 0;
 	
@@ -26,8 +27,9 @@ static bool nread(int fd, int len, uint8_t *buf) {
 		// Read len - byte_read_total bytes from the file descriptor into buf
 		byte_read_current = read(fd, buf + byte_read_total, len - byte_read_total);
 		
-		// If an error occurred during the read, return false
-		if (byte_read_current == -1)
+		// If an error occurred during the read or the peer closed the
+		// connection, return false
+		if (byte_read_current <= 0)
 		{
 			return false;
 		}
@@ -41,7 +43,7 @@ static bool nread(int fd, int len, uint8_t *buf) {
 
 /* attempts to write n bytes to fd; returns true on success and false on
  * failure */
-static bool nwrite(int fd, int len, uint8_t *buf) {
+bool nwrite(int fd, int len, uint8_t *buf) {
 	int byte_written_total = 0;
 	int byte_written_current = 0;
 	
@@ -64,102 +66,163 @@ static bool nwrite(int fd, int len, uint8_t *buf) {
 	return true;
 }
 
+/* the protocol version spoken on the client connection */
+static int protocol = JBOD_PROTO_V1;
+
+/* called for the invalidations the server pushes over a v3 connection */
+static jbod_invalidate_handler_t invalidate_handler = NULL;
+
+/* converts a 64-bit value between host and network byte order */
+static uint64_t htonll(uint64_t v) {
+	uint32_t hi = htonl((uint32_t) (v >> 32));
+	uint32_t lo = htonl((uint32_t) v);
+	uint64_t out;
+	memcpy(&out, &hi, 4);
+	memcpy((uint8_t *) &out + 4, &lo, 4);
+	return out;
+}
+
 /* attempts to receive a packet from fd; returns true on success and false on
- * failure */
-static bool recv_packet(int fd, uint32_t *op, uint16_t *ret, uint8_t *block) {
+ * failure. The version of the packet is stored in |version|; v1 ops are
+ * returned unchanged in the low 32 bits of |op|. Unless |lease| is NULL, it
+ * is set to the coherence fields of a v3 packet, or zeroed. */
+bool recv_packet(int fd, int *version, uint64_t *op, uint16_t *ret, jbod_lease_t *lease, uint8_t *block) {
 	// Buffer for storing the packet header
-	uint8_t packet[HEADER_LEN];
+	uint8_t packet[HEADER_LEN_V3];
+	uint16_t length;
+	jbod_lease_t fields = { 0, 0 };
 	
-	// Read the packet header from the file descriptor
-	if (nread(fd, HEADER_LEN, packet) == false)
+	// Read the length first, since it tells the two header formats apart
+	if (nread(fd, 2, packet) == false)
 	{
 		return false;
 	}
-	
-	// Extract the length, operation code, and return code from the packet header
-	uint16_t length;
 	memcpy(&length, packet, 2);
-	memcpy(op, packet + 2, 4);
-	memcpy(ret, packet + 6, 2);
-	
-	// Convert the length, operation code, and return code to network byte order
-	length = htons(length);
-	*op = htonl(*op);
-	*ret = htons(*ret);
+	length = ntohs(length);
 	
-	// If the packet includes a data block, read it into the provided buffer
-	if (length == (HEADER_LEN + JBOD_BLOCK_SIZE))
+	if (length == HEADER_LEN || length == (HEADER_LEN + JBOD_BLOCK_SIZE))
+	{
+		// v1 header: 32-bit op followed by the return code
+		uint32_t op32;
+		if (nread(fd, HEADER_LEN - 2, packet + 2) == false)
+		{
+			return false;
+		}
+		memcpy(&op32, packet + 2, 4);
+		memcpy(ret, packet + 6, 2);
+		*op = ntohl(op32);
+		*version = JBOD_PROTO_V1;
+		length -= HEADER_LEN;
+	}
+	else if (length == HEADER_LEN_V2 || length == (HEADER_LEN_V2 + JBOD_BLOCK_SIZE) ||
+	         length == HEADER_LEN_V3 || length == (HEADER_LEN_V3 + JBOD_BLOCK_SIZE))
 	{
-		if (nread(fd, JBOD_BLOCK_SIZE, block) == true) 
+		// v2 and v3 headers: version, 64-bit op and the return code, which v3
+		// follows with the block's version and lease
+		uint16_t header_len = (length == HEADER_LEN_V3 || length == (HEADER_LEN_V3 + JBOD_BLOCK_SIZE)) ?
+		                      HEADER_LEN_V3 : HEADER_LEN_V2;
+		uint16_t ver;
+		if (nread(fd, header_len - 2, packet + 2) == false)
 		{
-			return true;
+			return false;
 		}
-		else
+		memcpy(&ver, packet + 2, 2);
+		memcpy(op, packet + 4, 8);
+		memcpy(ret, packet + 12, 2);
+		if (ntohs(ver) != (header_len == HEADER_LEN_V3 ? JBOD_PROTO_V3 : JBOD_PROTO_V2))
 		{
 			return false;
 		}
-		
+		if (header_len == HEADER_LEN_V3)
+		{
+			memcpy(&fields.version, packet + 14, 4);
+			memcpy(&fields.lease_ms, packet + 18, 4);
+			fields.version = ntohl(fields.version);
+			fields.lease_ms = ntohl(fields.lease_ms);
+		}
+		*op = htonll(*op);
+		*version = ntohs(ver);
+		length -= header_len;
+	}
+	else
+	{
+		// Neither a bare header nor a header plus one block
+		return false;
+	}
+	*ret = ntohs(*ret);
+	if (lease != NULL)
+	{
+		*lease = fields;
+	}
+	
+	// If the packet includes a data block, read it into the provided buffer
+	if (length == JBOD_BLOCK_SIZE)
+	{
+		return nread(fd, JBOD_BLOCK_SIZE, block);
 	}
 	
 	// Otherwise, the packet does not include a data block, so just return true
 	return true;
 }
 
-uint8_t * create_packet(uint16_t length, uint32_t opCode, uint16_t returnCode, uint8_t *block){
-	// Determine the size of the packet based on the provided length
-	int packet_size = length;
+/* serializes a packet into |packet|, which must have room for
+ * JBOD_MAX_PACKET bytes; the block is only attached if |block| is not NULL,
+ * and a v3 packet carries |lease|, or zeroes if it is NULL. Returns the
+ * length of the packet. */
+uint16_t create_packet(uint8_t *packet, int version, uint64_t opCode, uint16_t returnCode,
+                       const jbod_lease_t *lease, uint8_t *block){
+	uint16_t header_len = (version == JBOD_PROTO_V3) ? HEADER_LEN_V3 :
+	                      (version == JBOD_PROTO_V2) ? HEADER_LEN_V2 : HEADER_LEN;
+	uint16_t length = header_len + (block != NULL ? JBOD_BLOCK_SIZE : 0);
 	
-	// Allocate memory for the packet and initialize a pointer to the start of the memory block
-	uint8_t packet[packet_size];
-	uint8_t* packet_ptr = packet;
-	
-	// Convert the values of length, opcode, and return code to network byte order
-	length = ntohs(length);
-	opCode = ntohl(opCode);
-	returnCode = ntohs(returnCode);
+	// Convert the values of length and return code to network byte order
+	uint16_t net_length = htons(length);
+	returnCode = htons(returnCode);
 	
 	// Copy the length, opcode, and return code into the packet byte array
-	memcpy(packet, &length, 2);
-	memcpy(packet + 2, &opCode, 4);
-	memcpy(packet + 6, &returnCode, 2);
+	memcpy(packet, &net_length, 2);
+	if (version != JBOD_PROTO_V1)
+	{
+		uint16_t ver = htons(version);
+		uint64_t op64 = htonll(opCode);
+		memcpy(packet + 2, &ver, 2);
+		memcpy(packet + 4, &op64, 8);
+		memcpy(packet + 12, &returnCode, 2);
+	}
+	else
+	{
+		uint32_t op32 = htonl((uint32_t) opCode);
+		memcpy(packet + 2, &op32, 4);
+		memcpy(packet + 6, &returnCode, 2);
+	}
+	if (version == JBOD_PROTO_V3)
+	{
+		uint32_t block_version = htonl(lease != NULL ? lease->version : 0);
+		uint32_t lease_ms = htonl(lease != NULL ? lease->lease_ms : 0);
+		memcpy(packet + 14, &block_version, 4);
+		memcpy(packet + 18, &lease_ms, 4);
+	}
 	
 	// If a block of data was provided, copy it into the packet byte array
-	if (packet_size == 264)
+	if (block != NULL)
 	{
-		memcpy(packet + 8, block, JBOD_BLOCK_SIZE);
+		memcpy(packet + header_len, block, JBOD_BLOCK_SIZE);
 	}
 	
-	// Return a pointer to the start of the packet byte array
-	return packet_ptr;
+	return length;
 }
 
 /* attempts to send a packet to sd; returns true on success and false on
  * failure */
-static bool send_packet(int sd, uint32_t op, uint8_t *block) {
-	uint32_t length;
+static bool send_packet(int sd, int version, uint64_t op, int cmd, uint8_t *block) {
 	uint16_t returnCode = 0;
+	uint8_t packet[JBOD_MAX_PACKET];
 	
-	// Determine packet length based on operation code
-	if ((op >> 26) == JBOD_WRITE_BLOCK)
-	{
-		length = HEADER_LEN + 256;
-	}
-	else
-	{
-		length = HEADER_LEN;
-	}
-	
-	// Create packet with given parameters
-	uint8_t *packet;
-	packet = create_packet(length, op, returnCode, block);
+	// Only writes carry a payload, fills send the fill byte inside the op
+	uint16_t length = create_packet(packet, version, op, returnCode, NULL, cmd == JBOD_WRITE_BLOCK ? block : NULL);
 	
 	// Send packet over socket
-	if (nwrite(sd, length, packet) == false)
-	{
-		return false;
-	}
-	
-	return true;
+	return nwrite(sd, length, packet);
 }
 
 /* attempts to connect to server and set the global cli_sd variable to the
@@ -197,14 +260,165 @@ void jbod_disconnect(void) {
 	cli_sd = -1;
 }
 
+/* selects the protocol version used by jbod_client_operation64 */
+void jbod_set_protocol(int version) {
+	protocol = version;
+}
+
+/* returns the protocol version used by jbod_client_operation64 */
+int jbod_protocol(void) {
+	return protocol;
+}
+
+/* sets the function called for each invalidation the server pushes */
+void jbod_set_invalidate_handler(jbod_invalidate_handler_t handler) {
+	invalidate_handler = handler;
+}
+
+/* hands the invalidation pushed as |op| with |lease| to the handler, then
+ * sends it back to acknowledge it; returns false on failure */
+static bool handle_push(uint64_t op, const jbod_lease_t *lease) {
+	uint8_t packet[HEADER_LEN_V3];
+	
+	if (invalidate_handler != NULL)
+	{
+		invalidate_handler(JBOD_OP_DISK(op), JBOD_OP_BLOCK(op), lease->version);
+	}
+	uint16_t length = create_packet(packet, JBOD_PROTO_V3, op, 0, lease, NULL);
+	return nwrite(cli_sd, length, packet);
+}
+
+/* receives the response to the next request in flight, handling the
+ * invalidations pushed ahead of it; returns true on success and false on
+ * failure */
+static bool recv_response(int *version, uint64_t *op, uint16_t *ret, jbod_lease_t *lease, uint8_t *block) {
+	jbod_lease_t fields;
+	
+	while (recv_packet(cli_sd, version, op, ret, &fields, block))
+	{
+		if (*version == JBOD_PROTO_V3 && JBOD_OP_CMD(*op) == JBOD_INVALIDATE)
+		{
+			if (handle_push(*op, &fields) == false)
+			{
+				return false;
+			}
+			continue;
+		}
+		if (lease != NULL)
+		{
+			*lease = fields;
+		}
+		return true;
+	}
+	return false;
+}
+
+/* handles the invalidations the server pushed while no request was in
+ * flight, without waiting for more; returns how many it handled, or -1 on
+ * failure */
+int jbod_client_poll(void) {
+	struct pollfd pfd = { cli_sd, POLLIN, 0 };
+	jbod_lease_t lease;
+	uint64_t op;
+	uint16_t ret;
+	uint8_t block[JBOD_BLOCK_SIZE];
+	int version, handled = 0;
+	
+	while (poll(&pfd, 1, 0) == 1)
+	{
+		// Nothing but pushes comes unasked
+		if (recv_packet(cli_sd, &version, &op, &ret, &lease, block) == false ||
+		    version != JBOD_PROTO_V3 || JBOD_OP_CMD(op) != JBOD_INVALIDATE ||
+		    handle_push(op, &lease) == false)
+		{
+			return -1;
+		}
+		handled++;
+	}
+	return handled;
+}
+
 /* sends the JBOD operation to the server and receives and processes the
  * response. */
 int jbod_client_operation(uint32_t op, uint8_t *block) {
   uint16_t returnValue;
+  uint64_t reply_op;
+  int version;
   // send packet with op and block to server
-  send_packet(cli_sd, op, block);
+  if (!send_packet(cli_sd, JBOD_PROTO_V1, op, op >> 26, block))
+    return -1;
   // receive packet from server containing the return value and update the returnValue variable
-  recv_packet(cli_sd, &op, &returnValue, block);
+  if (!recv_packet(cli_sd, &version, &reply_op, &returnValue, NULL, block))
+    return -1;
 
   return returnValue;
 }
+
+/* returns the protocol version |op| goes out in and sets |wire| to the op
+ * in that version's encoding, or returns -1 if the v1 encoding cannot
+ * address its disk or block */
+static int wire_operation(uint64_t op, uint64_t *wire) {
+  if (protocol == JBOD_PROTO_V1) {
+    uint32_t disk_num = JBOD_OP_DISK(op), block_num = JBOD_OP_BLOCK(op);
+    if (disk_num >= JBOD_NUM_DISKS || block_num >= JBOD_NUM_BLOCKS_PER_DISK)
+      return -1;
+    *wire = (JBOD_OP_CMD(op) << 26) | (disk_num << 22) | (JBOD_OP_FILL(op) << JBOD_FILL_BYTE_SHIFT) | block_num;
+    return JBOD_PROTO_V1;
+  }
+
+  *wire = op;
+  return protocol;
+}
+
+/* sends a 64-bit operation (see JBOD_OP_* in net.h) to the server. With the
+ * v1 protocol the op is narrowed to the 32-bit encoding, which fails for
+ * disks and blocks that encoding cannot address. */
+int jbod_client_operation64(uint64_t op, uint8_t *block) {
+  uint16_t returnValue;
+  uint64_t reply_op, wire;
+  int version = wire_operation(op, &wire);
+
+  if (version == -1)
+    return -1;
+  if (!send_packet(cli_sd, version, wire, JBOD_OP_CMD(op), block))
+    return -1;
+  if (!recv_response(&version, &reply_op, &returnValue, NULL, block))
+    return -1;
+
+  return returnValue;
+}
+
+/* sends the |n| operations of |ops|, each with its block in |blocks|, in one
+ * write and only then receives their responses, so that the batch costs a
+ * single round trip. The server carries them out in order whatever they
+ * return; the first nonzero return value is the batch's. Unless |leases|
+ * is NULL, it gets the coherence fields of each response. */
+int jbod_client_batch64(const uint64_t *ops, uint8_t **blocks, jbod_lease_t *leases, int n) {
+  uint8_t packets[JBOD_MAX_BATCH * JBOD_MAX_PACKET];
+  uint16_t returnValue;
+  uint64_t reply_op, wire;
+  int version, length = 0, rc = 0;
+
+  if (n < 0 || n > JBOD_MAX_BATCH)
+    return -1;
+
+  // Lay every request out back to back, then send them all at once
+  for (int i = 0; i < n; i++) {
+    if ((version = wire_operation(ops[i], &wire)) == -1)
+      return -1;
+    length += create_packet(packets + length, version, wire, 0, NULL,
+                            JBOD_OP_CMD(ops[i]) == JBOD_WRITE_BLOCK ? blocks[i] : NULL);
+  }
+  if (!nwrite(cli_sd, length, packets))
+    return -1;
+
+  // Collect the responses, which come back in the same order
+  for (int i = 0; i < n; i++) {
+    if (!recv_response(&version, &reply_op, &returnValue, leases != NULL ? &leases[i] : NULL, blocks[i]))
+      return -1;
+    if (rc == 0)
+      rc = returnValue;
+  }
+
+  return rc;
+}
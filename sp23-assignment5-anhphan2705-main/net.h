@@ -5,11 +5,79 @@
 #include <stdbool.h>
 
 #define HEADER_LEN (sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t))
+#define HEADER_LEN_V2 (sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint64_t) + sizeof(uint16_t))
+#define HEADER_LEN_V3 (HEADER_LEN_V2 + sizeof(uint32_t) + sizeof(uint32_t))
+#define JBOD_MAX_PACKET (HEADER_LEN_V3 + JBOD_BLOCK_SIZE)
 #define JBOD_SERVER "127.0.0.1"
 #define JBOD_PORT 3333
 
+/* Protocol versions. v1 is the original 8-byte header with the 32-bit op
+ * (command in bits 26+, disk in bits 22-25, block in bits 0-7). v2 adds a
+ * version field after the length and widens the op to 64 bits:
+ *
+ *   | len (16) | version (16) | op (64) | ret (16) | [block] |
+ *
+ * with the command in bits 56-63, a fill byte in bits 48-55, the disk in
+ * bits 24-47 and the block in bits 0-23. The length field alone tells the
+ * two formats apart, so a server can speak both on one connection. */
+#define JBOD_PROTO_V1 1
+#define JBOD_PROTO_V2 2
+
+/* v3 extends the v2 header with what lets several clients cache the array
+ * at once:
+ *
+ *   | len (16) | version (16) | op (64) | ret (16) | block version (32) | lease (32) | [block] |
+ *
+ * The server numbers the versions of each block by counting its writes. It
+ * answers a read with the version it returned and the milliseconds for
+ * which the client may cache the block, 0 for not at all, and a write with
+ * the version it made. Before a leased block is written, the server pushes
+ * a JBOD_INVALIDATE packet for it, carrying the version to come, to every
+ * other client holding a lease on it. The client drops its copy and sends
+ * the packet back, and the write waits until every holder has or their
+ * leases ran out. */
+#define JBOD_PROTO_V3 3
+
+typedef struct {
+  uint32_t version;   /* the block's version */
+  uint32_t lease_ms;  /* how long the reader may cache it */
+} jbod_lease_t;
+
+#define JBOD_OP_CMD_SHIFT   56
+#define JBOD_OP_FILL_SHIFT  48
+#define JBOD_OP_DISK_SHIFT  24
+#define JBOD_OP_MAX_DISKS   (1u << 24)
+#define JBOD_OP_MAX_BLOCKS  (1u << 24)
+
+#define JBOD_OP(cmd, disk, block) \
+  (((uint64_t) (cmd) << JBOD_OP_CMD_SHIFT) | ((uint64_t) (disk) << JBOD_OP_DISK_SHIFT) | (uint64_t) (block))
+#define JBOD_OP_CMD(op)   ((uint32_t) ((op) >> JBOD_OP_CMD_SHIFT) & 0xff)
+#define JBOD_OP_FILL(op)  ((uint32_t) ((op) >> JBOD_OP_FILL_SHIFT) & 0xff)
+#define JBOD_OP_DISK(op)  ((uint32_t) ((op) >> JBOD_OP_DISK_SHIFT) & (JBOD_OP_MAX_DISKS - 1))
+#define JBOD_OP_BLOCK(op) ((uint32_t) (op) & (JBOD_OP_MAX_BLOCKS - 1))
+
 int jbod_client_operation(uint32_t op, uint8_t *block);
+int jbod_client_operation64(uint64_t op, uint8_t *block);
+
+/* the most operations jbod_client_batch64 pipelines at once */
+#define JBOD_MAX_BATCH 16
+int jbod_client_batch64(const uint64_t *ops, uint8_t **blocks, jbod_lease_t *leases, int n);
+
+/* called for each invalidation the server pushes, with the block to drop
+ * and the version its pending write gives it */
+typedef void (*jbod_invalidate_handler_t)(uint32_t disk_num, uint32_t block_num, uint32_t version);
+void jbod_set_invalidate_handler(jbod_invalidate_handler_t handler);
+int jbod_client_poll(void);
 bool jbod_connect(const char *ip, uint16_t port);
 void jbod_disconnect(void);
+void jbod_set_protocol(int version);
+int jbod_protocol(void);
+
+/* packet helpers shared by the client and the server stand-in (server.c) */
+bool nread(int fd, int len, uint8_t *buf);
+bool nwrite(int fd, int len, uint8_t *buf);
+bool recv_packet(int fd, int *version, uint64_t *op, uint16_t *ret, jbod_lease_t *lease, uint8_t *block);
+uint16_t create_packet(uint8_t *packet, int version, uint64_t opCode, uint16_t returnCode,
+                       const jbod_lease_t *lease, uint8_t *block);
 
 #endif
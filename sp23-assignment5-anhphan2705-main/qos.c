@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "qos.h"
+#include "jbod.h"
+
+typedef struct {
+	double tokens;
+	double rate;    /* tokens per second, 0 if unlimited */
+	double depth;
+} bucket_t;
+
+typedef struct {
+	bool valid;
+	char name[32];
+	int weight;
+	bucket_t iops;
+	bucket_t bps;
+	uint64_t last_refill_ns;
+	double last_finish;   /* finish tag of the handle's previous request */
+	qos_stats_t stats;
+} qos_handle_t;
+
+typedef struct {
+	int handle;
+	uint32_t len;
+	double finish;
+	bool valid;
+} qos_request_t;
+
+static pthread_mutex_t qos_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qos_cond = PTHREAD_COND_INITIALIZER;
+static qos_handle_t handles[QOS_MAX_HANDLES] = {
+	[0] = { .valid = true, .name = "default", .weight = 1 },
+};
+static qos_request_t waiting[QOS_MAX_WAITING];
+static int num_handles = 1;
+static bool busy = false;
+static double virtual_time = 0;
+static __thread int current_handle = 0;
+
+/* returns a monotonic timestamp in nanoseconds */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* sets up a bucket for |rate| tokens per second holding QOS_BURST_MS worth,
+ * but never less than |min_depth| */
+static void bucket_init(bucket_t *bucket, double rate, double min_depth) {
+	bucket->rate = rate;
+	bucket->depth = rate * QOS_BURST_MS / 1000.0;
+	if (bucket->depth < min_depth) {
+		bucket->depth = min_depth;
+	}
+	bucket->tokens = bucket->depth;
+}
+
+/* returns the nanoseconds until |bucket| holds |need| tokens, 0 if it does.
+ * A request needing more than the bucket can hold waits for a full bucket
+ * instead and then takes it below zero, so that it is admitted at all and
+ * the requests after it wait until its tokens are paid back. */
+static uint64_t bucket_wait_ns(const bucket_t *bucket, double need) {
+	if (need > bucket->depth) {
+		need = bucket->depth;
+	}
+	if (bucket->rate == 0 || bucket->tokens >= need) {
+		return 0;
+	}
+	return (uint64_t) ((need - bucket->tokens) / bucket->rate * 1e9) + 1;
+}
+
+/* adds the tokens earned since the last refill to the buckets of |h| */
+static void refill(qos_handle_t *h, uint64_t now) {
+	double elapsed = (now - h->last_refill_ns) / 1e9;
+	bucket_t *buckets[2] = { &h->iops, &h->bps };
+
+	for (int i = 0; i < 2; i++) {
+		buckets[i]->tokens += elapsed * buckets[i]->rate;
+		if (buckets[i]->tokens > buckets[i]->depth) {
+			buckets[i]->tokens = buckets[i]->depth;
+		}
+	}
+	h->last_refill_ns = now;
+}
+
+/* returns the nanoseconds until handle |h| may issue |len| bytes */
+static uint64_t throttle_ns(qos_handle_t *h, uint32_t len) {
+	uint64_t a = bucket_wait_ns(&h->iops, 1);
+	uint64_t b = bucket_wait_ns(&h->bps, len);
+	return a > b ? a : b;
+}
+
+/* returns an unused slot of the waiting list, or NULL if it is full */
+static qos_request_t *free_slot(void) {
+	for (int i = 0; i < QOS_MAX_WAITING; i++) {
+		if (!waiting[i].valid) {
+			return &waiting[i];
+		}
+	}
+	return NULL;
+}
+
+int qos_register(const char *name, int weight, uint32_t iops, uint64_t bytes_per_sec) {
+	int handle = -1;
+
+	if (weight < 1) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&qos_lock);
+	if (num_handles < QOS_MAX_HANDLES) {
+		handle = num_handles++;
+		qos_handle_t *h = &handles[handle];
+		memset(h, 0, sizeof(*h));
+		h->valid = true;
+		snprintf(h->name, sizeof(h->name), "%s", name);
+		h->weight = weight;
+		bucket_init(&h->iops, iops, 1);
+		bucket_init(&h->bps, bytes_per_sec, JBOD_BLOCK_SIZE * 4);
+		h->last_refill_ns = now_ns();
+		h->last_finish = virtual_time;
+	}
+	pthread_mutex_unlock(&qos_lock);
+	return handle;
+}
+
+int qos_set_handle(int handle) {
+	if (handle < 0 || handle >= QOS_MAX_HANDLES || !handles[handle].valid) {
+		return -1;
+	}
+	current_handle = handle;
+	return 1;
+}
+
+bool qos_enabled(void) {
+	return num_handles > 1;
+}
+
+void qos_admit(uint32_t len) {
+	qos_handle_t *h = &handles[current_handle];
+	qos_request_t *req = NULL;
+
+	pthread_mutex_lock(&qos_lock);
+
+	// Without handles there is nothing to schedule, but the connection still
+	// goes to one thread at a time
+	if (!qos_enabled()) {
+		while (busy) {
+			pthread_cond_wait(&qos_cond, &qos_lock);
+		}
+		busy = true;
+		pthread_mutex_unlock(&qos_lock);
+		return;
+	}
+
+	// Queue the request with its weighted fair queueing finish tag; the
+	// cost of a request is its size, with a floor of one block
+	while ((req = free_slot()) == NULL) {
+		pthread_cond_wait(&qos_cond, &qos_lock);
+	}
+	double start = (h->last_finish > virtual_time) ? h->last_finish : virtual_time;
+	req->valid = true;
+	req->handle = current_handle;
+	req->len = len;
+	req->finish = start + (double) (len > JBOD_BLOCK_SIZE ? len : JBOD_BLOCK_SIZE) / h->weight;
+	h->last_finish = req->finish;
+
+	uint64_t queued_at = now_ns();
+	for (;;) {
+		uint64_t now = now_ns();
+		refill(h, now);
+		uint64_t own_wait = throttle_ns(h, len);
+
+		// Go if the JBOD is free, our buckets allow it and no eligible
+		// request of another handle has an earlier finish tag
+		bool first = true;
+		for (int i = 0; i < QOS_MAX_WAITING && first; i++) {
+			qos_request_t *other = &waiting[i];
+			if (!other->valid || other == req || other->finish >= req->finish) {
+				continue;
+			}
+			refill(&handles[other->handle], now);
+			first = throttle_ns(&handles[other->handle], other->len) > 0;
+		}
+
+		if (own_wait > 0) {
+			// Sleep until the buckets have refilled, charging the time to
+			// the handle's throttled counter
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			uint64_t deadline = (uint64_t) until.tv_sec * 1000000000ULL + until.tv_nsec + own_wait;
+			until.tv_sec = deadline / 1000000000ULL;
+			until.tv_nsec = deadline % 1000000000ULL;
+			pthread_cond_timedwait(&qos_cond, &qos_lock, &until);
+			h->stats.throttled_ns += now_ns() - now;
+			queued_at = now_ns();
+			continue;
+		}
+		if (!busy && first) {
+			h->stats.queued_ns += now_ns() - queued_at;
+			break;
+		}
+		pthread_cond_wait(&qos_cond, &qos_lock);
+	}
+
+	// Take the tokens and start the request
+	if (h->iops.rate != 0) {
+		h->iops.tokens -= 1;
+	}
+	if (h->bps.rate != 0) {
+		h->bps.tokens -= len;
+	}
+	h->stats.ops++;
+	h->stats.bytes += len;
+	virtual_time = req->finish;
+	req->valid = false;
+	busy = true;
+	pthread_mutex_unlock(&qos_lock);
+}
+
+void qos_done(void) {
+	pthread_mutex_lock(&qos_lock);
+	busy = false;
+	pthread_cond_broadcast(&qos_cond);
+	pthread_mutex_unlock(&qos_lock);
+}
+
+int qos_get_stats(int handle, qos_stats_t *stats) {
+	if (handle < 0 || handle >= QOS_MAX_HANDLES || !handles[handle].valid || stats == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&qos_lock);
+	*stats = handles[handle].stats;
+	pthread_mutex_unlock(&qos_lock);
+	return 1;
+}
+
+void qos_print_stats(void) {
+	pthread_mutex_lock(&qos_lock);
+	for (int i = 0; i < num_handles; i++) {
+		qos_stats_t *s = &handles[i].stats;
+		fprintf(stderr, "QoS %-12s weight %3d: %8lu ops %10lu bytes, throttled %8.3f s, queued %8.3f s\n",
+		        handles[i].name, handles[i].weight, (unsigned long) s->ops, (unsigned long) s->bytes,
+		        s->throttled_ns / 1e9, s->queued_ns / 1e9);
+	}
+	pthread_mutex_unlock(&qos_lock);
+}
@@ -0,0 +1,55 @@
+#ifndef QOS_H_
+#define QOS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Per-client quality of service for mdadm. Each handle has a weight and
+ * optional token-bucket limits on operations and bytes per second. Every
+ * mdadm operation is admitted through qos_admit. Among the waiting requests
+ * whose buckets allow them to go, the one with the smallest weighted-fair-
+ * queueing finish tag goes next. Admission also serializes the operations
+ * of concurrent threads on the single JBOD connection, with or without
+ * handles: until qos_done, no other thread is admitted. */
+
+#define QOS_MAX_HANDLES   16
+#define QOS_MAX_WAITING   64    /* requests queued at once */
+#define QOS_BURST_MS      100   /* bucket depth, in time at the limited rate */
+#define QOS_UNLIMITED     0
+
+typedef struct {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t throttled_ns;  /* waiting for the handle's own token buckets */
+  uint64_t queued_ns;     /* waiting behind requests of other handles */
+} qos_stats_t;
+
+/* Returns a handle for a client class with the given |weight| (>= 1) and
+ * limits (QOS_UNLIMITED for none), or -1 if no handle is left. Registering
+ * the first handle turns admission control on. */
+int qos_register(const char *name, int weight, uint32_t iops, uint64_t bytes_per_sec);
+
+/* Selects the handle that the calling thread's mdadm operations are
+ * charged to; threads start out on handle 0, an unlimited default class. */
+int qos_set_handle(int handle);
+
+/* Returns true once a handle has been registered; until then admission
+ * only serializes. */
+bool qos_enabled(void);
+
+/* Blocks until the calling thread may issue an operation of |len| bytes.
+ * An operation larger than its handle's byte bucket waits for a full bucket
+ * and overdraws it, which the handle's next operations wait out. */
+void qos_admit(uint32_t len);
+
+/* Marks the operation admitted by qos_admit as finished. */
+void qos_done(void);
+
+/* Copies the counters of |handle| to |stats|; returns 1 on success and -1
+ * for an unknown handle. */
+int qos_get_stats(int handle, qos_stats_t *stats);
+
+/* Prints the counters of every handle. */
+void qos_print_stats(void);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "qos.h"
+#include "jbod.h"
+
+#define QOSTEST_ARGUMENTS "h"
+#define USAGE                                                  \
+  "USAGE: qostest [-h]\n"                                      \
+  "\n"                                                         \
+  "where:\n"                                                   \
+  "    -h - help mode (display this message)\n"                \
+  "\n"                                                         \
+  "Checks the QoS scheduler without a server: that it admits one thread at\n" \
+  "a time before any handle is registered, that a request larger than its\n" \
+  "handle's byte bucket is admitted and paid back, that an operation limit\n" \
+  "holds, and that backlogged handles share by weight. Exits with 1 if any\n" \
+  "check fails, or is killed if admission hangs.\n"
+
+/* how long a stuck admission may take before the test is killed */
+#define TEST_TIMEOUT_S 20
+
+/* returns a monotonic timestamp in seconds */
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the threads test_serial has admitted at once, and the most it saw */
+static int in_flight;
+static int most_in_flight;
+
+/* takes the scheduler 20000 times, counting the threads holding it */
+static void *serial_worker(void *arg) {
+	(void) arg;
+	for (int i = 0; i < 20000; i++) {
+		qos_admit(JBOD_BLOCK_SIZE);
+		int n = __atomic_add_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+		if (n > __atomic_load_n(&most_in_flight, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&most_in_flight, n, __ATOMIC_RELAXED);
+		}
+		__atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+		qos_done();
+	}
+	return NULL;
+}
+
+/* checks that before any handle is registered, admission still lets one
+ * thread at a time through; returns the number of failed checks */
+static int test_serial(void) {
+	pthread_t tids[4];
+	int failed = 0;
+
+	for (int t = 0; t < 4; t++) {
+		if (pthread_create(&tids[t], NULL, serial_worker, NULL) != 0) {
+			errx(1, "cannot start thread %d", t);
+		}
+	}
+	for (int t = 0; t < 4; t++) {
+		pthread_join(tids[t], NULL);
+	}
+
+	failed += qos_enabled() || most_in_flight != 1;
+	printf("serial: at most %d of 4 threads admitted at once, %s\n", most_in_flight, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* checks that a request of 64 KiB on a handle limited to 100 KB/s, far more
+ * than its bucket holds, goes through at once and that the next one waits
+ * for it to be paid back; returns the number of failed checks */
+static int test_large(void) {
+	qos_stats_t stats;
+	int failed = 0;
+
+	int handle = qos_register("large", 1, QOS_UNLIMITED, 100000);
+	if (handle == -1 || qos_set_handle(handle) != 1) {
+		warnx("cannot register the handle");
+		return 1;
+	}
+	double start = now_s();
+	qos_admit(65536);
+	qos_done();
+	double first = now_s() - start;
+	qos_admit(JBOD_BLOCK_SIZE);
+	qos_done();
+	double second = now_s() - start - first;
+	qos_get_stats(handle, &stats);
+	qos_set_handle(0);
+
+	// The bucket starts full, and is then 55 KB short
+	failed += first > 0.2 || second < 0.4 || second > 2;
+	failed += stats.ops != 2 || stats.bytes != 65536 + JBOD_BLOCK_SIZE || stats.throttled_ns == 0;
+	printf("large: first in %.3f s, next in %.3f s, %s\n", first, second, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* checks that 60 operations on a handle limited to 200 per second, whose
+ * bucket holds 20, take about 0.2 s; returns the number of failed checks */
+static int test_iops(void) {
+	int failed = 0;
+
+	int handle = qos_register("iops", 1, 200, QOS_UNLIMITED);
+	if (handle == -1 || qos_set_handle(handle) != 1) {
+		warnx("cannot register the handle");
+		return 1;
+	}
+	double start = now_s();
+	for (int i = 0; i < 60; i++) {
+		qos_admit(JBOD_BLOCK_SIZE);
+		qos_done();
+	}
+	double elapsed = now_s() - start;
+	qos_set_handle(0);
+
+	failed += elapsed < 0.15 || elapsed > 1;
+	printf("iops: 60 operations in %.3f s, %s\n", elapsed, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* the handle a share worker charges, and when it stops */
+typedef struct {
+	int handle;
+	double until;
+} share_arg_t;
+
+/* issues operations of one block on its handle until the deadline, each
+ * holding the scheduler for 100 us as if it went to the JBOD */
+static void *share_worker(void *arg) {
+	const share_arg_t *share = arg;
+
+	qos_set_handle(share->handle);
+	while (now_s() < share->until) {
+		qos_admit(JBOD_BLOCK_SIZE);
+		usleep(100);
+		qos_done();
+	}
+	return NULL;
+}
+
+/* checks that two unlimited handles of weights 1 and 3, each kept busy by
+ * two threads, get operations in about that ratio; returns the number of
+ * failed checks */
+static int test_share(void) {
+	share_arg_t args[2];
+	pthread_t tids[4];
+	qos_stats_t light, heavy;
+	int failed = 0;
+
+	args[0].handle = qos_register("light", 1, QOS_UNLIMITED, QOS_UNLIMITED);
+	args[1].handle = qos_register("heavy", 3, QOS_UNLIMITED, QOS_UNLIMITED);
+	if (args[0].handle == -1 || args[1].handle == -1) {
+		warnx("cannot register the handles");
+		return 1;
+	}
+	args[0].until = args[1].until = now_s() + 0.5;
+	for (int t = 0; t < 4; t++) {
+		if (pthread_create(&tids[t], NULL, share_worker, &args[t % 2]) != 0) {
+			errx(1, "cannot start thread %d", t);
+		}
+	}
+	for (int t = 0; t < 4; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	qos_get_stats(args[0].handle, &light);
+	qos_get_stats(args[1].handle, &heavy);
+
+	double ratio = light.ops ? (double) heavy.ops / light.ops : 0;
+	failed += light.ops == 0 || ratio < 1.5 || ratio > 6;
+	printf("share: %lu light and %lu heavy operations, %.2f to 1, %s\n", (unsigned long) light.ops,
+	       (unsigned long) heavy.ops, ratio, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int ch, failed = 0;
+
+	while ((ch = getopt(argc, argv, QOSTEST_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h':
+			fprintf(stderr, USAGE);
+			return 0;
+		default:
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return -1;
+		}
+	}
+
+	// A request that is never admitted would hang the test
+	alarm(TEST_TIMEOUT_S);
+	failed += test_serial() != 0;
+	failed += test_large() != 0;
+	failed += test_iops() != 0;
+	failed += test_share() != 0;
+	qos_print_stats();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
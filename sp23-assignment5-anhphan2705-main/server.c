@@ -0,0 +1,776 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+#include "server.h"
+#include "jbod.h"
+#include "net.h"
+#include "util.h"
+
+#define SERVER_ARGUMENTS "hvp:d:b:s:l:"
+#define USAGE                                               \
+  "USAGE: server [-h] [-v] [-p port] [-d disks] [-b blocks] [-s spares] [-l lease]\n" \
+  "\n"                                                      \
+  "where:\n"                                                \
+  "    -h - help mode (display this message)\n"             \
+  "    -v - log every operation to stderr\n"                \
+  "    -p - port to listen on (default 3333)\n"             \
+  "    -d - number of disks in the array (default 16)\n"    \
+  "    -b - number of blocks per disk (default 256)\n"      \
+  "    -s - number of spare disks after the array, which only\n" \
+  "         the log-structured layout uses (default 0)\n"   \
+  "    -l - milliseconds a v3 client may cache a block it read\n" \
+  "         (default 1000)\n"                               \
+  "\n"                                                      \
+
+/* cost of each command, matching the course JBOD */
+static const int cost_array[JBOD_NUM_CMDS] = {
+	[JBOD_MOUNT] = 1000,
+	[JBOD_UNMOUNT] = 1000,
+	[JBOD_SEEK_TO_DISK] = 500,
+	[JBOD_SEEK_TO_BLOCK] = 50,
+	[JBOD_READ_BLOCK] = 100,
+	[JBOD_WRITE_BLOCK] = 200,
+	[JBOD_FILL_BLOCK] = 200,
+};
+
+/* the emulated array; a disk's contents are only allocated once it is
+ * first touched so that large, mostly idle arrays stay cheap. The last
+ * |spare_disks| of the |num_disks| disks are spares that only the
+ * log-structured layout of mdadm uses. */
+static uint32_t num_disks = JBOD_NUM_DISKS;
+static uint32_t spare_disks = 0;
+static uint32_t blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK;
+static uint8_t **disks = NULL;
+static bool mounted = false;
+static uint32_t current_disk = 0;
+static uint32_t current_block = 0;
+static uint64_t cost = 0;
+static uint8_t zero_block[JBOD_BLOCK_SIZE];
+
+/* what the server knows of the copies v3 clients cache of a block: how many
+ * times it was written, the clients holding a lease on it, one bit per
+ * client slot, and when the last lease granted on it runs out. Allocated a
+ * disk at a time, on first use. */
+typedef struct {
+	uint32_t version;
+	uint32_t holders;
+	uint64_t expiry_ms;
+} block_state_t;
+
+static block_state_t **states = NULL;
+static uint32_t lease_ms = SERVER_LEASE_MS;
+
+int jbod_server_set_geometry(uint32_t disks_in_array, uint32_t blocks, uint32_t spares) {
+	// The extended op encoding has 24 bits for each of the disk and block
+	if (disks != NULL || disks_in_array == 0 || blocks == 0 ||
+	    (uint64_t) disks_in_array + spares > JBOD_OP_MAX_DISKS || blocks > JBOD_OP_MAX_BLOCKS)
+	{
+		return -1;
+	}
+	
+	num_disks = disks_in_array + spares;
+	spare_disks = spares;
+	blocks_per_disk = blocks;
+	return 1;
+}
+
+int jbod_server_set_lease(uint32_t ms) {
+	lease_ms = ms;
+	return 1;
+}
+
+/* returns the current block of the current disk, allocating the disk on first
+ * use; NULL if the head is past the end of the disk */
+static uint8_t *current_block_ptr(void) {
+	if (current_block >= blocks_per_disk)
+	{
+		return NULL;
+	}
+	if (disks[current_disk] == NULL)
+	{
+		disks[current_disk] = calloc(blocks_per_disk, JBOD_BLOCK_SIZE);
+		if (disks[current_disk] == NULL)
+		{
+			return NULL;
+		}
+	}
+	return disks[current_disk] + (uint64_t) current_block * JBOD_BLOCK_SIZE;
+}
+
+int jbod_server_operation(uint64_t op, uint8_t *block) {
+	uint32_t cmd = JBOD_OP_CMD(op);
+	uint32_t disk_num = JBOD_OP_DISK(op);
+	uint32_t block_num = JBOD_OP_BLOCK(op);
+	uint8_t *data;
+	
+	if (cmd >= JBOD_NUM_CMDS)
+	{
+		return -1;
+	}
+	cost += cost_array[cmd];
+	
+	// Only mounting and geometry queries are allowed on an unmounted array
+	if (cmd == JBOD_MOUNT)
+	{
+		if (mounted)
+		{
+			return -1;
+		}
+		if (disks == NULL && (disks = calloc(num_disks, sizeof(*disks))) == NULL)
+		{
+			return -1;
+		}
+		if (states == NULL && (states = calloc(num_disks, sizeof(*states))) == NULL)
+		{
+			return -1;
+		}
+		
+		// Like the course JBOD, every mount starts from zeroed disks, which
+		// no client has read yet
+		for (uint32_t i = 0; i < num_disks; i++)
+		{
+			free(disks[i]);
+			disks[i] = NULL;
+			free(states[i]);
+			states[i] = NULL;
+		}
+		current_disk = 0;
+		current_block = 0;
+		mounted = true;
+		return 0;
+	}
+	if (cmd == JBOD_GET_GEOMETRY)
+	{
+		uint32_t geometry[3] = { htonl(num_disks - spare_disks), htonl(blocks_per_disk), htonl(spare_disks) };
+		memset(block, 0, JBOD_BLOCK_SIZE);
+		memcpy(block, geometry, sizeof(geometry));
+		return 0;
+	}
+	if (!mounted)
+	{
+		return -1;
+	}
+	
+	switch (cmd)
+	{
+	case JBOD_UNMOUNT:
+		mounted = false;
+		return 0;
+	
+	case JBOD_SEEK_TO_DISK:
+		if (disk_num >= num_disks)
+		{
+			return -1;
+		}
+		current_disk = disk_num;
+		current_block = 0;
+		return 0;
+	
+	case JBOD_SEEK_TO_BLOCK:
+		if (block_num >= blocks_per_disk)
+		{
+			return -1;
+		}
+		current_block = block_num;
+		return 0;
+	
+	case JBOD_READ_BLOCK:
+		if ((data = current_block_ptr()) == NULL)
+		{
+			return -1;
+		}
+		memcpy(block, data, JBOD_BLOCK_SIZE);
+		current_block++;
+		return 0;
+	
+	case JBOD_WRITE_BLOCK:
+		if ((data = current_block_ptr()) == NULL)
+		{
+			return -1;
+		}
+		memcpy(data, block, JBOD_BLOCK_SIZE);
+		current_block++;
+		return 0;
+	
+	case JBOD_FILL_BLOCK:
+		// A fill is a block write whose payload is generated on this side of
+		// the connection from the byte carried in the op
+		if ((data = current_block_ptr()) == NULL)
+		{
+			return -1;
+		}
+		memset(data, JBOD_OP_FILL(op), JBOD_BLOCK_SIZE);
+		current_block++;
+		return 0;
+	
+	case JBOD_SIGN_BLOCK:
+		if (disk_num >= num_disks || block_num >= blocks_per_disk)
+		{
+			return -1;
+		}
+		// Disks that were never touched read back as zeroes
+		data = (disks[disk_num] != NULL) ? disks[disk_num] + (uint64_t) block_num * JBOD_BLOCK_SIZE : zero_block;
+		snprintf((char *) block, JBOD_BLOCK_SIZE, "SIG(disk,block) %2d %3d : %s\n",
+		         disk_num, block_num, sha1_sig(data, JBOD_BLOCK_SIZE));
+		return 0;
+	}
+	
+	return -1;
+}
+
+/* widens a v1 op to the 64-bit encoding used by jbod_server_operation */
+static uint64_t widen_op(uint32_t op) {
+	return JBOD_OP(op >> 26, (op >> 22) & 0xf, op & 0xff) |
+	       ((uint64_t) ((op >> JBOD_FILL_BYTE_SHIFT) & 0xff) << JBOD_OP_FILL_SHIFT);
+}
+
+/* returns true if the response to |cmd| carries a block back to the client */
+static bool has_response_payload(uint32_t cmd) {
+	return cmd == JBOD_READ_BLOCK || cmd == JBOD_SIGN_BLOCK || cmd == JBOD_GET_GEOMETRY;
+}
+
+/* returns true if |cmd| writes the block under the head */
+static bool is_write(uint32_t cmd) {
+	return cmd == JBOD_WRITE_BLOCK || cmd == JBOD_FILL_BLOCK;
+}
+
+/* a request as it was received: the protocol version it came in, its op in
+ * that version's encoding and in the 64-bit one, and a write's payload */
+typedef struct {
+	int version;
+	uint64_t op;
+	uint64_t wide_op;
+	uint8_t block[JBOD_BLOCK_SIZE];
+} request_t;
+
+/* a connected client. Each has its own head and its own hold on the mount,
+ * so that several can share the array. A write waits in |request| until no
+ * other client holds a lease on its block, and a request sent behind it in
+ * |next|; the client is not read from again until both went through. The
+ * blocks it was leased are listed in |leased|, as disk << 32 | block, so
+ * that closing it only visits those; the list may still name blocks whose
+ * lease it lost since. */
+typedef struct {
+	int sd;                /* -1 for a free slot */
+	bool mounted;
+	uint32_t disk;
+	uint32_t block;
+	bool waiting;          /* |request| waits on leases */
+	bool notified;         /* the holders of its block were sent invalidations */
+	uint64_t seq;          /* the order waiting writes go through in */
+	request_t request;
+	bool stalled;          /* |next| waits behind |request| */
+	request_t next;
+	uint64_t *leased;
+	uint32_t num_leased;
+	uint32_t max_leased;
+} client_t;
+
+_Static_assert(SERVER_MAX_CLIENTS <= 32, "lease holders are a 32-bit mask");
+
+static client_t clients[SERVER_MAX_CLIENTS];
+static uint64_t write_seq = 0;
+
+/* returns a monotonic timestamp in milliseconds */
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* returns the bit of client |c| in the lease holders of a block */
+static uint32_t client_bit(const client_t *c) {
+	return 1u << (c - clients);
+}
+
+/* returns the coherence state of block |block_num| of disk |disk_num| of the
+ * mounted array, allocating its disk's on first use; NULL if there is no
+ * such block */
+static block_state_t *block_state(uint32_t disk_num, uint32_t block_num) {
+	if (!mounted || disk_num >= num_disks || block_num >= blocks_per_disk)
+	{
+		return NULL;
+	}
+	if (states[disk_num] == NULL)
+	{
+		states[disk_num] = calloc(blocks_per_disk, sizeof(block_state_t));
+	}
+	return (states[disk_num] != NULL) ? &states[disk_num][block_num] : NULL;
+}
+
+/* returns the coherence state of the block |key| names in a client's lease
+ * list, or NULL if it has none; unlike block_state, also while unmounted */
+static block_state_t *leased_state(uint64_t key) {
+	uint32_t disk_num = key >> 32, block_num = (uint32_t) key;
+	if (states == NULL || disk_num >= num_disks || block_num >= blocks_per_disk || states[disk_num] == NULL)
+	{
+		return NULL;
+	}
+	return &states[disk_num][block_num];
+}
+
+/* adds block |block_num| of disk |disk_num| to client |c|'s lease list,
+ * first dropping the blocks it no longer holds once the list is full, and
+ * returns false if there is no room for it */
+static bool client_add_lease(client_t *c, uint32_t disk_num, uint32_t block_num) {
+	if (c->num_leased == c->max_leased)
+	{
+		uint32_t kept = 0;
+		for (uint32_t i = 0; i < c->num_leased; i++)
+		{
+			block_state_t *state = leased_state(c->leased[i]);
+			if (state != NULL && (state->holders & client_bit(c)))
+			{
+				c->leased[kept++] = c->leased[i];
+			}
+		}
+		c->num_leased = kept;
+		
+		// Grow the list if that left it more than half full, so that it is
+		// not swept again soon
+		if (kept * 2 >= c->max_leased)
+		{
+			uint32_t max_leased = (c->max_leased > 0) ? c->max_leased * 2 : 64;
+			uint64_t *leased = realloc(c->leased, max_leased * sizeof(uint64_t));
+			if (leased != NULL)
+			{
+				c->leased = leased;
+				c->max_leased = max_leased;
+			}
+		}
+	}
+	if (c->num_leased == c->max_leased)
+	{
+		return false;
+	}
+	c->leased[c->num_leased++] = (uint64_t) disk_num << 32 | block_num;
+	return true;
+}
+
+/* returns the coherence state of the block under client |c|'s head, or NULL
+ * if the client has not mounted the array or its head is past the end */
+static block_state_t *head_state(const client_t *c) {
+	return c->mounted ? block_state(c->disk, c->block) : NULL;
+}
+
+/* returns true if a write to block |block_num| of disk |disk_num| waits on
+ * leases */
+static bool write_pending(uint32_t disk_num, uint32_t block_num) {
+	for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+	{
+		if (clients[i].waiting && clients[i].disk == disk_num && clients[i].block == block_num)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/* returns true if a client other than |c| has the array mounted */
+static bool others_mounted(const client_t *c) {
+	for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+	{
+		if (&clients[i] != c && clients[i].mounted)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/* executes request |r| on the array as client |c| sees it, with its own head
+ * and mount, and returns the result. The first mount zeroes the array and
+ * the last unmount unmounts it; the others only take or drop the client's
+ * hold on it. */
+static int client_operation(client_t *c, request_t *r) {
+	uint32_t cmd = JBOD_OP_CMD(r->wide_op);
+	int rc;
+	
+	if (cmd < JBOD_NUM_CMDS && cmd != JBOD_GET_GEOMETRY && !c->mounted && (cmd != JBOD_MOUNT || mounted))
+	{
+		// Join the clients that have the array mounted, or fail an operation
+		// on an array the client has not mounted
+		cost += cost_array[cmd];
+		rc = (cmd == JBOD_MOUNT) ? 0 : -1;
+	}
+	else if (cmd == JBOD_UNMOUNT && others_mounted(c))
+	{
+		cost += cost_array[cmd];
+		rc = 0;
+	}
+	else
+	{
+		current_disk = c->disk;
+		current_block = c->block;
+		rc = jbod_server_operation(r->wide_op, r->block);
+		c->disk = current_disk;
+		c->block = current_block;
+	}
+	
+	if (rc == 0 && cmd == JBOD_MOUNT)
+	{
+		c->mounted = true;
+		c->disk = 0;
+		c->block = 0;
+	}
+	if (rc == 0 && cmd == JBOD_UNMOUNT)
+	{
+		c->mounted = false;
+	}
+	return rc;
+}
+
+/* carries out request |r| of client |c| and sends the response, leasing a
+ * block a v3 client reads to it unless a write to the block is waiting;
+ * returns false once the connection should be closed */
+static bool client_serve(client_t *c, request_t *r) {
+	uint8_t packet[JBOD_MAX_PACKET];
+	jbod_lease_t lease = { 0, 0 };
+	uint32_t cmd = JBOD_OP_CMD(r->wide_op);
+	uint32_t disk_num = c->disk, block_num = c->block;
+	block_state_t *state = (cmd == JBOD_READ_BLOCK || is_write(cmd)) ? head_state(c) : NULL;
+	
+	// Execute it in the 64-bit encoding and log the outcome
+	int rc = client_operation(c, r);
+	debug_log("received cmd id = %d [disk id = %u block id = %u], result = %d",
+	          cmd, JBOD_OP_DISK(r->wide_op), JBOD_OP_BLOCK(r->wide_op), rc);
+	
+	// A write makes a new version, on which only its writer may still hold a
+	// lease; a read is leased to the clients that can be told to drop it
+	if (rc == 0 && state != NULL)
+	{
+		if (is_write(cmd))
+		{
+			state->version++;
+			state->holders &= client_bit(c);
+		}
+		else if (r->version == JBOD_PROTO_V3 && lease_ms > 0 && !write_pending(disk_num, block_num))
+		{
+			// The holders whose leases all ran out hold nothing any more. A
+			// block the client does not hold yet goes on its lease list, and
+			// is not leased if the list has no room
+			uint64_t now = now_ms();
+			if (state->expiry_ms <= now)
+			{
+				state->holders = 0;
+			}
+			if ((state->holders & client_bit(c)) || client_add_lease(c, disk_num, block_num))
+			{
+				state->holders |= client_bit(c);
+				state->expiry_ms = now + lease_ms;
+				lease.lease_ms = lease_ms;
+			}
+		}
+		lease.version = state->version;
+	}
+	
+	// Send back the result in the client's format, with the block for reads,
+	// signatures and geometry queries
+	bool payload = (rc == 0 && has_response_payload(cmd));
+	uint16_t length = create_packet(packet, r->version, r->op, (uint16_t) rc, &lease, payload ? r->block : NULL);
+	return nwrite(c->sd, length, packet);
+}
+
+/* takes request |r| of client |c|: a write waits for settle_writes to let it
+ * through, anything else is served right away; returns false once the
+ * connection should be closed */
+static bool client_request(client_t *c, request_t *r) {
+	if (is_write(JBOD_OP_CMD(r->wide_op)) && head_state(c) != NULL)
+	{
+		c->request = *r;
+		c->waiting = true;
+		c->notified = false;
+		c->seq = ++write_seq;
+		return true;
+	}
+	return client_serve(c, r);
+}
+
+/* closes the connection of client |c|, dropping its leases and its hold on
+ * the mount; the array is unmounted once no client holds it */
+static void client_close(client_t *c) {
+	close(c->sd);
+	c->sd = -1;
+	c->waiting = false;
+	c->stalled = false;
+	if (c->mounted)
+	{
+		c->mounted = false;
+		mounted = others_mounted(c);
+	}
+	for (uint32_t i = 0; i < c->num_leased; i++)
+	{
+		block_state_t *state = leased_state(c->leased[i]);
+		if (state != NULL)
+		{
+			state->holders &= ~client_bit(c);
+		}
+	}
+	free(c->leased);
+	c->leased = NULL;
+	c->num_leased = 0;
+	c->max_leased = 0;
+	debug_log("client closed, cost so far = %lu", (unsigned long) cost);
+}
+
+/* reads one packet from client |c|: an invalidation sent back ends the
+ * client's lease on the block, and a request is taken, or waits behind the
+ * client's write if one is waiting */
+static void client_receive(client_t *c) {
+	request_t r;
+	uint16_t ret;
+	
+	// Receive the request, including the payload of a write
+	if (recv_packet(c->sd, &r.version, &r.op, &ret, NULL, r.block) == false)
+	{
+		fprintf(stderr, "received invalid packet from client\n");
+		client_close(c);
+		return;
+	}
+	r.wide_op = (r.version == JBOD_PROTO_V1) ? widen_op(r.op) : r.op;
+	
+	if (r.version == JBOD_PROTO_V3 && JBOD_OP_CMD(r.wide_op) == JBOD_INVALIDATE)
+	{
+		block_state_t *state = block_state(JBOD_OP_DISK(r.wide_op), JBOD_OP_BLOCK(r.wide_op));
+		if (state != NULL)
+		{
+			state->holders &= ~client_bit(c);
+		}
+	}
+	else if (c->waiting)
+	{
+		c->next = r;
+		c->stalled = true;
+	}
+	else if (client_request(c, &r) == false)
+	{
+		client_close(c);
+	}
+}
+
+/* pushes an invalidation of the block client |c| waits to write, whose
+ * coherence state is |state|, to every client in |holders| */
+static void notify_holders(const client_t *c, const block_state_t *state, uint32_t holders) {
+	uint8_t packet[HEADER_LEN_V3];
+	jbod_lease_t lease = { state->version + 1, 0 };
+	uint16_t length = create_packet(packet, JBOD_PROTO_V3, JBOD_OP(JBOD_INVALIDATE, c->disk, c->block), 0,
+	                                &lease, NULL);
+	
+	for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+	{
+		if ((holders & client_bit(&clients[i])) && nwrite(clients[i].sd, length, packet) == false)
+		{
+			client_close(&clients[i]);
+		}
+	}
+}
+
+/* returns true if a write to the block client |c| waits to write arrived
+ * before its own */
+static bool write_ahead(const client_t *c) {
+	for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+	{
+		const client_t *other = &clients[i];
+		if (other->waiting && other->seq < c->seq && other->disk == c->disk && other->block == c->block)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/* lets through the waiting writes whose block no other client holds a lease
+ * on any more, in the order they arrived for each block, after pushing
+ * invalidations to the holders of the others. Returns how many milliseconds
+ * poll may wait before one of the leases they wait on runs out, or -1. */
+static int settle_writes(void) {
+	int timeout = -1;
+	bool progress = true;
+	
+	while (progress)
+	{
+		progress = false;
+		timeout = -1;
+		uint64_t now = now_ms();
+		for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+		{
+			client_t *c = &clients[i];
+			if (!c->waiting || write_ahead(c))
+			{
+				continue;
+			}
+			
+			// Wait for the holders of leases that have not run out to drop
+			// their copies
+			block_state_t *state = head_state(c);
+			uint32_t holders = (state != NULL && state->expiry_ms > now) ? state->holders & ~client_bit(c) : 0;
+			if (holders != 0)
+			{
+				if (!c->notified)
+				{
+					c->notified = true;
+					notify_holders(c, state, holders);
+					progress = true;
+				}
+				int wait = (int) (state->expiry_ms - now);
+				timeout = (timeout == -1 || wait < timeout) ? wait : timeout;
+				continue;
+			}
+			
+			// Then write, and take the request that waited behind the write
+			c->waiting = false;
+			if (client_serve(c, &c->request) == false ||
+			    (c->stalled && (c->stalled = false, client_request(c, &c->next) == false)))
+			{
+				client_close(c);
+			}
+			progress = true;
+		}
+	}
+	return timeout;
+}
+
+int jbod_server_run(uint16_t port) {
+	struct sockaddr_in saddr;
+	struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+	int slots[SERVER_MAX_CLIENTS + 1];
+	int enable = 1;
+	
+	// Create the listening socket
+	int sd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sd == -1)
+	{
+		warn("Failed to create a socket");
+		return -1;
+	}
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	
+	// Bind it to the requested port on every interface
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sd, (struct sockaddr *) &saddr, sizeof(saddr)) == -1 || listen(sd, SERVER_MAX_CLIENTS) == -1)
+	{
+		warn("Failed to listen on port %d", port);
+		close(sd);
+		return -1;
+	}
+	fprintf(stderr, "JBOD server listening on port %d...\n", port);
+	
+	for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+	{
+		clients[i].sd = -1;
+	}
+	
+	for (;;)
+	{
+		// Let through the writes no lease holds up any more, then wait for a
+		// packet from a client not stalled behind its write, or a new client
+		// while there is room for one, until a lease a write waits on runs out
+		int timeout = settle_writes();
+		int free_slot = -1, nfds = 1;
+		for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+		{
+			if (clients[i].sd == -1 && free_slot == -1)
+			{
+				free_slot = i;
+			}
+			else if (clients[i].sd != -1 && !clients[i].stalled)
+			{
+				fds[nfds].fd = clients[i].sd;
+				fds[nfds].events = POLLIN;
+				slots[nfds++] = i;
+			}
+		}
+		fds[0].fd = sd;
+		fds[0].events = (free_slot != -1) ? POLLIN : 0;
+		if (poll(fds, nfds, timeout) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		
+		// Accept a new client
+		if (fds[0].revents & POLLIN)
+		{
+			int cli = accept(sd, NULL, NULL);
+			if (cli != -1)
+			{
+				// Send every response as soon as it is ready: a client that
+				// pipelines its requests waits on responses Nagle would hold back
+				setsockopt(cli, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+				memset(&clients[free_slot], 0, sizeof(client_t));
+				clients[free_slot].sd = cli;
+			}
+		}
+		
+		// Handle one packet per ready client and drop closed connections
+		for (int i = 1; i < nfds; i++)
+		{
+			if (fds[i].revents != 0 && clients[slots[i]].sd == fds[i].fd)
+			{
+				client_receive(&clients[slots[i]]);
+			}
+		}
+	}
+	
+	warn("poll failed");
+	close(sd);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+  uint16_t port = JBOD_PORT;
+  uint32_t disks_in_array = JBOD_NUM_DISKS, blocks = JBOD_NUM_BLOCKS_PER_DISK, spares = 0;
+
+  while ((ch = getopt(argc, argv, SERVER_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'v':
+        enable_debug_log();
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'd':
+        disks_in_array = strtoul(optarg, NULL, 0);
+        break;
+      case 'b':
+        blocks = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        spares = strtoul(optarg, NULL, 0);
+        break;
+      case 'l':
+        jbod_server_set_lease(strtoul(optarg, NULL, 0));
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (jbod_server_set_geometry(disks_in_array, blocks, spares) == -1)
+    errx(1, "Invalid geometry: %u disks and %u spares of %u blocks", disks_in_array, spares, blocks);
+
+  return jbod_server_run(port) == -1 ? 1 : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stdint.h>
+
+#define SERVER_MAX_CLIENTS 16
+
+/* how long a v3 client may cache a block it read, by default */
+#define SERVER_LEASE_MS 1000
+
+/* Sets the geometry of the emulated array, followed by |spare_disks| spare
+ * disks that JBOD_GET_GEOMETRY reports separately. Must be called before the
+ * server starts; returns 1 on success and -1 on failure. */
+int jbod_server_set_geometry(uint32_t num_disks, uint32_t blocks_per_disk, uint32_t spare_disks);
+
+/* Sets how many milliseconds a v3 client may cache a block it read, 0 for
+ * not at all; a write to the block waits up to that long for the client to
+ * drop its copy. Returns 1. */
+int jbod_server_set_lease(uint32_t lease_ms);
+
+/* Executes a single JBOD operation, given in the 64-bit encoding of net.h,
+ * against the emulated array. Returns 0 on success and -1 on failure. */
+int jbod_server_operation(uint64_t op, uint8_t *block);
+
+/* Listens on |port| and serves clients until a fatal socket error occurs.
+ * Returns -1 on failure. */
+int jbod_server_run(uint16_t port);
+
+#endif
@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#include <inttypes.h>
 
 #include "cache.h"
 #include "jbod.h"
@@ -17,21 +18,44 @@
 #include "util.h"
 #include "tester.h"
 #include "net.h"
+#include "lfs.h"
+#include "qos.h"
 
-#define TESTER_ARGUMENTS "hw:s:"
+#define TESTER_ARGUMENTS "hxklcfmjw:s:a:p:r:t:z:q:"
 #define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size] \n"  \
+  "USAGE: test [-h] [-x] [-k] [-l] [-c] [-f] [-m] [-j] [-w workload-file] [-s cache_size] [-a ways] [-p policy] [-r cache-file] [-t l1_entries] [-z tier_bytes] [-q bytes_per_sec] \n"  \
   "\n"                                                      \
   "where:\n"                                                \
   "    -h - help mode (display this message)\n"             \
+  "    -x - use the extended (v2) protocol; needs the in-tree server\n" \
+  "    -k - use the coherent (v3) protocol, which keeps the cache valid while\n" \
+  "         other clients write the array; needs the in-tree server\n" \
+  "    -l - use the log-structured layout; its cleaner needs spare disks\n" \
+  "         worth an eighth of all disks (server -s, 3 for the traces)\n" \
+  "    -c - combine sub-block writes before sending them\n" \
+  "    -a - make the cache set-associative with this many ways per set\n" \
+  "    -p - cache eviction policy, lru (default) or arc\n" \
+  "    -f - only cache blocks the TinyLFU filter admits\n" \
+  "    -m - estimate the LRU miss ratio of every cache size from the lookups\n" \
+  "    -j - print the cache statistics as a line of JSON after the hit rate\n" \
+  "    -r - warm the cache from this file at the first mount, keeping the blocks\n" \
+  "         the server still holds, and save the cache to it at the end\n" \
+  "    -t - keep this many recently hit blocks in a per-thread L1 in front of the cache\n" \
+  "    -z - keep evicted blocks compressed in a second tier of this many bytes\n" \
+  "    -q - charge the workload to a QoS handle limited to this many bytes per\n" \
+  "         second (0 for no limit), and print its counters at the end\n" \
   "\n"                                                      \
 
-int run_workload(char *workload, int cache_size);
+int run_workload(char *workload, int cache_size, int cache_ways, int cache_policy, bool cache_tinylfu,
+                 bool cache_mrc, int cache_l1, size_t cache_tier, char *cache_file);
 
 int main(int argc, char *argv[])
 {
-  int ch, cache_size = 0;
-  char *workload = NULL;
+  int ch, cache_size = 0, cache_ways = 0, cache_policy = CACHE_POLICY_LRU, cache_l1 = 0;
+  size_t cache_tier = 0;
+  long long qos_rate = -1;
+  bool cache_tinylfu = false, cache_mrc = false, dump_stats = false, lfs_requested = false;
+  char *workload = NULL, *cache_file = NULL;
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
     switch (ch) {
@@ -41,9 +65,53 @@ int main(int argc, char *argv[])
       case 's':
         cache_size = atoi(optarg);
         break;
+      case 'a':
+        cache_ways = atoi(optarg);
+        break;
+      case 'f':
+        cache_tinylfu = true;
+        break;
+      case 'm':
+        cache_mrc = true;
+        break;
+      case 'j':
+        dump_stats = true;
+        break;
+      case 'p':
+        cache_policy = cache_policy_by_name(optarg);
+        if (cache_policy == -1) {
+          fprintf(stderr, "Unknown cache policy (%s), aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'r':
+        cache_file = optarg;
+        break;
+      case 't':
+        cache_l1 = atoi(optarg);
+        break;
+      case 'z':
+        cache_tier = strtoull(optarg, NULL, 10);
+        break;
+      case 'q':
+        qos_rate = strtoll(optarg, NULL, 10);
+        break;
       case 'w':
         workload = optarg;
         break;
+      case 'x':
+        jbod_set_protocol(JBOD_PROTO_V2);
+        break;
+      case 'k':
+        jbod_set_protocol(JBOD_PROTO_V3);
+        break;
+      case 'l':
+        mdadm_set_log_structured(1);
+        lfs_requested = true;
+        break;
+      case 'c':
+        mdadm_set_write_combining(16, 100);
+        break;
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
@@ -55,10 +123,35 @@ int main(int argc, char *argv[])
     return -1;
   }
 
+  // Blocks warmed from a file hold no lease, so nothing would drop them
+  if (cache_file && jbod_protocol() == JBOD_PROTO_V3) {
+    fprintf(stderr, "The cache file (-r) cannot be used with the coherent protocol (-k), aborting.\n");
+    return -1;
+  }
+
+  // The block map of the log-structured layout is private to this client
+  if (lfs_requested && jbod_protocol() == JBOD_PROTO_V3) {
+    fprintf(stderr, "The log-structured layout (-l) cannot be used with the coherent protocol (-k), aborting.\n");
+    return -1;
+  }
+
+  // Every request of the workload is admitted under the handle
+  if (qos_rate >= 0) {
+    int handle = qos_register("tester", 1, QOS_UNLIMITED, qos_rate);
+    if (handle == -1 || qos_set_handle(handle) != 1) {
+      fprintf(stderr, "Failed to register a QoS handle, aborting.\n");
+      return -1;
+    }
+  }
+
   if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
     return -1;
   
-  run_workload(workload, cache_size);
+  run_workload(workload, cache_size, cache_ways, cache_policy, cache_tinylfu, cache_mrc, cache_l1, cache_tier, cache_file);
+  if (dump_stats)
+    cache_dump_stats(stderr);
+  if (qos_rate >= 0)
+    qos_print_stats();
   jbod_disconnect();
 
   return 0;
@@ -68,22 +161,12 @@ int equals(const char *s1, const char *s2) {
   return strncmp(s1, s2, strlen(s2)) == 0;
 }
 
-static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
-  assert(cmd >= 0 && cmd < JBOD_NUM_CMDS);
-  assert(block_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK);
-
-  uint32_t op = 0;
-  op |= cmd << 26;
-  op |= disk_num << 22;
-  op |= block_num;
-
-  return op;
-}
-
-int run_workload(char *workload, int cache_size) {
+int run_workload(char *workload, int cache_size, int cache_ways, int cache_policy, bool cache_tinylfu,
+                 bool cache_mrc, int cache_l1, size_t cache_tier, char *cache_file) {
   char line[256], cmd[32];
   uint8_t buf[MAX_IO_SIZE];
-  uint32_t addr, len, ch;
+  uint64_t addr;
+  uint32_t len, ch;
   int rc;
 
   memset(buf, 0, MAX_IO_SIZE);
@@ -93,34 +176,49 @@ int run_workload(char *workload, int cache_size) {
     err(1, "Cannot open workload file %s", workload);
 
   if (cache_size) {
-    rc = cache_create(cache_size);
+    cache_config_t config = { .num_entries = cache_size, .ways = cache_ways, .policy = cache_policy,
+                              .tinylfu = cache_tinylfu, .mrc = cache_mrc, .l1_entries = cache_l1,
+                              .tier_bytes = cache_tier };
+    rc = cache_create_with(&config);
     if (rc != 1)
       errx(1, "Failed to create cache.");
   }
 
+  bool warm_up = cache_size && cache_file;
   int line_num = 0;
   while (fgets(line, 256, f)) {
     ++line_num;
     line[strlen(line)-1] = '\0';
     if (equals(line, "MOUNT")) {
       rc = mdadm_mount();
+      // Validation signs blocks on the server, so the saved cache can only be
+      // loaded once the array is mounted
+      if (rc == 1 && warm_up) {
+        int loaded = cache_load(cache_file, mdadm_blocks_current);
+        if (loaded >= 0)
+          fprintf(stderr, "Loaded %d cached blocks from %s\n", loaded, cache_file);
+        warm_up = false;
+      }
     } else if (equals(line, "UNMOUNT")) {
       rc = mdadm_unmount();
     } else if (equals(line, "SIGNALL")) {
+      mdadm_flush();
       for (int i = 0; i < JBOD_NUM_DISKS; ++i)
         for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j) {
           uint8_t b[JBOD_BLOCK_SIZE];
-          jbod_client_operation(encode_op(JBOD_SIGN_BLOCK, i, j), b);
-          fprintf(stdout, "%s", b);
+          if (mdadm_sign_block(i, j, b) == 1)
+            fprintf(stdout, "%s", b);
         }
     } else {
-      if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
+      if (sscanf(line, "%7s %20" SCNu64 " %4u %3u", cmd, &addr, &len, &ch) != 4)
         errx(1, "Failed to parse command: [%s\n], aborting.", line);
       if (equals(cmd, "READ")) {
         rc = mdadm_read(addr, len, buf);
       } else if (equals(cmd, "WRITE")) {
         memset(buf, ch, len);
         rc = mdadm_write(addr, len, buf);
+      } else if (equals(cmd, "FILL")) {
+        rc = mdadm_fill(addr, len, ch);
       } else {
         errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
       }
@@ -131,11 +229,16 @@ int run_workload(char *workload, int cache_size) {
   }
   fclose(f);
 
-  if (cache_size)
+  if (cache_size) {
+    if (cache_file && cache_save(cache_file) != 1)
+      warnx("Failed to save the cache to %s.", cache_file);
     cache_destroy();
+  }
 
   jbod_print_cost();
   cache_print_hit_rate();
+  if (lfs_enabled())
+    lfs_print_stats();
 
   return 0;
 }
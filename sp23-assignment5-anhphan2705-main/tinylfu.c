@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "tinylfu.h"
+
+/* odd multipliers deriving each row's column from the block hash */
+static const uint64_t row_seeds[TINYLFU_DEPTH] = {
+	0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+};
+
+/* returns the column of the block with hash |h| in row |row| */
+static uint32_t column(const tinylfu_t *sketch, uint64_t h, int row) {
+	return (h * row_seeds[row]) >> (64 - sketch->width_bits);
+}
+
+/* returns the word holding the counter at |col| of |row| */
+static uint64_t *counter_word(const tinylfu_t *sketch, int row, uint32_t col) {
+	return &sketch->counters[((size_t) row << sketch->width_bits >> 4) + (col >> 4)];
+}
+
+/* returns the 4-bit counter at |col| of |row| */
+static int counter_get(const tinylfu_t *sketch, int row, uint32_t col) {
+	return (__atomic_load_n(counter_word(sketch, row, col), __ATOMIC_RELAXED) >> ((col & 15) * 4)) & 15;
+}
+
+/* returns true if the doorkeeper has seen the block, setting its bits if
+ * |add| is set */
+static bool doorkeeper_check(const tinylfu_t *sketch, uint64_t h, bool add) {
+	bool seen = true;
+	int bits = sketch->width_bits + 2;
+
+	// Take three bit positions from different parts of the hash
+	for (int i = 0; i < 3; i++) {
+		uint64_t bit = (h * row_seeds[i + 1]) >> (64 - bits);
+		uint64_t mask = 1ULL << (bit & 63);
+		if (!(__atomic_load_n(&sketch->doorkeeper[bit >> 6], __ATOMIC_RELAXED) & mask)) {
+			seen = false;
+			if (add) {
+				__atomic_fetch_or(&sketch->doorkeeper[bit >> 6], mask, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	return seen;
+}
+
+/* halves every counter and clears the doorkeeper; increments racing with
+ * it may be lost */
+static void age(tinylfu_t *sketch) {
+	size_t words = (size_t) TINYLFU_DEPTH << sketch->width_bits >> 4;
+	for (size_t i = 0; i < words; i++) {
+		// Shift each counter down a bit, dropping the bit that crosses into its neighbour
+		uint64_t word = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+		__atomic_store_n(&sketch->counters[i], (word >> 1) & 0x7777777777777777ULL, __ATOMIC_RELAXED);
+	}
+	for (size_t i = 0; i < ((size_t) 1 << (sketch->width_bits + 2)) / 64; i++) {
+		__atomic_store_n(&sketch->doorkeeper[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+tinylfu_t *tinylfu_create(int num_entries) {
+	if (num_entries < 1) {
+		return NULL;
+	}
+	tinylfu_t *sketch = calloc(1, sizeof(tinylfu_t));
+	if (sketch == NULL) {
+		return NULL;
+	}
+
+	// One counter column per cached block, but at least a word's worth per row
+	sketch->width_bits = 4;
+	while ((1 << sketch->width_bits) < num_entries) {
+		sketch->width_bits++;
+	}
+	sketch->counters = calloc((size_t) TINYLFU_DEPTH << sketch->width_bits >> 4, sizeof(uint64_t));
+	sketch->doorkeeper = calloc(((size_t) 1 << (sketch->width_bits + 2)) / 64, sizeof(uint64_t));
+	if (sketch->counters == NULL || sketch->doorkeeper == NULL) {
+		tinylfu_destroy(sketch);
+		return NULL;
+	}
+	sketch->sample_size = TINYLFU_SAMPLE_FACTOR << sketch->width_bits;
+	return sketch;
+}
+
+void tinylfu_destroy(tinylfu_t *sketch) {
+	if (sketch == NULL) {
+		return;
+	}
+	free(sketch->counters);
+	free(sketch->doorkeeper);
+	free(sketch);
+}
+
+void tinylfu_record(tinylfu_t *sketch, uint64_t h) {
+	// The first access only goes to the doorkeeper
+	if (!doorkeeper_check(sketch, h, true)) {
+		return;
+	}
+
+	// Later ones increment the smallest counters (conservative update), each
+	// only if no other thread moved it on meanwhile
+	int min = tinylfu_estimate(sketch, h) - 1;
+	if (min < 15) {
+		for (int row = 0; row < TINYLFU_DEPTH; row++) {
+			uint32_t col = column(sketch, h, row);
+			uint64_t *word = counter_word(sketch, row, col);
+			int shift = (col & 15) * 4;
+			uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+			while ((int) ((old >> shift) & 15) == min &&
+			       !__atomic_compare_exchange_n(word, &old, old + (1ULL << shift), true, __ATOMIC_RELAXED,
+			                                    __ATOMIC_RELAXED))
+				;
+		}
+	}
+
+	// Age the sketch once it has taken a full sample; only the thread that
+	// completes the sample does it
+	uint32_t additions = __atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED);
+	if (additions == sketch->sample_size) {
+		age(sketch);
+		__atomic_store_n(&sketch->additions, 0, __ATOMIC_RELAXED);
+	}
+}
+
+int tinylfu_estimate(const tinylfu_t *sketch, uint64_t h) {
+	int min = 15;
+	for (int row = 0; row < TINYLFU_DEPTH; row++) {
+		int count = counter_get(sketch, row, column(sketch, h, row));
+		if (count < min) {
+			min = count;
+		}
+	}
+	return min + doorkeeper_check(sketch, h, false);
+}
+
+bool tinylfu_admit(const tinylfu_t *sketch, uint64_t candidate, uint64_t victim) {
+	return tinylfu_estimate(sketch, candidate) > tinylfu_estimate(sketch, victim);
+}
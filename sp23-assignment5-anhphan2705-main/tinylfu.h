@@ -0,0 +1,47 @@
+#ifndef TINYLFU_H_
+#define TINYLFU_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* TinyLFU frequency sketch (Einziger, Friedman and Manes, "TinyLFU: A Highly
+ * Efficient Cache Admission Policy"). A count-min sketch of 4-bit counters
+ * estimates how often each block was accessed recently; a doorkeeper Bloom
+ * filter absorbs the first access to a block so that one-off blocks never
+ * reach the counters. Once the sketch has seen TINYLFU_SAMPLE_FACTOR accesses
+ * per counter column every counter is halved and the doorkeeper cleared, so
+ * the estimates follow the recent workload. Blocks are identified by a 64-bit
+ * hash of their address. Each cache shard has a sketch of its own.
+ * tinylfu_record may be called by several threads at once without a lock;
+ * counters are updated atomically, but increments that race with aging may
+ * be lost, which only makes the estimates a little lower. */
+
+#define TINYLFU_DEPTH         4
+#define TINYLFU_SAMPLE_FACTOR 10
+
+typedef struct {
+  uint64_t *counters;   /* TINYLFU_DEPTH rows of 2^width_bits 4-bit counters */
+  uint64_t *doorkeeper; /* 2^(width_bits + 2) bits */
+  int width_bits;
+  uint32_t additions;
+  uint32_t sample_size;
+} tinylfu_t;
+
+/* Returns a sketch sized for a cache of |num_entries| blocks, or NULL on
+ * failure; it takes about 2.5 bytes per block. */
+tinylfu_t *tinylfu_create(int num_entries);
+
+/* Frees the sketch; NULL is ignored. */
+void tinylfu_destroy(tinylfu_t *sketch);
+
+/* Counts an access to the block with hash |h|. */
+void tinylfu_record(tinylfu_t *sketch, uint64_t h);
+
+/* Returns the estimated number of recent accesses to the block with hash |h|. */
+int tinylfu_estimate(const tinylfu_t *sketch, uint64_t h);
+
+/* Returns true if the block with hash |candidate| should replace the block
+ * with hash |victim|, that is, if it was accessed more often recently. */
+bool tinylfu_admit(const tinylfu_t *sketch, uint64_t candidate, uint64_t victim);
+
+#endif
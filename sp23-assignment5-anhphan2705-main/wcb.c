@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "wcb.h"
+
+static wcb_entry_t entries[WCB_MAX_ENTRIES];
+static int wcb_size = 0;
+static int wcb_timeout_ms = 0;
+
+/* returns a monotonic timestamp in milliseconds */
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int wcb_create(int num_entries, int timeout_ms) {
+	// Check that the size is valid and that nothing is left buffered
+	if (num_entries < 0 || num_entries > WCB_MAX_ENTRIES || timeout_ms < 0 || wcb_oldest() != NULL) {
+		return -1;
+	}
+
+	memset(entries, 0, sizeof(entries));
+	wcb_size = num_entries;
+	wcb_timeout_ms = timeout_ms;
+	return 1;
+}
+
+bool wcb_enabled(void) {
+	return wcb_size > 0;
+}
+
+wcb_entry_t *wcb_find(uint32_t disk_num, uint32_t block_num) {
+	for (int i = 0; i < wcb_size; i++) {
+		if (entries[i].valid && entries[i].disk_num == disk_num && entries[i].block_num == block_num) {
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+wcb_entry_t *wcb_alloc(uint32_t disk_num, uint32_t block_num) {
+	for (int i = 0; i < wcb_size; i++) {
+		if (!entries[i].valid) {
+			entries[i].valid = true;
+			entries[i].disk_num = disk_num;
+			entries[i].block_num = block_num;
+			memset(entries[i].dirty, 0, sizeof(entries[i].dirty));
+			entries[i].first_write_ms = now_ms();
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+wcb_entry_t *wcb_oldest(void) {
+	wcb_entry_t *oldest = NULL;
+
+	for (int i = 0; i < wcb_size; i++) {
+		if (entries[i].valid && (oldest == NULL || entries[i].first_write_ms < oldest->first_write_ms)) {
+			oldest = &entries[i];
+		}
+	}
+	return oldest;
+}
+
+wcb_entry_t *wcb_expired(void) {
+	wcb_entry_t *oldest = wcb_oldest();
+
+	if (oldest != NULL && now_ms() - oldest->first_write_ms >= (uint64_t) wcb_timeout_ms) {
+		return oldest;
+	}
+	return NULL;
+}
+
+bool wcb_merge(wcb_entry_t *entry, int offset, int len, const uint8_t *buf) {
+	bool complete = true;
+
+	memcpy(entry->block + offset, buf, len);
+
+	// Set the dirty bit of every byte in [offset, offset + len)
+	for (int i = offset; i < offset + len; i++) {
+		entry->dirty[i / 64] |= 1ULL << (i % 64);
+	}
+
+	for (int w = 0; w < WCB_MASK_WORDS; w++) {
+		complete = complete && entry->dirty[w] == UINT64_MAX;
+	}
+	return complete;
+}
+
+void wcb_overlay(const wcb_entry_t *entry, uint8_t *block) {
+	for (int i = 0; i < JBOD_BLOCK_SIZE; i++) {
+		if (entry->dirty[i / 64] & (1ULL << (i % 64))) {
+			block[i] = entry->block[i];
+		}
+	}
+}
+
+void wcb_release(wcb_entry_t *entry) {
+	entry->valid = false;
+}
@@ -0,0 +1,58 @@
+#ifndef WCB_H_
+#define WCB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* Write-combining buffer for sub-block writes. Each entry collects the bytes
+ * written to one block, with a bit per byte marking the ones that are dirty,
+ * so that a burst of small writes costs a single block write. This module
+ * only manages the entries; mdadm decides when to write them back. */
+
+#define WCB_MAX_ENTRIES     64
+#define WCB_MASK_WORDS      (JBOD_BLOCK_SIZE / 64)
+
+typedef struct {
+  bool valid;
+  uint32_t disk_num;
+  uint32_t block_num;
+  uint64_t dirty[WCB_MASK_WORDS];
+  uint64_t first_write_ms;
+  uint8_t block[JBOD_BLOCK_SIZE];
+} wcb_entry_t;
+
+/* Returns 1 on success and -1 on failure. Sets up |num_entries| buffers
+ * whose contents are due for write-back |timeout_ms| milliseconds after
+ * their first write; 0 entries turns write combining off. */
+int wcb_create(int num_entries, int timeout_ms);
+
+/* Returns true if write combining is on. */
+bool wcb_enabled(void);
+
+/* Returns the entry buffering |disk_num| and |block_num|, or NULL. */
+wcb_entry_t *wcb_find(uint32_t disk_num, uint32_t block_num);
+
+/* Returns a free entry for |disk_num| and |block_num|, or NULL if every
+ * entry is in use and one has to be written back first. */
+wcb_entry_t *wcb_alloc(uint32_t disk_num, uint32_t block_num);
+
+/* Returns the entry that has held dirty data the longest, or NULL if the
+ * buffer is empty. */
+wcb_entry_t *wcb_oldest(void);
+
+/* Returns an entry whose timeout has passed, or NULL. */
+wcb_entry_t *wcb_expired(void);
+
+/* Copies |len| bytes of |buf| to |offset| in the entry and marks them dirty.
+ * Returns true once every byte of the block is dirty. */
+bool wcb_merge(wcb_entry_t *entry, int offset, int len, const uint8_t *buf);
+
+/* Applies the dirty bytes of the entry on top of |block|. */
+void wcb_overlay(const wcb_entry_t *entry, uint8_t *block);
+
+/* Frees the entry after it was written back or overwritten. */
+void wcb_release(wcb_entry_t *entry);
+
+#endif
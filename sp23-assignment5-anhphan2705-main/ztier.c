@@ -0,0 +1,393 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ztier.h"
+
+/* the first byte of a compressed block says how the rest encodes it */
+#define KIND_UNIFORM 0  /* the byte every byte of the block holds */
+#define KIND_LZ      1  /* LZ sequences */
+#define KIND_RAW     2  /* the block itself */
+
+/* LZ sequences start with a token whose high nibble is the number of
+ * literals that follow it and whose low nibble is the length of the match
+ * after them less LZ_MIN_MATCH; a nibble of 15 goes on in extra bytes, added
+ * up until one is below 255. The match follows as a one-byte offset back
+ * from the end of the literals. The last sequence has literals only. */
+#define LZ_MIN_MATCH 3
+#define LZ_HASH_BITS 8
+
+/* the hash chains start with this many buckets, doubling as blocks come in */
+#define ZTIER_MIN_BUCKET_BITS 10
+
+struct ztier_block {
+	ztier_block_t *chain;
+	ztier_block_t *newer;
+	ztier_block_t *older;
+	uint64_t h;
+	int disk_num;
+	int block_num;
+	uint16_t size;
+	uint8_t data[];
+};
+
+/* returns the bytes of the tier's budget a block compressed to |size| bytes
+ * takes */
+static size_t block_cost(int size) {
+	return sizeof(ztier_block_t) + size;
+}
+
+/* returns the hash of the 3 bytes at |p| */
+static uint32_t lz_hash(const uint8_t *p) {
+	uint32_t v = p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16;
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* writes |length| past the 15 a nibble holds as extra bytes at |out| + |op|
+ * and returns the new |op|, or -1 if it would pass |limit| */
+static int lz_put_length(uint8_t *out, int op, int limit, int length) {
+	for (; length >= 255; length -= 255) {
+		if (op >= limit) {
+			return -1;
+		}
+		out[op++] = 255;
+	}
+	if (op >= limit) {
+		return -1;
+	}
+	out[op++] = length;
+	return op;
+}
+
+/* writes a sequence of the |num_literals| bytes at |literals| followed by a
+ * match of |match_length| bytes |offset| back, or none if |match_length| is
+ * 0, to |out| + |op|; returns the new |op|, or -1 if it would pass |limit| */
+static int lz_put_sequence(uint8_t *out, int op, int limit, const uint8_t *literals, int num_literals,
+                           int offset, int match_length) {
+	int match_code = match_length == 0 ? 0 : match_length - LZ_MIN_MATCH;
+	if (op >= limit) {
+		return -1;
+	}
+	out[op++] = (num_literals < 15 ? num_literals : 15) << 4 | (match_code < 15 ? match_code : 15);
+	if (num_literals >= 15 && (op = lz_put_length(out, op, limit, num_literals - 15)) == -1) {
+		return -1;
+	}
+	if (op + num_literals > limit) {
+		return -1;
+	}
+	memcpy(out + op, literals, num_literals);
+	op += num_literals;
+	if (match_length == 0) {
+		return op;
+	}
+	if (op >= limit) {
+		return -1;
+	}
+	out[op++] = offset;
+	if (match_code >= 15 && (op = lz_put_length(out, op, limit, match_code - 15)) == -1) {
+		return -1;
+	}
+	return op;
+}
+
+/* compresses |block| into at most |limit| bytes of |out| and returns the
+ * compressed size, or -1 if it does not fit */
+static int lz_compress(const uint8_t *block, uint8_t *out, int limit) {
+	int16_t last[1 << LZ_HASH_BITS];
+	memset(last, -1, sizeof(last));
+
+	// Greedily take the match at the last position with the same hash, if it
+	// is in reach of a one-byte offset
+	int ip = 0, anchor = 0, op = 0;
+	while (ip + LZ_MIN_MATCH <= JBOD_BLOCK_SIZE) {
+		uint32_t hv = lz_hash(block + ip);
+		int ref = last[hv];
+		last[hv] = ip;
+		if (ref < 0 || ip - ref > 255 || memcmp(block + ref, block + ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+		int length = LZ_MIN_MATCH;
+		while (ip + length < JBOD_BLOCK_SIZE && block[ref + length] == block[ip + length]) {
+			length++;
+		}
+		op = lz_put_sequence(out, op, limit, block + anchor, ip - anchor, ip - ref, length);
+		if (op == -1) {
+			return -1;
+		}
+		ip += length;
+		anchor = ip;
+	}
+	return lz_put_sequence(out, op, limit, block + anchor, JBOD_BLOCK_SIZE - anchor, 0, 0);
+}
+
+/* reads a length past the 15 a nibble holds from |in| at |*ip|, before
+ * |end|, and returns it, or -1 if it runs past |end| */
+static int lz_get_length(const uint8_t *in, int *ip, int end) {
+	int length = 0;
+	for (;;) {
+		if (*ip >= end) {
+			return -1;
+		}
+		uint8_t b = in[(*ip)++];
+		length += b;
+		if (b < 255) {
+			return length;
+		}
+	}
+}
+
+/* decompresses the |len| bytes of LZ sequences at |in| into |block| and
+ * returns 1, or -1 if they do not make up exactly one block */
+static int lz_decompress(const uint8_t *in, int len, uint8_t *block) {
+	int ip = 0, op = 0;
+	while (ip < len) {
+		uint8_t token = in[ip++];
+		int num_literals = token >> 4;
+		if (num_literals == 15) {
+			int extra = lz_get_length(in, &ip, len);
+			if (extra == -1) {
+				return -1;
+			}
+			num_literals += extra;
+		}
+		if (ip + num_literals > len || op + num_literals > JBOD_BLOCK_SIZE) {
+			return -1;
+		}
+		memcpy(block + op, in + ip, num_literals);
+		ip += num_literals;
+		op += num_literals;
+		if (ip == len) {
+			break;
+		}
+
+		// Copy the match a byte at a time, since it may overlap itself
+		int offset = in[ip++];
+		int length = token & 15;
+		if (length == 15) {
+			int extra = lz_get_length(in, &ip, len);
+			if (extra == -1) {
+				return -1;
+			}
+			length += extra;
+		}
+		length += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || op + length > JBOD_BLOCK_SIZE) {
+			return -1;
+		}
+		for (int i = 0; i < length; i++, op++) {
+			block[op] = block[op - offset];
+		}
+	}
+	return op == JBOD_BLOCK_SIZE ? 1 : -1;
+}
+
+int ztier_compress(const uint8_t *block, uint8_t *out) {
+	// A uniform block is its byte
+	int i = 1;
+	while (i < JBOD_BLOCK_SIZE && block[i] == block[0]) {
+		i++;
+	}
+	if (i == JBOD_BLOCK_SIZE) {
+		out[0] = KIND_UNIFORM;
+		out[1] = block[0];
+		return 2;
+	}
+
+	// Anything else is LZ compressed, or kept as it is if that is no smaller
+	int size = lz_compress(block, out + 1, JBOD_BLOCK_SIZE - 1);
+	if (size != -1) {
+		out[0] = KIND_LZ;
+		return 1 + size;
+	}
+	out[0] = KIND_RAW;
+	memcpy(out + 1, block, JBOD_BLOCK_SIZE);
+	return ZTIER_MAX_COMPRESSED;
+}
+
+int ztier_decompress(const uint8_t *in, int len, uint8_t *block) {
+	if (len < 1) {
+		return -1;
+	}
+	switch (in[0]) {
+		case KIND_UNIFORM:
+			if (len != 2) {
+				return -1;
+			}
+			memset(block, in[1], JBOD_BLOCK_SIZE);
+			return 1;
+		case KIND_LZ:
+			return lz_decompress(in + 1, len - 1, block);
+		case KIND_RAW:
+			if (len != ZTIER_MAX_COMPRESSED) {
+				return -1;
+			}
+			memcpy(block, in + 1, JBOD_BLOCK_SIZE);
+			return 1;
+		default:
+			return -1;
+	}
+}
+
+/* returns the hash chain of the block with hash |h| */
+static ztier_block_t **tier_bucket(ztier_t *tier, uint64_t h) {
+	return &tier->buckets[(h * 0x9e3779b97f4a7c15ULL) >> (64 - tier->bucket_bits)];
+}
+
+/* returns the link pointing to the stored block at |disk_num| and
+ * |block_num|, which points to NULL if there is none */
+static ztier_block_t **tier_find(ztier_t *tier, int disk_num, int block_num, uint64_t h) {
+	ztier_block_t **link = tier_bucket(tier, h);
+	while (*link != NULL && ((*link)->disk_num != disk_num || (*link)->block_num != block_num)) {
+		link = &(*link)->chain;
+	}
+	return link;
+}
+
+/* unlinks block |b|, which |link| points to, and frees it */
+static void tier_remove(ztier_t *tier, ztier_block_t **link, ztier_block_t *b) {
+	*link = b->chain;
+	if (b->newer != NULL) {
+		b->newer->older = b->older;
+	} else {
+		tier->newest = b->older;
+	}
+	if (b->older != NULL) {
+		b->older->newer = b->newer;
+	} else {
+		tier->oldest = b->newer;
+	}
+	tier->used -= block_cost(b->size);
+	tier->num_blocks--;
+	free(b);
+}
+
+/* doubles the hash chains once there are more blocks than chains; keeps
+ * the chains as they are if there is no memory for more */
+static void tier_grow(ztier_t *tier) {
+	if (tier->num_blocks <= ((uint64_t) 1 << tier->bucket_bits) || tier->bucket_bits >= 30) {
+		return;
+	}
+	int bits = tier->bucket_bits + 1;
+	ztier_block_t **buckets = calloc((size_t) 1 << bits, sizeof(ztier_block_t *));
+	if (buckets == NULL) {
+		return;
+	}
+	ztier_block_t **old = tier->buckets;
+	int old_bits = tier->bucket_bits;
+	tier->buckets = buckets;
+	tier->bucket_bits = bits;
+	for (size_t i = 0; i < (size_t) 1 << old_bits; i++) {
+		while (old[i] != NULL) {
+			ztier_block_t *b = old[i];
+			old[i] = b->chain;
+			ztier_block_t **bucket = tier_bucket(tier, b->h);
+			b->chain = *bucket;
+			*bucket = b;
+		}
+	}
+	free(old);
+}
+
+ztier_t *ztier_create(size_t budget) {
+	ztier_t *tier = calloc(1, sizeof(ztier_t));
+	if (tier == NULL) {
+		return NULL;
+	}
+	tier->bucket_bits = ZTIER_MIN_BUCKET_BITS;
+	tier->buckets = calloc((size_t) 1 << tier->bucket_bits, sizeof(ztier_block_t *));
+	if (tier->buckets == NULL) {
+		free(tier);
+		return NULL;
+	}
+	tier->budget = budget;
+	pthread_mutex_init(&tier->lock, NULL);
+	return tier;
+}
+
+void ztier_destroy(ztier_t *tier) {
+	if (tier == NULL) {
+		return;
+	}
+	while (tier->oldest != NULL) {
+		ztier_block_t *b = tier->oldest;
+		tier_remove(tier, tier_find(tier, b->disk_num, b->block_num, b->h), b);
+	}
+	free(tier->buckets);
+	pthread_mutex_destroy(&tier->lock);
+	free(tier);
+}
+
+void ztier_put(ztier_t *tier, int disk_num, int block_num, uint64_t h, const uint8_t *buf) {
+	// Compress before taking the lock
+	uint8_t packed[ZTIER_MAX_COMPRESSED];
+	int size = ztier_compress(buf, packed);
+	if (block_cost(size) > tier->budget) {
+		return;
+	}
+	ztier_block_t *b = malloc(block_cost(size));
+	if (b == NULL) {
+		return;
+	}
+	b->h = h;
+	b->disk_num = disk_num;
+	b->block_num = block_num;
+	b->size = size;
+	memcpy(b->data, packed, size);
+
+	// Replace any stored copy, then drop the oldest blocks until the new one fits
+	pthread_mutex_lock(&tier->lock);
+	ztier_block_t **link = tier_find(tier, disk_num, block_num, h);
+	if (*link != NULL) {
+		tier_remove(tier, link, *link);
+	}
+	while (tier->used + block_cost(size) > tier->budget) {
+		ztier_block_t *old = tier->oldest;
+		tier_remove(tier, tier_find(tier, old->disk_num, old->block_num, old->h), old);
+	}
+	link = tier_bucket(tier, h);
+	b->chain = *link;
+	*link = b;
+	b->newer = NULL;
+	b->older = tier->newest;
+	if (tier->newest != NULL) {
+		tier->newest->newer = b;
+	} else {
+		tier->oldest = b;
+	}
+	tier->newest = b;
+	tier->used += block_cost(size);
+	tier->num_blocks++;
+	tier_grow(tier);
+	pthread_mutex_unlock(&tier->lock);
+}
+
+bool ztier_take(ztier_t *tier, int disk_num, int block_num, uint64_t h, uint8_t *buf) {
+	pthread_mutex_lock(&tier->lock);
+	ztier_block_t **link = tier_find(tier, disk_num, block_num, h);
+	ztier_block_t *b = *link;
+	bool found = b != NULL && ztier_decompress(b->data, b->size, buf) == 1;
+	if (b != NULL) {
+		tier_remove(tier, link, b);
+	}
+	pthread_mutex_unlock(&tier->lock);
+	return found;
+}
+
+void ztier_update(ztier_t *tier, int disk_num, int block_num, uint64_t h, const uint8_t *buf) {
+	pthread_mutex_lock(&tier->lock);
+	bool stored = *tier_find(tier, disk_num, block_num, h) != NULL;
+	pthread_mutex_unlock(&tier->lock);
+	if (stored) {
+		ztier_put(tier, disk_num, block_num, h, buf);
+	}
+}
+
+uint64_t ztier_usage(ztier_t *tier, size_t *used) {
+	pthread_mutex_lock(&tier->lock);
+	uint64_t num_blocks = tier->num_blocks;
+	*used = tier->used;
+	pthread_mutex_unlock(&tier->lock);
+	return num_blocks;
+}
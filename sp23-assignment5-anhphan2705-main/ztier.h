@@ -0,0 +1,70 @@
+#ifndef ZTIER_H_
+#define ZTIER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* Compressed second tier of the block cache. Blocks evicted from the cache
+ * are kept here compressed, within a budget of bytes, and taken back out
+ * when the cache misses on them. A block whose bytes are all the same is
+ * stored as that one byte, a run-length code of a single run; any other
+ * block goes through a small LZ77 codec in the style of LZ4, with one-byte
+ * offsets since a block is only JBOD_BLOCK_SIZE bytes long, and is stored
+ * as it is if that does not make it smaller. The budget counts the
+ * bookkeeping of every stored block along with its compressed bytes, and
+ * the blocks stored longest ago are dropped to stay within it. Blocks are
+ * identified by their address along with a 64-bit hash of it. The tier has
+ * a lock of its own; the cache takes it while holding a shard lock, never
+ * the other way round. */
+
+/* the most bytes a block compresses to: a kind byte and the block */
+#define ZTIER_MAX_COMPRESSED (1 + JBOD_BLOCK_SIZE)
+
+typedef struct ztier_block ztier_block_t;
+
+typedef struct {
+  ztier_block_t **buckets;  /* hash chains, 2^bucket_bits of them */
+  int bucket_bits;
+  ztier_block_t *newest;    /* storage order, the oldest dropped first */
+  ztier_block_t *oldest;
+  size_t budget;
+  size_t used;              /* compressed bytes and bookkeeping */
+  uint64_t num_blocks;
+  pthread_mutex_t lock;
+} ztier_t;
+
+/* Returns an empty tier that holds up to |budget| bytes, or NULL on failure. */
+ztier_t *ztier_create(size_t budget);
+
+/* Frees the tier and its blocks; NULL is ignored. */
+void ztier_destroy(ztier_t *tier);
+
+/* Stores the block at |disk_num| and |block_num|, with hash |h|, holding
+ * |buf|, in place of any copy already stored. A block that does not fit the
+ * budget even in an empty tier is not stored. */
+void ztier_put(ztier_t *tier, int disk_num, int block_num, uint64_t h, const uint8_t *buf);
+
+/* Returns true and copies the block at |disk_num| and |block_num| to |buf|,
+ * removing it from the tier, if it is stored; false otherwise. */
+bool ztier_take(ztier_t *tier, int disk_num, int block_num, uint64_t h, uint8_t *buf);
+
+/* Replaces the stored copy of the block at |disk_num| and |block_num| with
+ * |buf| if there is one. */
+void ztier_update(ztier_t *tier, int disk_num, int block_num, uint64_t h, const uint8_t *buf);
+
+/* Returns the number of blocks stored, and in |used| the bytes they take. */
+uint64_t ztier_usage(ztier_t *tier, size_t *used);
+
+/* Compresses |block| into |out|, which must have room for
+ * ZTIER_MAX_COMPRESSED bytes, and returns the compressed size. */
+int ztier_compress(const uint8_t *block, uint8_t *out);
+
+/* Returns 1 on success and -1 if |in| is not a compressed block.
+ * Decompresses the |len| bytes at |in| into |block|. */
+int ztier_decompress(const uint8_t *in, int len, uint8_t *block);
+
+#endif